@@ -0,0 +1,140 @@
+#ifndef FD_READER_H
+#define FD_READER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+
+/**
+ * Reads everything from a file descriptor and hands it to a hash's update function, shared by the hash functions
+ * The file is never held in memory all at once, one thread reads the next chunk while the calling thread hashes the previous one
+ */
+
+
+/****************
+*** CONSTANTS ***
+****************/
+#define READ_CHUNK_SIZE (1 << 20) // Files are read 1 MiB at a time
+
+
+/*******************
+*** FILE READING ***
+*******************/
+/**
+ * Double buffer shared between the thread reading a file and the thread hashing it
+ * While one buffer is being hashed the other is being filled, so reading and hashing overlap
+ */
+typedef struct {
+    int fd; // The file (or pipe) being read
+    uint8_t *buffers[2]; // Page-aligned READ_CHUNK_SIZE buffers
+    ssize_t lens[2]; // How much of each buffer holds data (0 at the end of the file, -1 if the read failed)
+    int full[2]; // Whether each buffer is waiting to be hashed (1) or waiting to be filled (0)
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} fd_reader;
+
+/**
+ * Reader thread, fills the two buffers in turn until the end of the file is reached
+ * @param arg the fd_reader shared with the hashing thread
+ * @returns NULL
+ */
+void* fd_reader_thread(void *arg) {
+    fd_reader *reader = arg;
+
+    for (int i = 0; ; i ^= 1) {
+        // Wait for the hashing thread to be done with this buffer
+        pthread_mutex_lock(&reader->lock);
+        while (reader->full[i]) {
+            pthread_cond_wait(&reader->changed, &reader->lock);
+        }
+        pthread_mutex_unlock(&reader->lock);
+
+        // Fill the whole buffer (reads from pipes can come back short)
+        ssize_t len = 0;
+        while (len < READ_CHUNK_SIZE) {
+            ssize_t got = read(reader->fd, reader->buffers[i] + len, READ_CHUNK_SIZE - len);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got < 0) {
+                len = -1;
+                break;
+            }
+            if (got == 0) {
+                break;
+            }
+            len += got;
+        }
+
+        // Hand the buffer over to the hashing thread
+        pthread_mutex_lock(&reader->lock);
+        reader->lens[i] = len;
+        reader->full[i] = 1;
+        pthread_cond_broadcast(&reader->changed);
+        pthread_mutex_unlock(&reader->lock);
+
+        if (len <= 0) {
+            return NULL;
+        }
+    }
+}
+
+/**
+ * Reads a file descriptor (a file, pipe, socket, etc.) until the end, handing each chunk to an update function as it arrives
+ * @param fd the file descriptor to read until the end
+ * @param update the hash's update function, called with ctx and each chunk of the file in order
+ * @param ctx the context of the running hash, passed to update
+ * @returns 0 on success, or -1 if the file could not be read
+ */
+int fd_read_all(int fd, void (*update)(void *ctx, const uint8_t *data, size_t len), void *ctx) {
+    fd_reader reader = {.fd = fd};
+    if (posix_memalign((void**)&reader.buffers[0], 4096, READ_CHUNK_SIZE) != 0) {
+        return -1;
+    }
+    if (posix_memalign((void**)&reader.buffers[1], 4096, READ_CHUNK_SIZE) != 0) {
+        free(reader.buffers[0]);
+        return -1;
+    }
+    pthread_mutex_init(&reader.lock, NULL);
+    pthread_cond_init(&reader.changed, NULL);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL); // Only a hint, so failure (e.g. on a pipe) does not matter
+
+    pthread_t thread;
+    int result = -1;
+    if (pthread_create(&thread, NULL, fd_reader_thread, &reader) == 0) {
+        for (int i = 0; ; i ^= 1) {
+            // Wait for the reader thread to fill this buffer
+            pthread_mutex_lock(&reader.lock);
+            while (!reader.full[i]) {
+                pthread_cond_wait(&reader.changed, &reader.lock);
+            }
+            ssize_t len = reader.lens[i];
+            pthread_mutex_unlock(&reader.lock);
+
+            if (len <= 0) {
+                result = (len == 0) ? 0 : -1;
+                break;
+            }
+            update(ctx, reader.buffers[i], len);
+
+            // Hand the buffer back to the reader thread
+            pthread_mutex_lock(&reader.lock);
+            reader.full[i] = 0;
+            pthread_cond_broadcast(&reader.changed);
+            pthread_mutex_unlock(&reader.lock);
+        }
+        pthread_join(thread, NULL);
+    }
+
+    pthread_mutex_destroy(&reader.lock);
+    pthread_cond_destroy(&reader.changed);
+    free(reader.buffers[0]);
+    free(reader.buffers[1]);
+    return result;
+}
+
+#endif
@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+
+/**
+ * KangarooTwelve (KT128, RFC 9861), a tree hash built on the same Keccak permutation as SHA-3, but with 12 rounds instead of 24
+ * The message is split into 8 KiB chunks, every chunk after the first is hashed on its own into a 32-byte chaining value,
+ * and the first chunk and the chaining values are hashed together into the final output
+ * Since the chunks are independent, they are hashed several at a time with the multi-buffer permutation, and on every core
+ */
+
+
+/*******************
+*** SHA-3 SPONGE ***
+*******************/
+#define main sha3_main
+#include "sha3.c"
+#undef main
+
+
+/****************
+*** CONSTANTS ***
+****************/
+#define K12_CHUNK_SIZE 8192
+#define K12_CV_SIZE 32 // The size of the chaining value of each leaf (in BYTES)
+#define K12_ROUNDS 12
+#define TURBOSHAKE128_RATE (1344/8) // The same rate as SHAKE128
+
+// The domain separation bytes of each kind of node (with the first bit of the padding, like the SHA-3 suffixes)
+#define K12_SINGLE_NODE 0x07 // A message that fits in one chunk
+#define K12_LEAF_NODE 0x0B // Every chunk after the first
+#define K12_FINAL_NODE 0x06 // The first chunk, followed by the chaining values of the rest
+
+#define K12_BATCH_CHUNKS 32 // How many chunks a worker takes at a time
+
+
+/********************
+*** TURBOSHAKE128 ***
+********************/
+/**
+ * Performs Keccak-p[1600, 12], the last 12 rounds of Keccak-f
+ * @param state (IN/OUT) the state to permute
+ */
+void keccak_p12(uint64_t state[5][5]) {
+    keccak_p(state, K12_ROUNDS);
+}
+
+// TurboSHAKE128 is SHAKE128 with keccak_p12 instead of keccak_f, and a domain byte chosen by the caller
+DEFINE_SPONGE(turboshake128, TURBOSHAKE128_RATE, ctx->suffix, keccak_p12)
+
+/**
+ * Starts a new TurboSHAKE128 computation
+ * @param ctx (OUTPUT) the context to initialize
+ * @param domain the domain separation byte (0x01 to 0x7F)
+ */
+void turboshake128_init(keccak_ctx *ctx, uint8_t domain) {
+    memset(ctx->state, 0, sizeof(ctx->state));
+    ctx->offset = 0;
+    ctx->squeezing = 0;
+    ctx->rate = TURBOSHAKE128_RATE;
+    ctx->suffix = domain;
+    ctx->output_len = 0;
+}
+
+/**
+ * Performs the TurboSHAKE128 extendable output function
+ * @param msg the message (may contain any bytes, including 0s)
+ * @param len the length of msg in BYTES
+ * @param domain the domain separation byte (0x01 to 0x7F)
+ * @param output (OUTPUT) where the output will be put
+ * @param output_len how many bytes of output to produce
+ */
+void turboshake128(const uint8_t *msg, size_t len, uint8_t domain, uint8_t *output, size_t output_len) {
+    keccak_ctx ctx;
+    turboshake128_init(&ctx, domain);
+    turboshake128_update(&ctx, msg, len);
+    turboshake128_squeeze(&ctx, output, output_len);
+}
+
+
+/*******************
+*** LEAF HASHING ***
+*******************/
+#ifdef HAVE_X86_INTRINSICS
+DEFINE_KECCAK_F_LANES(keccak_p12_x4_avx2, 4, v4u64, "avx2", K12_ROUNDS)
+DEFINE_KECCAK_F_LANES(keccak_p12_x8_avx512, 8, v8u64, "avx512f", K12_ROUNDS)
+
+/**
+ * Picks the widest multi-buffer Keccak-p[1600, 12] the processor supports
+ * @param permute_lanes (OUTPUT) the multi-buffer permutation to use
+ * @returns the number of states permute_lanes works on, or 1 if multi-buffer hashing should not be used
+ */
+int select_keccak_p12_lanes(void (**permute_lanes)(uint64_t *states)) {
+    void (*permute_f)(uint64_t *states);
+    int num_lanes = select_keccak_f_lanes(&permute_f); // Only used for the CPU check, which it has already cached
+    *permute_lanes = (num_lanes == 8) ? keccak_p12_x8_avx512 : keccak_p12_x4_avx2;
+    return num_lanes;
+}
+#endif
+
+/**
+ * Hashes leaf chunks into their chaining values (TurboSHAKE128 with the leaf domain byte), several at a time when possible
+ * @param chunks the chunks to hash
+ * @param lens the length of each chunk in BYTES
+ * @param num_chunks the number of chunks
+ * @param cvs (OUTPUT) the K12_CV_SIZE byte chaining value of each chunk, one after another
+ */
+void k12_hash_leaves(const uint8_t **chunks, const size_t *lens, size_t num_chunks, uint8_t *cvs) {
+#ifdef HAVE_X86_INTRINSICS
+    void (*permute_lanes)(uint64_t *states);
+    int num_lanes = select_keccak_p12_lanes(&permute_lanes);
+    if (num_lanes > 1) {
+        keccak_batch_lanes(chunks, lens, num_chunks, TURBOSHAKE128_RATE, K12_LEAF_NODE, cvs, K12_CV_SIZE,
+                           num_lanes, permute_lanes, keccak_p12);
+        return;
+    }
+#endif
+
+    for (size_t i = 0; i < num_chunks; i++) {
+        turboshake128(chunks[i], lens[i], K12_LEAF_NODE, cvs + i*K12_CV_SIZE, K12_CV_SIZE);
+    }
+}
+
+
+/**********************
+*** KANGAROOTWELVE ***
+**********************/
+/**
+ * The input to the tree, S = msg || custom || length_encode(custom_len), split into chunks without copying msg
+ * Only the chunks that are not entirely inside msg are copied, into tail (so every chunk is contiguous in memory)
+ */
+typedef struct {
+    const uint8_t *msg;
+    size_t tail_start; // Where tail starts in S (a multiple of K12_CHUNK_SIZE, no more than the length of msg)
+    uint8_t *tail; // S from tail_start onwards
+    size_t total_len; // The length of S
+    size_t num_chunks;
+} k12_tree;
+
+/**
+ * Work shared between the threads hashing the leaves, each takes the next K12_BATCH_CHUNKS chunks until none are left
+ */
+typedef struct {
+    const k12_tree *tree;
+    uint8_t *cvs; // The chaining value of chunk i (i >= 1) goes at cvs + (i - 1)*K12_CV_SIZE
+    atomic_size_t next_chunk;
+} k12_leaf_work;
+
+/**
+ * Encodes a length as its big endian bytes (without leading 0 bytes), followed by the number of those bytes
+ * @param x the length to encode
+ * @param encoded (OUTPUT) at least 9 bytes where the encoding will be put
+ * @returns the number of bytes in the encoding
+ */
+int length_encode(size_t x, uint8_t *encoded) {
+    int num_bytes = 0;
+    for (size_t y = x; y > 0; y >>= 8) {
+        num_bytes++;
+    }
+    for (int i = 0; i < num_bytes; i++) {
+        encoded[i] = (uint8_t)(x >> 8*(num_bytes - 1 - i));
+    }
+    encoded[num_bytes] = (uint8_t)num_bytes;
+    return num_bytes + 1;
+}
+
+/**
+ * Finds one of the chunks of S
+ * @param tree the input to the tree
+ * @param i the index of the chunk
+ * @param len (OUTPUT) the length of the chunk in BYTES
+ * @returns the start of the chunk
+ */
+const uint8_t* k12_chunk(const k12_tree *tree, size_t i, size_t *len) {
+    size_t start = i * K12_CHUNK_SIZE;
+    *len = (tree->total_len - start < K12_CHUNK_SIZE) ? tree->total_len - start : K12_CHUNK_SIZE;
+    return (start < tree->tail_start) ? tree->msg + start : tree->tail + (start - tree->tail_start);
+}
+
+/**
+ * Worker thread, hashes batches of leaf chunks until every leaf has been taken
+ * @param arg the k12_leaf_work shared by the workers
+ * @returns NULL
+ */
+void* k12_worker_thread(void *arg) {
+    k12_leaf_work *work = arg;
+    const uint8_t *chunks[K12_BATCH_CHUNKS];
+    size_t lens[K12_BATCH_CHUNKS];
+
+    while (1) {
+        size_t first = atomic_fetch_add(&work->next_chunk, K12_BATCH_CHUNKS);
+        if (first >= work->tree->num_chunks) {
+            return NULL;
+        }
+        size_t count = (work->tree->num_chunks - first < K12_BATCH_CHUNKS) ? work->tree->num_chunks - first : K12_BATCH_CHUNKS;
+        for (size_t i = 0; i < count; i++) {
+            chunks[i] = k12_chunk(work->tree, first + i, &lens[i]);
+        }
+        k12_hash_leaves(chunks, lens, count, work->cvs + (first - 1)*K12_CV_SIZE);
+    }
+}
+
+/**
+ * Performs the KangarooTwelve (KT128) extendable output function
+ * @param msg the message (may contain any bytes, including 0s)
+ * @param len the length of msg in BYTES
+ * @param custom the customization string (may be empty)
+ * @param custom_len the length of custom in BYTES
+ * @param output (OUTPUT) where the output will be put
+ * @param output_len how many bytes of output to produce
+ * @param num_threads how many threads to hash the leaves on (including this one), or 0 for one per processor
+ * @returns 0 on success, or -1 if memory could not be allocated
+ */
+int kangarootwelve(const uint8_t *msg, size_t len, const uint8_t *custom, size_t custom_len,
+                   uint8_t *output, size_t output_len, int num_threads) {
+    // Copy out everything from the last chunk boundary inside msg onwards, and append the customization string to it
+    uint8_t encoded_len[9];
+    int encoded_len_len = length_encode(custom_len, encoded_len);
+    k12_tree tree = {.msg = msg, .tail_start = (len / K12_CHUNK_SIZE) * K12_CHUNK_SIZE};
+    tree.total_len = len + custom_len + encoded_len_len;
+    tree.num_chunks = (tree.total_len + K12_CHUNK_SIZE - 1) / K12_CHUNK_SIZE;
+    tree.tail = malloc(tree.total_len - tree.tail_start);
+    if (tree.tail == NULL) {
+        return -1;
+    }
+    memcpy(tree.tail, msg + tree.tail_start, len - tree.tail_start);
+    memcpy(tree.tail + (len - tree.tail_start), custom, custom_len);
+    memcpy(tree.tail + (len - tree.tail_start) + custom_len, encoded_len, encoded_len_len);
+
+    // A single chunk is just hashed by itself
+    size_t first_len;
+    const uint8_t *first_chunk = k12_chunk(&tree, 0, &first_len);
+    if (tree.num_chunks == 1) {
+        turboshake128(first_chunk, first_len, K12_SINGLE_NODE, output, output_len);
+        free(tree.tail);
+        return 0;
+    }
+
+    // Hash the leaves (every chunk but the first), with this thread working alongside any extra threads
+    k12_leaf_work work = {.tree = &tree};
+    atomic_init(&work.next_chunk, 1);
+    work.cvs = malloc((tree.num_chunks - 1) * K12_CV_SIZE);
+    if (work.cvs == NULL) {
+        free(tree.tail);
+        return -1;
+    }
+
+    if (num_threads <= 0) {
+        num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    size_t num_batches = (tree.num_chunks - 1 + K12_BATCH_CHUNKS - 1) / K12_BATCH_CHUNKS;
+    if ((size_t)num_threads > num_batches) {
+        num_threads = num_batches; // There is no point in threads that would never get a batch
+    }
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    int num_started = 0;
+    for (int i = 1; threads != NULL && i < num_threads; i++) {
+        if (pthread_create(&threads[num_started], NULL, k12_worker_thread, &work) != 0) {
+            break; // Whatever the threads that did start leave behind is hashed by this one
+        }
+        num_started++;
+    }
+    k12_worker_thread(&work);
+    for (int i = 0; i < num_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    // The final node: the first chunk, then a marker (and padding to a whole lane), then the chaining values
+    uint8_t marker[8] = {0x03};
+    uint8_t encoded_num_cvs[9];
+    int encoded_num_cvs_len = length_encode(tree.num_chunks - 1, encoded_num_cvs);
+    uint8_t terminator[2] = {0xFF, 0xFF};
+
+    keccak_ctx ctx;
+    turboshake128_init(&ctx, K12_FINAL_NODE);
+    turboshake128_update(&ctx, first_chunk, first_len);
+    turboshake128_update(&ctx, marker, sizeof(marker));
+    turboshake128_update(&ctx, work.cvs, (tree.num_chunks - 1) * K12_CV_SIZE);
+    turboshake128_update(&ctx, encoded_num_cvs, encoded_num_cvs_len);
+    turboshake128_update(&ctx, terminator, sizeof(terminator));
+    turboshake128_squeeze(&ctx, output, output_len);
+
+    free(work.cvs);
+    free(tree.tail);
+    return 0;
+}
+
+
+/**************
+*** TESTING ***
+**************/
+/**
+ * Fills a buffer with the test pattern used by the RFC 9861 examples (0x00, 0x01, ..., 0xFA, repeated)
+ * @param buffer (OUTPUT) the buffer to fill
+ * @param len the length of the buffer in BYTES
+ */
+void fill_pattern(uint8_t *buffer, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        buffer[i] = i % 251;
+    }
+}
+
+/**
+ * Checks an output against its expected value, printing an error if they differ
+ * @param output the output to check
+ * @param expected the expected output, in hex
+ * @param what a description of the output for the error message
+ */
+void check_output(const uint8_t *output, const char *expected, const char *what) {
+    char hex[2*K12_CV_SIZE + 1];
+    for (int i = 0; i < K12_CV_SIZE; i++) {
+        sprintf(&hex[2*i], "%02x", output[i]);
+    }
+    if (strcmp(hex, expected) != 0) {
+        printf("ERROR: %s is NOT correct!\n", what);
+    }
+}
+
+// Test examples: https://www.rfc-editor.org/rfc/rfc9861 (Section 5)
+int main(int argc, char **argv) {
+    uint8_t output[K12_CV_SIZE];
+
+    // Sanity check TurboSHAKE128 by itself
+    turboshake128(NULL, 0, 0x1F, output, K12_CV_SIZE);
+    check_output(output, "1e415f1c5983aff2169217277d17bb538cd945a397ddec541f1ce41af2c1b74c", "TurboSHAKE128 of the empty message");
+
+    // Messages of 17^k bytes of the test pattern, from a single chunk up to many chunks
+    const char *msg_expected[6] = {
+        "2bda92450e8b147f8a7cb629e784a058efca7cf7d8218e02d345dfaa65244a1f",
+        "6bf75fa2239198db4772e36478f8e19b0f371205f6a9a93a273f51df37122888",
+        "0c315ebcdedbf61426de7dcf8fb725d1e74675d7f5327a5067f367b108ecb67c",
+        "cb552e2ec77d9910701d578b457ddf772c12e322e4ee7fe417f92c758f0d59d0",
+        "8701045e22205345ff4dda05555cbb5c3af1a771c2b89baef37db43d9998b9fe",
+        "844d610933b1b9963cbdeb5ae3b6b05cc7cbd67ceedf883eb678a0a8e0371682"
+    };
+    uint8_t *pattern = malloc(1419857); // 17^5
+    fill_pattern(pattern, 1419857);
+    for (int k = 0, len = 1; k < 6; k++, len *= 17) {
+        char what[64];
+        sprintf(what, "KT128 of %d bytes", len);
+        kangarootwelve(pattern, len, NULL, 0, output, K12_CV_SIZE, 0);
+        check_output(output, msg_expected[k], what);
+        kangarootwelve(pattern, len, NULL, 0, output, K12_CV_SIZE, 1);
+        check_output(output, msg_expected[k], what);
+    }
+
+    // Customization strings of 41^k bytes of the test pattern, with messages of 2^k - 1 bytes of 0xFF
+    const char *custom_expected[4] = {
+        "fab658db63e94a246188bf7af69a133045f46ee984c56e3c3328caaf1aa1a583",
+        "d848c5068ced736f4462159b9867fd4c20b808acc3d5bc48e0b06ba0a3762ec4",
+        "c389e5009ae57120854c2e8c64670ac01358cf4c1baf89447a724234dc7ced74",
+        "75d2f86a2e644566726b4fbcfc5657b9dbcf070c7b0dca06450ab291d7443bcf"
+    };
+    uint8_t ones[7];
+    memset(ones, 0xFF, sizeof(ones));
+    for (int k = 0, custom_len = 1; k < 4; k++, custom_len *= 41) {
+        char what[64];
+        sprintf(what, "KT128 with a %d byte customization string", custom_len);
+        kangarootwelve(ones, (1 << k) - 1, pattern, custom_len, output, K12_CV_SIZE, 0);
+        check_output(output, custom_expected[k], what);
+    }
+    free(pattern);
+
+    // Compare the speed of SHA3-256 with KangarooTwelve on one thread and on every processor when run as "./kangarootwelve benchmark"
+    if (argc > 1 && strcmp(argv[1], "benchmark") == 0) {
+        size_t bench_len = 256 << 20;
+        uint8_t *bench_data = malloc(bench_len);
+        memset(bench_data, 0xA5, bench_len);
+        int num_processors = sysconf(_SC_NPROCESSORS_ONLN);
+
+        for (int run = 0; run < 3; run++) {
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            if (run == 0) {
+                free(sha3(bench_data, bench_len));
+            }
+            else {
+                kangarootwelve(bench_data, bench_len, NULL, 0, output, K12_CV_SIZE, (run == 1) ? 1 : num_processors);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+
+            double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+            const char *names[3] = {"SHA3-256", "KT128 (1 thread)", "KT128 (all threads)"};
+            printf("%-20s %8.1f MB/s\n", names[run], bench_len / seconds / 1e6);
+        }
+        free(bench_data);
+    }
+
+    return 0;
+}
@@ -0,0 +1,310 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+
+/**
+ * cSHAKE and KMAC (NIST SP 800-185), the customizable version of SHAKE and the MAC built on top of it
+ * Both start by absorbing a few whole blocks that only depend on the function name, customization string and (for KMAC) the key
+ * Those blocks are absorbed once into a template context, which is then copied for every message,
+ * so each MAC only costs absorbing the message itself and the final permutation(s) that squeeze out the output
+ */
+
+
+/*******************
+*** SHA-3 SPONGE ***
+*******************/
+#define main sha3_main
+#include "sha3.c"
+#undef main
+
+
+/****************
+*** CONSTANTS ***
+****************/
+// cSHAKE is SHAKE with 00 instead of 1111 as the domain bits (0x04 rather than 0x1F once the first bit of the padding is added)
+#define CSHAKE_SUFFIX 0x04
+
+#define MAX_ENCODE_BYTES 9 // The longest left_encode or right_encode of a size_t (8 bytes and the length byte)
+
+
+/****************
+*** ENCODING ***
+****************/
+/**
+ * Finds how many bytes are needed for the big endian encoding of a value (at least 1, even for 0)
+ * @param x the value to encode
+ * @returns the number of bytes
+ */
+int encode_num_bytes(uint64_t x) {
+    int num_bytes = 1;
+    while (num_bytes < 8 && (x >> 8*num_bytes) != 0) {
+        num_bytes++;
+    }
+    return num_bytes;
+}
+
+/**
+ * Encodes a value as the number of bytes in its encoding, followed by its big endian bytes
+ * @param x the value to encode
+ * @param encoded (OUTPUT) at least MAX_ENCODE_BYTES bytes where the encoding will be put
+ * @returns the number of bytes in the encoding
+ */
+int left_encode(uint64_t x, uint8_t *encoded) {
+    int num_bytes = encode_num_bytes(x);
+    encoded[0] = (uint8_t)num_bytes;
+    for (int i = 0; i < num_bytes; i++) {
+        encoded[1 + i] = (uint8_t)(x >> 8*(num_bytes - 1 - i));
+    }
+    return num_bytes + 1;
+}
+
+/**
+ * Encodes a value as its big endian bytes, followed by the number of those bytes
+ * @param x the value to encode
+ * @param encoded (OUTPUT) at least MAX_ENCODE_BYTES bytes where the encoding will be put
+ * @returns the number of bytes in the encoding
+ */
+int right_encode(uint64_t x, uint8_t *encoded) {
+    int num_bytes = encode_num_bytes(x);
+    for (int i = 0; i < num_bytes; i++) {
+        encoded[i] = (uint8_t)(x >> 8*(num_bytes - 1 - i));
+    }
+    encoded[num_bytes] = (uint8_t)num_bytes;
+    return num_bytes + 1;
+}
+
+/**
+ * Absorbs encode_string(str), which is left_encode of the length in BITS followed by the string itself
+ * @param ctx (IN/OUT) the context of the sponge
+ * @param str the string (may contain any bytes, including 0s)
+ * @param len the length of str in BYTES
+ * @returns the number of bytes absorbed
+ */
+size_t absorb_encoded_string(keccak_ctx *ctx, const uint8_t *str, size_t len) {
+    uint8_t encoded[MAX_ENCODE_BYTES];
+    int encoded_len = left_encode((uint64_t)len * 8, encoded);
+    keccak_update(ctx, encoded, encoded_len);
+    keccak_update(ctx, str, len);
+    return encoded_len + len;
+}
+
+/**
+ * Absorbs 0s until the total absorbed since the last block boundary is a whole number of blocks (the end of bytepad)
+ * The state already holds 0s there, so this is just the permutation(s) of the blocks that are finished
+ * @param ctx (IN/OUT) the context of the sponge
+ * @param absorbed the number of bytes absorbed since the last block boundary
+ */
+void absorb_zero_padding(keccak_ctx *ctx, size_t absorbed) {
+    uint8_t zeros[MAX_RATE_BYTES] = {0};
+    size_t remainder = absorbed % ctx->rate;
+    if (remainder != 0) {
+        keccak_update(ctx, zeros, ctx->rate - remainder);
+    }
+}
+
+
+/*************
+*** cSHAKE ***
+*************/
+/**
+ * Starts a new cSHAKE computation, by absorbing bytepad(encode_string(name) || encode_string(custom), rate)
+ * With an empty name and customization string, this is the same as SHAKE
+ * @param ctx (OUTPUT) the context to initialize
+ * @param variant SHAKE128 for cSHAKE128, or SHAKE256 for cSHAKE256
+ * @param name the function name (only used by functions defined on top of cSHAKE, e.g. "KMAC", otherwise empty)
+ * @param name_len the length of name in BYTES
+ * @param custom the customization string (may be empty)
+ * @param custom_len the length of custom in BYTES
+ */
+void cshake_init(keccak_ctx *ctx, keccak_variant variant, const uint8_t *name, size_t name_len,
+                 const uint8_t *custom, size_t custom_len) {
+    keccak_init(ctx, variant);
+    if (name_len == 0 && custom_len == 0) {
+        return;
+    }
+    ctx->suffix = CSHAKE_SUFFIX;
+
+    uint8_t encoded_rate[MAX_ENCODE_BYTES];
+    size_t absorbed = left_encode(ctx->rate, encoded_rate);
+    keccak_update(ctx, encoded_rate, absorbed);
+    absorbed += absorb_encoded_string(ctx, name, name_len);
+    absorbed += absorb_encoded_string(ctx, custom, custom_len);
+    absorb_zero_padding(ctx, absorbed);
+}
+
+/**
+ * Performs the cSHAKE extendable output function
+ * @param variant SHAKE128 for cSHAKE128, or SHAKE256 for cSHAKE256
+ * @param msg the message (may contain any bytes, including 0s)
+ * @param len the length of msg in BYTES
+ * @param custom the customization string (may be empty)
+ * @param custom_len the length of custom in BYTES
+ * @param output (OUTPUT) where the output will be put
+ * @param output_len how many bytes of output to produce
+ */
+void cshake(keccak_variant variant, const uint8_t *msg, size_t len, const uint8_t *custom, size_t custom_len,
+            uint8_t *output, size_t output_len) {
+    keccak_ctx ctx;
+    cshake_init(&ctx, variant, NULL, 0, custom, custom_len);
+    keccak_update(&ctx, msg, len);
+    keccak_squeeze(&ctx, output, output_len);
+}
+
+
+/***********
+*** KMAC ***
+***********/
+/**
+ * Prepares a key for KMAC, by absorbing everything that comes before the message into a template context
+ * (cSHAKE's bytepad of "KMAC" and the customization string, then bytepad(encode_string(key), rate))
+ * The template is never changed, kmac_init copies it for each message
+ * @param key_ctx (OUTPUT) the template context to initialize
+ * @param variant SHAKE128 for KMAC128, or SHAKE256 for KMAC256
+ * @param key the key
+ * @param key_len the length of key in BYTES
+ * @param custom the customization string (may be empty)
+ * @param custom_len the length of custom in BYTES
+ */
+void kmac_init_key(keccak_ctx *key_ctx, keccak_variant variant, const uint8_t *key, size_t key_len,
+                   const uint8_t *custom, size_t custom_len) {
+    cshake_init(key_ctx, variant, (const uint8_t*)"KMAC", 4, custom, custom_len);
+
+    uint8_t encoded_rate[MAX_ENCODE_BYTES];
+    size_t absorbed = left_encode(key_ctx->rate, encoded_rate);
+    keccak_update(key_ctx, encoded_rate, absorbed);
+    absorbed += absorb_encoded_string(key_ctx, key, key_len);
+    absorb_zero_padding(key_ctx, absorbed);
+}
+
+/**
+ * Starts a new KMAC computation from a prepared key
+ * @param ctx (OUTPUT) the context to initialize
+ * @param key_ctx the template context from kmac_init_key
+ */
+void kmac_init(keccak_ctx *ctx, const keccak_ctx *key_ctx) {
+    *ctx = *key_ctx;
+}
+
+/**
+ * Finishes a KMAC computation, by absorbing right_encode of the MAC length in BITS and squeezing out the MAC
+ * @param ctx (IN/OUT) the context of the running MAC, must be re-initialized before being used again
+ * @param mac (OUTPUT) where the MAC will be put
+ * @param mac_len the length of the MAC in BYTES (part of the input, so different lengths give unrelated MACs)
+ */
+void kmac_final(keccak_ctx *ctx, uint8_t *mac, size_t mac_len) {
+    uint8_t encoded_len[MAX_ENCODE_BYTES];
+    keccak_update(ctx, encoded_len, right_encode((uint64_t)mac_len * 8, encoded_len));
+    keccak_squeeze(ctx, mac, mac_len);
+}
+
+/**
+ * Finishes a KMACXOF computation, after which any amount of output can be squeezed out with keccak_squeeze
+ * @param ctx (IN/OUT) the context of the running MAC
+ */
+void kmac_xof_final(keccak_ctx *ctx) {
+    uint8_t encoded_len[MAX_ENCODE_BYTES];
+    keccak_update(ctx, encoded_len, right_encode(0, encoded_len)); // A length of 0 marks the output length as arbitrary
+}
+
+/**
+ * Performs KMAC on a message with a prepared key
+ * @param key_ctx the template context from kmac_init_key
+ * @param msg the message (may contain any bytes, including 0s)
+ * @param len the length of msg in BYTES
+ * @param mac (OUTPUT) where the MAC will be put
+ * @param mac_len the length of the MAC in BYTES
+ */
+void kmac(const keccak_ctx *key_ctx, const uint8_t *msg, size_t len, uint8_t *mac, size_t mac_len) {
+    keccak_ctx ctx;
+    kmac_init(&ctx, key_ctx);
+    keccak_update(&ctx, msg, len);
+    kmac_final(&ctx, mac, mac_len);
+}
+
+
+/**************
+*** TESTING ***
+**************/
+/**
+ * Checks an output against its expected value, printing an error if they differ
+ * @param output the output to check
+ * @param len the length of output in BYTES (at most 64)
+ * @param expected the expected output, in hex
+ * @param what a description of the output for the error message
+ */
+void check_output(const uint8_t *output, size_t len, const char *expected, const char *what) {
+    char hex[2*64 + 1];
+    for (size_t i = 0; i < len; i++) {
+        sprintf(&hex[2*i], "%02x", output[i]);
+    }
+    if (strcmp(hex, expected) != 0) {
+        printf("ERROR: %s is NOT correct!\n", what);
+    }
+}
+
+// Test examples: https://csrc.nist.gov/projects/cryptographic-standards-and-guidelines/example-values (cSHAKE and KMAC samples)
+int main(int argc, char **argv) {
+    uint8_t data[200];
+    uint8_t key[32];
+    for (int i = 0; i < 200; i++) {
+        data[i] = i;
+    }
+    for (int i = 0; i < 32; i++) {
+        key[i] = 0x40 + i;
+    }
+    const uint8_t *email = (const uint8_t*)"Email Signature";
+    const uint8_t *tagged = (const uint8_t*)"My Tagged Application";
+    uint8_t output[64];
+
+    cshake(SHAKE128, data, 4, email, strlen((const char*)email), output, 32);
+    check_output(output, 32, "c1c36925b6409a04f1b504fcbca9d82b4017277cb5ed2b2065fc1d3814d5aaf5", "cSHAKE128 sample #1");
+    cshake(SHAKE256, data, 200, email, strlen((const char*)email), output, 64);
+    check_output(output, 64, "07dc27b11e51fbac75bc7b3c1d983e8b4b85fb1defaf218912ac86430273091727f42b17ed1df63e8ec118f04b23633c1dfb1574c8fb55cb45da8e25afb092bb", "cSHAKE256 sample #4");
+
+    keccak_ctx key_ctx;
+    kmac_init_key(&key_ctx, SHAKE128, key, 32, NULL, 0);
+    kmac(&key_ctx, data, 4, output, 32);
+    check_output(output, 32, "e5780b0d3ea6f7d3a429c5706aa43a00fadbd7d49628839e3187243f456ee14e", "KMAC128 sample #1");
+    kmac_init_key(&key_ctx, SHAKE128, key, 32, tagged, strlen((const char*)tagged));
+    kmac(&key_ctx, data, 4, output, 32);
+    check_output(output, 32, "3b1fba963cd8b0b59e8c1a6d71888b7143651af8ba0a7070c0979e2811324aa5", "KMAC128 sample #2");
+    kmac_init_key(&key_ctx, SHAKE256, key, 32, tagged, strlen((const char*)tagged));
+    kmac(&key_ctx, data, 200, output, 64);
+    check_output(output, 64, "b58618f71f92e1d56c1b8c55ddd7cd188b97b4ca4d99831eb2699a837da2e4d970fbacfde50033aea585f1a2708510c32d07880801bd182898fe476876fc8965", "KMAC256 sample #4");
+
+    // Sanity check the template is left untouched, so MACing the same message again gives the same MAC
+    uint8_t again[64];
+    kmac(&key_ctx, data, 200, again, 64);
+    if (memcmp(output, again, 64) != 0) {
+        printf("ERROR: KMAC with a reused key template is NOT the same!\n");
+    }
+
+    // Compare MACing short frames from the key template with preparing the key again for each frame when run as "./kmac benchmark"
+    if (argc > 1 && strcmp(argv[1], "benchmark") == 0) {
+        int num_frames = 1000000;
+        for (int reuse = 0; reuse < 2; reuse++) {
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (int i = 0; i < num_frames; i++) {
+                data[0] = i;
+                if (!reuse) {
+                    kmac_init_key(&key_ctx, SHAKE128, key, 32, tagged, strlen((const char*)tagged));
+                }
+                kmac(&key_ctx, data, 64, output, 32);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+
+            double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+            printf("%-34s %10.0f MACs/second\n", reuse ? "KMAC128 (key template)" : "KMAC128 (key absorbed each time)", num_frames / seconds);
+        }
+    }
+
+    return 0;
+}
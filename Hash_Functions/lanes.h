@@ -0,0 +1,336 @@
+#ifndef LANES_H
+#define LANES_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define HAVE_X86_INTRINSICS
+#endif
+
+
+/**
+ * Multi-buffer ("lanes") hashing shared by the hash functions
+ * Many independent messages are hashed at once by giving each element (lane) of a vector a different message
+ * The hash files only provide the multi-lane compression function (or permutation) and how to feed a lane its message,
+ * this holds the rest: checking which vector extensions the processor has, and keeping every lane busy by
+ * refilling it with the next waiting message whenever it finishes one
+ */
+
+
+/*******************
+*** CPU FEATURES ***
+*******************/
+#ifdef HAVE_X86_INTRINSICS
+/**
+ * Checks (via CPUID) whether the processor supports AVX2 or AVX-512, and whether the OS saves the vector registers they use
+ * @param want_avx512 1 to check for AVX-512 (foundation), 0 to check for AVX2
+ * @returns 1 if the requested instructions can be used, otherwise 0
+ */
+int cpu_has_avx(int want_avx512) {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE) || !(ecx & bit_AVX)) {
+        return 0;
+    }
+
+    // The OS must be saving the wider registers on context switches (XMM/YMM, plus the opmask/ZMM state for AVX-512)
+    unsigned int xcr0_lo, xcr0_hi;
+    __asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    unsigned int needed = want_avx512 ? 0xE6 : 0x06;
+    if ((xcr0_lo & needed) != needed) {
+        return 0;
+    }
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    return want_avx512 ? ((ebx & bit_AVX512F) ? 1 : 0) : ((ebx & bit_AVX2) ? 1 : 0);
+}
+
+/**
+ * Picks how many lanes to run from the widest vector extension the processor supports (checked once via CPUID)
+ * @param avx512_lanes the number of lanes to use with AVX-512
+ * @param avx2_lanes the number of lanes to use with AVX2 (1 if AVX2 should not be used)
+ * @returns the number of lanes, or 1 if multi-buffer hashing should not be used
+ */
+int cpu_avx_lanes(int avx512_lanes, int avx2_lanes) {
+    // -1 until the CPU has been checked, then 2 for AVX-512, 1 for AVX2, or 0 for neither
+    // (atomic, since the first checks can come from several threads at once)
+    static atomic_int cached_avx_level = -1;
+    int avx_level = atomic_load(&cached_avx_level);
+    if (avx_level < 0) {
+        avx_level = cpu_has_avx(1) ? 2 : (cpu_has_avx(0) ? 1 : 0);
+        atomic_store(&cached_avx_level, avx_level);
+    }
+    return (avx_level == 2) ? avx512_lanes : ((avx_level == 1) ? avx2_lanes : 1);
+}
+#endif
+
+// Vectors of 8 and 16 32-bit words, each element (lane) holds the state of a different message
+typedef uint32_t v8u32 __attribute__((vector_size(32)));
+typedef uint32_t v16u32 __attribute__((vector_size(64)));
+
+#define MAX_LANES 16 // The most lanes any multi-buffer function works on (16 32-bit words with AVX-512)
+
+
+/**********************
+*** LANE SCHEDULING ***
+**********************/
+/**
+ * What the scheduler needs from a hash to run its lanes, each function is given the hash's own batch state
+ */
+typedef struct {
+    void (*load)(void *batch, int lane, size_t msg_index); // Starts a lane working on a new message
+    void (*step)(void *batch, const int *active); // Runs the multi-buffer function once over every lane (active[lane] is 0 for idle lanes)
+    int (*done)(void *batch, int lane); // Called for every active lane after a step, writes the lane's output and returns 1 once its message is finished
+    void (*finish)(void *batch, int lane); // Finishes a lane's message on its own with the single message function, and writes its output
+} lane_ops;
+
+/**
+ * Hashes many independent messages by running a hash's multi-buffer function over num_lanes messages at once
+ * Messages can have different lengths, whenever a lane finishes its message it is refilled with the next waiting one
+ * @param batch the hash's batch state, handed to every function in ops
+ * @param ops how to load, step, and finish the lanes of the hash
+ * @param num_lanes the number of messages the multi-buffer function works on at once (at most MAX_LANES)
+ * @param num_msgs the number of messages
+ */
+void lanes_run(void *batch, const lane_ops *ops, int num_lanes, size_t num_msgs) {
+    int active[MAX_LANES] = {0};
+    int num_active = 0;
+    size_t next_msg = 0;
+
+    // Give every lane its first message
+    for (int lane = 0; lane < num_lanes && next_msg < num_msgs; lane++) {
+        ops->load(batch, lane, next_msg);
+        active[lane] = 1;
+        num_active++;
+        next_msg++;
+    }
+
+    // A step costs the same however many lanes are busy, so once no messages are waiting and
+    // fewer than half of the lanes are left, the single message function gets through them sooner
+    while (num_active > 0 && (next_msg < num_msgs || num_active >= num_lanes / 2)) {
+        ops->step(batch, active);
+
+        for (int lane = 0; lane < num_lanes; lane++) {
+            if (!active[lane] || !ops->done(batch, lane)) {
+                continue;
+            }
+            if (next_msg < num_msgs) {
+                ops->load(batch, lane, next_msg);
+                next_msg++;
+            }
+            else {
+                active[lane] = 0;
+                num_active--;
+            }
+        }
+    }
+
+    for (int lane = 0; lane < num_lanes; lane++) {
+        if (active[lane]) {
+            ops->finish(batch, lane);
+        }
+    }
+}
+
+
+/***************************
+*** MERKLE-DAMGARD LANES ***
+***************************/
+/*
+ * MD5 and SHA-256 both pad the message out to 64-byte blocks and chain a compression function over them,
+ * so they only differ in the compression functions, the initial hash, and the byte order of the words
+ */
+
+/**
+ * Transposes one 512-bit block from each of LANES messages, so that vector W[i] holds word i of every message
+ * Lanes given a NULL block read 0s, and are left out of mask (all 1 bits for lanes with a block, 0 bits for the rest)
+ * @param W (OUTPUT) 16 vectors of LANES 32-bit words
+ * @param mask (OUTPUT) vector of LANES 32-bit words
+ * @param blocks the block of each lane (or NULL)
+ * @param LANES the number of lanes
+ * @param BIG_ENDIAN 1 to read the words as BIG ENDIAN (SHA-256), 0 for LITTLE ENDIAN (MD5)
+ */
+#define LANES_LOAD_BLOCKS(W, mask, blocks, LANES, BIG_ENDIAN) { \
+    static const uint8_t empty_block[64] = {0}; \
+    uint32_t words[16][LANES]; \
+    uint32_t lane_mask[LANES]; \
+    for (int lane = 0; lane < LANES; lane++) { \
+        const uint8_t *block = blocks[lane] ? blocks[lane] : empty_block; \
+        lane_mask[lane] = blocks[lane] ? 0xFFFFFFFF : 0; \
+        for (int i = 0; i < 16; i++) { \
+            uint32_t word; \
+            memcpy(&word, &block[4*i], 4); \
+            words[i][lane] = (BIG_ENDIAN) ? __builtin_bswap32(word) : word; \
+        } \
+    } \
+    memcpy(W, words, sizeof(words)); \
+    memcpy(&mask, lane_mask, sizeof(lane_mask)); \
+}
+
+// Compresses one 512-bit block from each of LANES messages, state[i*LANES + lane] holds word i of each lane's hash (NULL blocks are skipped)
+typedef void (*compress_lanes_fn)(const uint8_t **blocks, uint32_t *state);
+
+/**
+ * Describes a Merkle-Damgard hash to the multi-buffer scheduler
+ */
+typedef struct {
+    int num_words; // Number of 32-bit words in the hash value (4 for MD5, 8 for SHA-256)
+    int big_endian; // Whether the words of the digest are BIG ENDIAN (SHA-256) or LITTLE ENDIAN (MD5)
+    const uint32_t *initial_hash; // The initial hash value
+    int (*pad)(const uint8_t *tail, size_t tail_len, uint64_t total_len, uint8_t *padded); // Pads the final partial block
+    void (*compress_single)(const uint8_t *blocks, size_t num_blocks, uint32_t *prev_H); // Compresses blocks of one message
+} md_hash;
+
+/**
+ * Keeps track of which message a lane is working on, and how far through it the lane is
+ */
+typedef struct {
+    size_t msg_index; // Index of the message (and digest) this lane is working on
+    const uint8_t *msg; // The message itself, full blocks are compressed straight from here
+    size_t num_blocks; // Number of full 512-bit blocks in msg
+    size_t block_index; // The next block to compress (blocks past num_blocks come from padded)
+    uint8_t padded[128]; // The padded final block(s) of the message
+    int num_padded_blocks; // Number of blocks in padded (1 or 2)
+} md_lane;
+
+/**
+ * The state of a batch of messages being hashed with a Merkle-Damgard hash
+ */
+typedef struct {
+    const md_hash *hash;
+    compress_lanes_fn compress_lanes;
+    int num_lanes;
+    const uint8_t **msgs;
+    const size_t *lens;
+    uint8_t *digests; // 4*num_words bytes for each message, one after another
+    md_lane lanes[MAX_LANES];
+    uint32_t state[8*MAX_LANES]; // state[i*num_lanes + lane] holds word i of the hash of each lane
+} md_batch;
+
+/**
+ * Writes out the digest of a lane's message
+ * @param batch the batch the lane is in
+ * @param lane the lane
+ * @param H the lane's final hash value
+ */
+void md_store_digest(md_batch *batch, int lane, const uint32_t *H) {
+    uint8_t *digest = batch->digests + batch->lanes[lane].msg_index * 4*batch->hash->num_words;
+    for (int i = 0; i < 4*batch->hash->num_words; i++) {
+        int shift = batch->hash->big_endian ? 24 - 8*(i%4) : 8*(i%4);
+        digest[i] = (H[i/4] >> shift) & 0x000000FF;
+    }
+}
+
+/**
+ * Starts a lane working on a new message, resetting its hash to the initial hash
+ * @param arg the md_batch
+ * @param lane the lane to load
+ * @param msg_index the index of the message (and digest)
+ */
+void md_lane_load(void *arg, int lane, size_t msg_index) {
+    md_batch *batch = arg;
+    md_lane *l = &batch->lanes[lane];
+    size_t len = batch->lens[msg_index];
+    l->msg_index = msg_index;
+    l->msg = batch->msgs[msg_index];
+    l->num_blocks = len / 64;
+    l->block_index = 0;
+    l->num_padded_blocks = batch->hash->pad(l->msg + 64*l->num_blocks, len % 64, len, l->padded);
+
+    for (int i = 0; i < batch->hash->num_words; i++) {
+        batch->state[i*batch->num_lanes + lane] = batch->hash->initial_hash[i];
+    }
+}
+
+/**
+ * Compresses the next block of every active lane's message (idle lanes are masked off with NULL)
+ * @param arg the md_batch
+ * @param active whether each lane has a message
+ */
+void md_lanes_step(void *arg, const int *active) {
+    md_batch *batch = arg;
+    const uint8_t *blocks[MAX_LANES];
+    for (int lane = 0; lane < batch->num_lanes; lane++) {
+        blocks[lane] = NULL;
+        if (active[lane]) {
+            md_lane *l = &batch->lanes[lane];
+            blocks[lane] = (l->block_index < l->num_blocks) ? l->msg + 64*l->block_index
+                                                             : l->padded + 64*(l->block_index - l->num_blocks);
+        }
+    }
+    batch->compress_lanes(blocks, batch->state);
+}
+
+/**
+ * Moves a lane past the block that was just compressed, and outputs its digest if that was the last one
+ * @param arg the md_batch
+ * @param lane the lane
+ * @returns 1 if the lane's message is finished, otherwise 0
+ */
+int md_lane_done(void *arg, int lane) {
+    md_batch *batch = arg;
+    md_lane *l = &batch->lanes[lane];
+    if (++l->block_index < l->num_blocks + l->num_padded_blocks) {
+        return 0;
+    }
+
+    uint32_t H[8];
+    for (int i = 0; i < batch->hash->num_words; i++) {
+        H[i] = batch->state[i*batch->num_lanes + lane];
+    }
+    md_store_digest(batch, lane, H);
+    return 1;
+}
+
+/**
+ * Compresses the rest of a lane's message with the single message compression function, and outputs its digest
+ * @param arg the md_batch
+ * @param lane the lane to finish
+ */
+void md_lane_finish(void *arg, int lane) {
+    md_batch *batch = arg;
+    md_lane *l = &batch->lanes[lane];
+    uint32_t H[8];
+    for (int i = 0; i < batch->hash->num_words; i++) {
+        H[i] = batch->state[i*batch->num_lanes + lane];
+    }
+
+    if (l->block_index < l->num_blocks) {
+        batch->hash->compress_single(l->msg + 64*l->block_index, l->num_blocks - l->block_index, H);
+        l->block_index = l->num_blocks;
+    }
+    batch->hash->compress_single(l->padded + 64*(l->block_index - l->num_blocks), l->num_blocks + l->num_padded_blocks - l->block_index, H);
+    md_store_digest(batch, lane, H);
+}
+
+const lane_ops md_lane_ops = {md_lane_load, md_lanes_step, md_lane_done, md_lane_finish};
+
+/**
+ * Performs a Merkle-Damgard hash on many independent messages, by running compress_lanes over num_lanes messages at once
+ * @param hash the hash to perform
+ * @param msgs the messages to calculate the hash of
+ * @param lens the length of each message in BYTES
+ * @param num_msgs the number of messages
+ * @param digests (OUTPUT) the 4*num_words byte digest of each message, one after another
+ * @param num_lanes the number of messages compress_lanes works on at once (at most MAX_LANES)
+ * @param compress_lanes the multi-buffer compression function to use
+ */
+void md_batch_lanes(const md_hash *hash, const uint8_t **msgs, const size_t *lens, size_t num_msgs, uint8_t *digests,
+                    int num_lanes, compress_lanes_fn compress_lanes) {
+    md_batch batch = {
+        .hash = hash,
+        .compress_lanes = compress_lanes,
+        .num_lanes = num_lanes,
+        .msgs = msgs,
+        .lens = lens,
+        .digests = digests
+    };
+    lanes_run(&batch, &md_lane_ops, num_lanes, num_msgs);
+}
+
+#endif
@@ -2,13 +2,17 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+
+#include "lanes.h" // The CPU feature checks and the multi-buffer lane scheduler, shared with SHA-256 and SHA-3
+#include "fd_reader.h" // The threaded file reader, shared with SHA-1
 
 
 /****************
 *** CONSTANTS ***
 ****************/
-// Derived from: k[i] = floor(2^32 * abs(sin(i + 1)))
-uint32_t k[64] = {
+// Derived from: md5_k[i] = floor(2^32 * abs(sin(i + 1)))
+uint32_t md5_k[64] = {
     0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
     0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
     0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
@@ -27,103 +31,151 @@ uint32_t k[64] = {
     0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
 };
 
-// s[i] represents the shift amount for round i
-uint32_t s[64] = {
-    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
-    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
-    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
-    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
-};
-
 // Initial hash values in LITTLE ENDIAN, are just the values counting up and down in base-16 (01 23 45 67 etc.)
-uint32_t H0[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476};
+uint32_t md5_H0[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476};
 
 
 /********************
 *** PREPROCESSING ***
 ********************/
 /**
- * Pad the message to be a multiple of the 512 bits
+ * Pads the trailing partial block of a message out to a multiple of 512 bits
  * Will append a 1, then k zero bits, and then a 64-bit block at the end containing the original msg length
- * @param msg the original message to pad
- * @param len the length of msg in BYTES
- * @param padded (OUTPUT) a double pointer where the outputted padded message will be but
- * @param len_padded (OUTPUT) the length of the padded message in BYTES
+ * Only the final (<64 byte) piece of the message is ever copied, all full blocks are compressed straight from the caller's memory
+ * @param tail the trailing bytes of the message that did not fill a whole 512-bit block
+ * @param tail_len the length of tail in BYTES (must be less than 64)
+ * @param total_len the length of the WHOLE original message in BYTES
+ * @param padded (OUTPUT) a 128-byte buffer where the padded final block(s) will be put
+ * @returns the number of 512-bit blocks written to padded (either 1 or 2)
  */
-void pad_msg(uint8_t *msg, int len, uint8_t **padded, int *len_padded) {
-    // The number of 0s needed, k, is given by: k = (512 - 64 - len - 1) = 448 - (len + 1) mod 512
-    int k = (448 - 8*len) % 512;
-    if (k < 0) {
-        k += 512;
-    }
-
-    // Will append a 1, then k zero bits, and then a 64-bit block at the end containing the original msg length
-    // Add an extra bit to k for the leading 1 bit, and then convert # bits to # bytes
-    *len_padded = len + (k+1)/8 + 64/8;
-    *padded = malloc(*len_padded);
+int md5_pad_msg(const uint8_t *tail, size_t tail_len, uint64_t total_len, uint8_t *padded) {
+    // The padding needs 1 byte for the leading 1 bit and 8 bytes for the length
+    // If that does not fit after the tail, then the padding spills over into a second block
+    int num_blocks = (tail_len + 1 + 8 <= 64) ? 1 : 2;
 
-    memcpy(*padded, msg, len); // Copy over the original message
-    memset(*padded + len, 0, (*len_padded - len)); // Set all padded bits to 0
-    (*padded)[len] = 0x80; // Set the most significant padded bit to 1
+    memcpy(padded, tail, tail_len); // Copy over the end of the original message
+    memset(padded + tail_len, 0, 64*num_blocks - tail_len); // Set all padded bits to 0
+    padded[tail_len] = 0x80; // Set the most significant padded bit to 1
 
     // Set the last 64 bits as the 64-bit representation of the original msg length (IN BITS)
-    uint64_t len64 = (uint64_t)(len * 8);
+    uint64_t len64 = total_len * 8;
     for (int i = 0; i < 8; i++) {
-        (*padded)[*len_padded - 1 - i] = len64 >> (56 - 8*i);
+        padded[64*num_blocks - 8 + i] = len64 >> 8*i;
     }
+
+    return num_blocks;
 }
 
 
-/**************************
-*** COMPRESSION HELPERS ***
-**************************/
-/**
- * Rotates the bits in a word w n bits to the left
- * @param w word to rotate
- * @param n number of bits to rotate left
- * @returns the resulting rotated value
- */
-uint32_t rotl(uint32_t w, int n) {
-    return (w << n) | (w >> (32 - n));
-}
+/**********************
+*** CORE MD5 HASH ***
+**********************/
+// The round functions used by each of the four rounds of the compression function
+// (Written as macros so they work on plain words and on vectors of words alike)
+#define MD5_F(x, y, z) (((x) & (y)) ^ (~(x) & (z))) // Choice of y or z based on x
+#define MD5_G(x, y, z) (((z) & (x)) ^ (~(z) & (y))) // Choice of x or y based on z
+#define MD5_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD5_I(x, y, z) ((y) ^ ((x) | ~(z)))
+#define MD5_ROTL(w, n) (((w) << (n)) | ((w) >> (32 - (n))))
 
 /**
- * Performs the Choice function, which chooses the respective bit of y or z, based on the corresponding bit of x
- * @param x the value whose bit will determine which other inpput y or z will be chosen from
- * @param y the input to choose from when x's bit = 0
- * @param z the input to choose from when x's bit = 1
- * @returns the result of the choosing
+ * Performs a single step i of the compression function
+ * Rather than shifting every state variable along after each step, the next step is just given them in a rotated order
+ * @param f the round function to use
+ * @param a (IN/OUT) the state variable that gets replaced by this step
+ * @param b, c, d the other state variables
+ * @param m the message word used by this step
+ * @param i the step number (0-63), selects the constant md5_k[i]
+ * @param s the number of bits to rotate by in this step
  */
-uint32_t ch(uint32_t x, uint32_t y, uint32_t z) {
-    return (x & y) ^ (~x & z);
-}
+#define MD5_STEP(f, a, b, c, d, m, i, s) \
+    a += f(b, c, d) + md5_k[i] + (m); \
+    a = b + MD5_ROTL(a, s)
 
-/**
- * Performs the Majority function, which chooses the output bit is what value had the majority among x, y, and z
- * @param x the first input
- * @param y the second input
- * @param z the third input
- * @returns the result of the majority bits within x, y, and z
- */
-uint32_t maj(uint32_t x, uint32_t y, uint32_t z) {
-    return (x & y) ^ (x & z) ^ (y & z);
-}
+// The four 16-step rounds, fully unrolled so every message word index and shift amount is a constant
+#define MD5_ROUND_1(M) \
+    MD5_STEP(MD5_F, A, B, C, D, M[ 0],  0,  7); \
+    MD5_STEP(MD5_F, D, A, B, C, M[ 1],  1, 12); \
+    MD5_STEP(MD5_F, C, D, A, B, M[ 2],  2, 17); \
+    MD5_STEP(MD5_F, B, C, D, A, M[ 3],  3, 22); \
+    MD5_STEP(MD5_F, A, B, C, D, M[ 4],  4,  7); \
+    MD5_STEP(MD5_F, D, A, B, C, M[ 5],  5, 12); \
+    MD5_STEP(MD5_F, C, D, A, B, M[ 6],  6, 17); \
+    MD5_STEP(MD5_F, B, C, D, A, M[ 7],  7, 22); \
+    MD5_STEP(MD5_F, A, B, C, D, M[ 8],  8,  7); \
+    MD5_STEP(MD5_F, D, A, B, C, M[ 9],  9, 12); \
+    MD5_STEP(MD5_F, C, D, A, B, M[10], 10, 17); \
+    MD5_STEP(MD5_F, B, C, D, A, M[11], 11, 22); \
+    MD5_STEP(MD5_F, A, B, C, D, M[12], 12,  7); \
+    MD5_STEP(MD5_F, D, A, B, C, M[13], 13, 12); \
+    MD5_STEP(MD5_F, C, D, A, B, M[14], 14, 17); \
+    MD5_STEP(MD5_F, B, C, D, A, M[15], 15, 22)
 
+#define MD5_ROUND_2(M) \
+    MD5_STEP(MD5_G, A, B, C, D, M[ 1], 16,  5); \
+    MD5_STEP(MD5_G, D, A, B, C, M[ 6], 17,  9); \
+    MD5_STEP(MD5_G, C, D, A, B, M[11], 18, 14); \
+    MD5_STEP(MD5_G, B, C, D, A, M[ 0], 19, 20); \
+    MD5_STEP(MD5_G, A, B, C, D, M[ 5], 20,  5); \
+    MD5_STEP(MD5_G, D, A, B, C, M[10], 21,  9); \
+    MD5_STEP(MD5_G, C, D, A, B, M[15], 22, 14); \
+    MD5_STEP(MD5_G, B, C, D, A, M[ 4], 23, 20); \
+    MD5_STEP(MD5_G, A, B, C, D, M[ 9], 24,  5); \
+    MD5_STEP(MD5_G, D, A, B, C, M[14], 25,  9); \
+    MD5_STEP(MD5_G, C, D, A, B, M[ 3], 26, 14); \
+    MD5_STEP(MD5_G, B, C, D, A, M[ 8], 27, 20); \
+    MD5_STEP(MD5_G, A, B, C, D, M[13], 28,  5); \
+    MD5_STEP(MD5_G, D, A, B, C, M[ 2], 29,  9); \
+    MD5_STEP(MD5_G, C, D, A, B, M[ 7], 30, 14); \
+    MD5_STEP(MD5_G, B, C, D, A, M[12], 31, 20)
+
+#define MD5_ROUND_3(M) \
+    MD5_STEP(MD5_H, A, B, C, D, M[ 5], 32,  4); \
+    MD5_STEP(MD5_H, D, A, B, C, M[ 8], 33, 11); \
+    MD5_STEP(MD5_H, C, D, A, B, M[11], 34, 16); \
+    MD5_STEP(MD5_H, B, C, D, A, M[14], 35, 23); \
+    MD5_STEP(MD5_H, A, B, C, D, M[ 1], 36,  4); \
+    MD5_STEP(MD5_H, D, A, B, C, M[ 4], 37, 11); \
+    MD5_STEP(MD5_H, C, D, A, B, M[ 7], 38, 16); \
+    MD5_STEP(MD5_H, B, C, D, A, M[10], 39, 23); \
+    MD5_STEP(MD5_H, A, B, C, D, M[13], 40,  4); \
+    MD5_STEP(MD5_H, D, A, B, C, M[ 0], 41, 11); \
+    MD5_STEP(MD5_H, C, D, A, B, M[ 3], 42, 16); \
+    MD5_STEP(MD5_H, B, C, D, A, M[ 6], 43, 23); \
+    MD5_STEP(MD5_H, A, B, C, D, M[ 9], 44,  4); \
+    MD5_STEP(MD5_H, D, A, B, C, M[12], 45, 11); \
+    MD5_STEP(MD5_H, C, D, A, B, M[15], 46, 16); \
+    MD5_STEP(MD5_H, B, C, D, A, M[ 2], 47, 23)
+
+#define MD5_ROUND_4(M) \
+    MD5_STEP(MD5_I, A, B, C, D, M[ 0], 48,  6); \
+    MD5_STEP(MD5_I, D, A, B, C, M[ 7], 49, 10); \
+    MD5_STEP(MD5_I, C, D, A, B, M[14], 50, 15); \
+    MD5_STEP(MD5_I, B, C, D, A, M[ 5], 51, 21); \
+    MD5_STEP(MD5_I, A, B, C, D, M[12], 52,  6); \
+    MD5_STEP(MD5_I, D, A, B, C, M[ 3], 53, 10); \
+    MD5_STEP(MD5_I, C, D, A, B, M[10], 54, 15); \
+    MD5_STEP(MD5_I, B, C, D, A, M[ 1], 55, 21); \
+    MD5_STEP(MD5_I, A, B, C, D, M[ 8], 56,  6); \
+    MD5_STEP(MD5_I, D, A, B, C, M[15], 57, 10); \
+    MD5_STEP(MD5_I, C, D, A, B, M[ 6], 58, 15); \
+    MD5_STEP(MD5_I, B, C, D, A, M[13], 59, 21); \
+    MD5_STEP(MD5_I, A, B, C, D, M[ 4], 60,  6); \
+    MD5_STEP(MD5_I, D, A, B, C, M[11], 61, 10); \
+    MD5_STEP(MD5_I, C, D, A, B, M[ 2], 62, 15); \
+    MD5_STEP(MD5_I, B, C, D, A, M[ 9], 63, 21)
 
-/**********************
-*** CORE MD5 HASH ***
-**********************/
 /**
  * Performs the core compression function of MD5
  * @param block the 512-bit block of the message that is being worked on
  * @param prev_H (IN/OUT) the outputted hash message from the previous call to this function (or the initial hash). Will contain the resulting hash upon return
  */
-void compress(uint8_t* block, uint32_t *prev_H) {
+void md5_compress(const uint8_t* block, uint32_t *prev_H) {
     /*** Create the 16-entry message schedule ***/
-    uint32_t *M = calloc(32, sizeof(uint32_t));
+    uint32_t M[16];
     memcpy(M, block, 512/8); // Can keep the LITTLE ENDIAN of the original message
 
-    /*** Perform the compression iteration 80 times ***/
+    /*** Perform the compression iteration 64 times ***/
     // Initialize the states
     uint32_t A = prev_H[0];
     uint32_t B = prev_H[1];
@@ -131,33 +183,10 @@ void compress(uint8_t* block, uint32_t *prev_H) {
     uint32_t D = prev_H[3];
 
     // Perform the iteration function
-    for (int i = 0; i < 64; i++) {
-        // Get the values for F and g
-        uint32_t F = 0;
-        uint32_t g = 0;
-        if (i < 16) {
-            F = ch(B, C, D);
-            g = i;
-        }
-        else if (i < 32) {
-            F = ch(D, B, C);
-            g = (5*i + 1) % 16;
-        }
-        else if (i < 48) {
-            F = B ^ C ^ D;
-            g = (3*i + 5) % 16;
-        }
-        else {
-            F = C ^ (B | (~D));
-            g = (7*i) % 16;
-        }
-
-        uint32_t temp = D;
-        D = C;
-        C = B;
-        B = B + rotl(A + F + k[i] + M[g], s[i]);
-        A = temp;
-    }
+    MD5_ROUND_1(M);
+    MD5_ROUND_2(M);
+    MD5_ROUND_3(M);
+    MD5_ROUND_4(M);
 
     // Add the results to the previous hash to get the NEW hash
     prev_H[0] += A; 
@@ -167,43 +196,232 @@ void compress(uint8_t* block, uint32_t *prev_H) {
 }
 
 /**
- * Performs the MD5 hash function
- * @param msg the message to calculate the hash of
- * @returns the digest of the msg
+ * Performs the compression function over several consecutive blocks
+ * @param blocks the 512-bit blocks of the message that are being worked on
+ * @param num_blocks the number of 512-bit blocks in blocks
+ * @param prev_H (IN/OUT) the outputted hash message from the previous call to this function (or the initial hash). Will contain the resulting hash upon return
  */
-uint8_t* md5(uint8_t *msg) {
-    /*** PREPROCESSING ***/
-    // Pad the message
-    uint8_t *padded = NULL;
-    int padded_len = 0;
-    pad_msg(msg, strlen(msg), &padded, &padded_len);
-    // Breaking the padded message into blocks will be done in the main loop
-
-    for (int i = 0; i < 512/8; i++) {
-        printf("%02x", padded[i]);
+void md5_compress_blocks(const uint8_t *blocks, size_t num_blocks, uint32_t *prev_H) {
+    for (size_t block_index = 0; block_index < num_blocks; block_index++) {
+        md5_compress(&blocks[block_index * 64], prev_H);
     }
-    printf("\n");
+}
 
-    /*** CORE HASH FUNCTIONALITY ***/
-    uint32_t H[4] = {0}; // The most recent hash value
-    memcpy(H, H0, 128/8); // Set the initial hash value to the constant H0
+/**
+ * Internal state for computing a MD5 hash incrementally
+ * Lets a message be hashed in pieces (e.g. as it is read from a file) without ever holding the whole thing in memory
+ */
+typedef struct {
+    uint32_t H[4]; // The most recent hash value
+    uint8_t buffer[64]; // Holds the start of a block until the caller has provided all 64 bytes of it
+    size_t buffer_len; // Number of bytes currently held in buffer
+    uint64_t total_len; // Total length of the message processed so far in BYTES
+} md5_ctx;
 
-    // Perform the compression function for each block in the message
-    for (int block_index = 0; block_index < (padded_len / 64); block_index++) {
-        uint8_t* block = &padded[block_index * 64];
-        compress(block, H);
+/**
+ * Starts a new MD5 hash computation
+ * @param ctx (OUTPUT) the context to initialize
+ */
+void md5_init(md5_ctx *ctx) {
+    memcpy(ctx->H, md5_H0, 128/8); // Set the initial hash value to the constant md5_H0
+    ctx->buffer_len = 0;
+    ctx->total_len = 0;
+}
+
+/**
+ * Adds more of the message to a running MD5 hash computation
+ * Full blocks are compressed directly out of msg, only a trailing partial block is buffered until the next call
+ * @param ctx (IN/OUT) the context of the running hash
+ * @param msg the next piece of the message (may contain any bytes, including 0s)
+ * @param len the length of msg in BYTES
+ */
+void md5_update(md5_ctx *ctx, const uint8_t *msg, size_t len) {
+    ctx->total_len += len;
+
+    // Top up a partially filled block from a previous call first
+    if (ctx->buffer_len > 0) {
+        size_t needed = 64 - ctx->buffer_len;
+        size_t taken = (len < needed) ? len : needed;
+        memcpy(ctx->buffer + ctx->buffer_len, msg, taken);
+        ctx->buffer_len += taken;
+        msg += taken;
+        len -= taken;
+
+        if (ctx->buffer_len < 64) {
+            return;
+        }
+        md5_compress_blocks(ctx->buffer, 1, ctx->H);
+        ctx->buffer_len = 0;
     }
 
+    // Perform the compression function for each full block, straight from the caller's memory
+    size_t num_blocks = len / 64;
+    md5_compress_blocks(msg, num_blocks, ctx->H);
+    msg += 64*num_blocks;
+    len -= 64*num_blocks;
+
+    // Hold onto whatever is left until more of the message arrives (or the hash is finished)
+    memcpy(ctx->buffer, msg, len);
+    ctx->buffer_len = len;
+}
+
+/**
+ * Finishes a MD5 hash computation by padding and compressing the last block
+ * @param ctx (IN/OUT) the context of the running hash, must be re-initialized before being used again
+ * @param digest (OUTPUT) 128-bit (16-byte) buffer where the digest of the msg will be put
+ */
+void md5_final(md5_ctx *ctx, uint8_t *digest) {
+    // Pad the message, only the final partial block gets copied
+    uint8_t padded[128];
+    int num_blocks = md5_pad_msg(ctx->buffer, ctx->buffer_len, ctx->total_len, padded);
+    md5_compress_blocks(padded, num_blocks, ctx->H);
+
     // Note that this output is in LITTLE ENDIAN already
     // (Also converts the word-index hash back into byte-index)
-    uint8_t *digest = malloc(128/8);
-    memcpy(digest, H, 128/8);
+    for (int i = 0; i < 128/8; i++) {
+        digest[i] = (ctx->H[i/4] >> (8*(i%4))) & 0x000000FF;
+    }
+}
+
+/**
+ * Performs the MD5 hash function
+ * @param msg the message to calculate the hash of (may contain any bytes, including 0s)
+ * @param len the length of msg in BYTES
+ * @returns the digest of the msg
+ */
+uint8_t* md5(const uint8_t *msg, size_t len) {
+    md5_ctx ctx;
+    md5_init(&ctx);
+    md5_update(&ctx, msg, len);
 
-    free(padded);
+    uint8_t *digest = malloc(128/8);
+    md5_final(&ctx, digest);
     return digest;
 }
 
 
+/**************************
+*** MULTI-BUFFER HASHING ***
+**************************/
+#ifdef HAVE_X86_INTRINSICS
+/**
+ * Defines a compression function that works on LANES independent messages at once (one 512-bit block from each)
+ * This is the same as md5_compress(), except each variable holds one word from every message instead of just one
+ * MD5 has no message schedule to expand, so all the work is in the rounds, and every lane runs them in lockstep
+ * Lanes given a NULL block are masked off, so their hash values are left unchanged
+ * @param name the name of the function to define
+ * @param LANES the number of messages worked on at once
+ * @param vec_t the vector type holding one word from each message
+ * @param isa the instruction set extension the function is compiled for
+ */
+#define MD5_DEFINE_COMPRESS_LANES(name, LANES, vec_t, isa) \
+__attribute__((target(isa))) \
+void name(const uint8_t **blocks, uint32_t *state) { \
+    vec_t M[16]; \
+    vec_t mask; \
+    LANES_LOAD_BLOCKS(M, mask, blocks, LANES, 0) /* The words are kept in LITTLE ENDIAN */ \
+    \
+    /* Initialize the states, state[i*LANES + lane] holds word i of the hash for each lane */ \
+    vec_t A, B, C, D; \
+    memcpy(&A, &state[0*LANES], sizeof(vec_t)); \
+    memcpy(&B, &state[1*LANES], sizeof(vec_t)); \
+    memcpy(&C, &state[2*LANES], sizeof(vec_t)); \
+    memcpy(&D, &state[3*LANES], sizeof(vec_t)); \
+    vec_t A_SAVE = A, B_SAVE = B, C_SAVE = C, D_SAVE = D; \
+    \
+    /* Perform the iteration function */ \
+    MD5_ROUND_1(M); \
+    MD5_ROUND_2(M); \
+    MD5_ROUND_3(M); \
+    MD5_ROUND_4(M); \
+    \
+    /* Add the results to the previous hash to get the NEW hash (masked off lanes add 0) */ \
+    A = A_SAVE + (A & mask); \
+    B = B_SAVE + (B & mask); \
+    C = C_SAVE + (C & mask); \
+    D = D_SAVE + (D & mask); \
+    memcpy(&state[0*LANES], &A, sizeof(vec_t)); \
+    memcpy(&state[1*LANES], &B, sizeof(vec_t)); \
+    memcpy(&state[2*LANES], &C, sizeof(vec_t)); \
+    memcpy(&state[3*LANES], &D, sizeof(vec_t)); \
+}
+
+MD5_DEFINE_COMPRESS_LANES(md5_compress_x8_avx2, 8, v8u32, "avx2")
+MD5_DEFINE_COMPRESS_LANES(md5_compress_x16_avx512, 16, v16u32, "avx512f")
+
+/**
+ * Picks the widest multi-buffer compression function the processor supports
+ * @param compress_lanes (OUTPUT) the multi-buffer compression function to use
+ * @returns the number of lanes compress_lanes works on, or 1 if multi-buffer hashing should not be used
+ */
+int md5_select_compress_lanes(compress_lanes_fn *compress_lanes) {
+    int num_lanes = cpu_avx_lanes(16, 8);
+    *compress_lanes = (num_lanes == 16) ? md5_compress_x16_avx512 : md5_compress_x8_avx2;
+    return num_lanes;
+}
+#endif
+
+// How the shared multi-buffer scheduler runs MD5
+const md_hash md5_md_hash = {4, 0, md5_H0, md5_pad_msg, md5_compress_blocks};
+
+/**
+ * Performs the MD5 hash function on many independent messages at once (e.g. verifying the checksums of a whole directory of files)
+ * Uses 16 lanes with AVX-512 or 8 lanes with AVX2 when the processor has them, otherwise hashes the messages one after another
+ * @param msgs the messages to calculate the hash of (may contain any bytes, including 0s)
+ * @param lens the length of each message in BYTES
+ * @param num_msgs the number of messages
+ * @param digests (OUTPUT) the 128-bit digest of each message
+ */
+void md5_batch(const uint8_t **msgs, const size_t *lens, size_t num_msgs, uint8_t (*digests)[16]) {
+#ifdef HAVE_X86_INTRINSICS
+    compress_lanes_fn compress_lanes;
+    int num_lanes = md5_select_compress_lanes(&compress_lanes);
+    if (num_lanes > 1) {
+        md_batch_lanes(&md5_md_hash, msgs, lens, num_msgs, &digests[0][0], num_lanes, compress_lanes);
+        return;
+    }
+#endif
+
+    for (size_t i = 0; i < num_msgs; i++) {
+        md5_ctx ctx;
+        md5_init(&ctx);
+        md5_update(&ctx, msgs[i], lens[i]);
+        md5_final(&ctx, digests[i]);
+    }
+}
+
+
+/*******************
+*** FILE HASHING ***
+*******************/
+/**
+ * Adds a chunk of a file to a running MD5 hash computation, in the form fd_read_all() calls
+ * @param ctx the md5_ctx of the running hash
+ * @param data the next chunk of the file
+ * @param len the length of data in BYTES
+ */
+void md5_fd_update(void *ctx, const uint8_t *data, size_t len) {
+    md5_update(ctx, data, len);
+}
+
+/**
+ * Performs the MD5 hash function on everything that can be read from a file descriptor (a file, pipe, socket, etc.)
+ * The file is never held in memory all at once, one thread reads the next chunk while this one hashes the previous one
+ * @param fd the file descriptor to read until the end
+ * @param digest (OUTPUT) 128-bit (16-byte) buffer where the digest of the file will be put
+ * @returns 0 on success, or -1 if the file could not be read
+ */
+int md5_fd(int fd, uint8_t *digest) {
+    md5_ctx ctx;
+    md5_init(&ctx);
+    if (fd_read_all(fd, md5_fd_update, &ctx) != 0) {
+        return -1;
+    }
+    md5_final(&ctx, digest);
+    return 0;
+}
+
+
 /**************
 *** TESTING ***
 **************/
@@ -212,7 +430,7 @@ int main() {
     uint8_t msg[] = "The quick brown fox jumps over the lazy dog";
     printf("message = %s\n", msg);
 
-    uint8_t *digest = md5(msg);
+    uint8_t *digest = md5(msg, strlen(msg));
     printf("digest = %s\n", digest);
     printf("       = ");
     for (int i = 0; i < 128/8; i++) {
@@ -220,6 +438,75 @@ int main() {
     }
     printf("\n");
 
+    // Sanity check the streaming interface gives the same digest when fed one byte at a time
+    md5_ctx ctx;
+    uint8_t streamed_digest[128/8];
+    md5_init(&ctx);
+    for (size_t i = 0; i < strlen(msg); i++) {
+        md5_update(&ctx, &msg[i], 1);
+    }
+    md5_final(&ctx, streamed_digest);
+    if (memcmp(digest, streamed_digest, 128/8) != 0) {
+        printf("ERROR: Streamed digest and one-shot digest are NOT the same!\n");
+    }
+
+    // Sanity check the batch interface against the RFC 1321 test suite, repeated so there are more messages than lanes
+    const char *rfc_msgs[7] = {
+        "", "a", "abc", "message digest", "abcdefghijklmnopqrstuvwxyz",
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789",
+        "12345678901234567890123456789012345678901234567890123456789012345678901234567890"
+    };
+    const char *rfc_digests[7] = {
+        "d41d8cd98f00b204e9800998ecf8427e", "0cc175b9c0f1b6a831c399e269772661", "900150983cd24fb0d6963f7d28e17f72",
+        "f96b697d7cb7938d525a2f31aaf161d0", "c3fcd3d76192e4007dfb496cca67e13b", "d174ab98d277d9f5a5611c2c9f419d9f",
+        "57edf4a22be3c955ac49da2e2107b67a"
+    };
+    const uint8_t *batch_msgs[4*7];
+    size_t batch_lens[4*7];
+    uint8_t batch_digests[4*7][128/8];
+    for (int i = 0; i < 4*7; i++) {
+        batch_msgs[i] = (const uint8_t *)rfc_msgs[i % 7];
+        batch_lens[i] = strlen(rfc_msgs[i % 7]);
+    }
+    md5_batch(batch_msgs, batch_lens, 4*7, batch_digests);
+    for (int i = 0; i < 4*7; i++) {
+        char hex[2*128/8 + 1];
+        for (int j = 0; j < 128/8; j++) {
+            sprintf(&hex[2*j], "%02x", batch_digests[i][j]);
+        }
+        if (strcmp(hex, rfc_digests[i % 7]) != 0) {
+            printf("ERROR: Batch digest %d does NOT match the RFC 1321 known answer!\n", i);
+        }
+    }
+
+    // Sanity check hashing from a file descriptor against known answers (from Python's hashlib),
+    // using an empty file and a file that takes several read chunks, so both buffers are filled more than once
+    size_t file_len = 3*READ_CHUNK_SIZE + 1000;
+    uint8_t *file_data = malloc(file_len);
+    for (size_t i = 0; i < file_len; i++) {
+        file_data[i] = i * 7;
+    }
+    uint8_t expected_file_digests[2][128/8] = {
+        {0xd4, 0x1d, 0x8c, 0xd9, 0x8f, 0x00, 0xb2, 0x04, 0xe9, 0x80, 0x09, 0x98, 0xec, 0xf8, 0x42, 0x7e},
+        {0x88, 0x86, 0x24, 0x2f, 0x6b, 0x3f, 0xfd, 0x01, 0x0e, 0x99, 0xf6, 0x59, 0xfd, 0x09, 0xc3, 0xe2}
+    };
+    size_t file_lens[2] = {0, file_len};
+    for (int i = 0; i < 2; i++) {
+        FILE *file = tmpfile();
+        uint8_t file_digest[128/8];
+        if (file == NULL || fwrite(file_data, 1, file_lens[i], file) != file_lens[i] || fflush(file) != 0
+            || lseek(fileno(file), 0, SEEK_SET) != 0 || md5_fd(fileno(file), file_digest) != 0) {
+            printf("ERROR: Could not hash temporary file %d!\n", i);
+        }
+        else if (memcmp(file_digest, expected_file_digests[i], 128/8) != 0) {
+            printf("ERROR: File digest %d does NOT match the known answer!\n", i);
+        }
+        if (file != NULL) {
+            fclose(file);
+        }
+    }
+    free(file_data);
+
     free(digest);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,475 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "lanes.h" // Shared by MD5, SHA-256, and SHA3-256
+#include "fd_reader.h" // Shared by MD5 and SHA-1
+
+
+/**
+ * Computes several digests (MD5, SHA-1, SHA-256 and SHA3-256) of the same message in a single pass over it
+ * The other hash files are pulled in directly, their internals already carry a per-file prefix (md5_compress, sha1_H0,
+ * sha256_k, etc.) and the shared pieces live in lanes.h and fd_reader.h, so only each file's main needs renaming
+ */
+
+
+/****************************
+*** INDIVIDUAL HASH FILES ***
+****************************/
+// MD5
+#define main md5_main
+#include "md5.c"
+#undef main
+
+// SHA-1
+#define main sha1_main
+#include "sha1.c"
+#undef main
+
+// SHA-256
+#define main sha256_main
+#include "sha256.c"
+#undef main
+
+// SHA3-256
+#define main sha3_main
+#include "sha3.c"
+#undef main
+
+
+/****************
+*** CONSTANTS ***
+****************/
+// Which digests to compute, OR these together to request more than one
+#define MULTIHASH_MD5      0x1
+#define MULTIHASH_SHA1     0x2
+#define MULTIHASH_SHA256   0x4
+#define MULTIHASH_SHA3_256 0x8
+#define MULTIHASH_ALL      (MULTIHASH_MD5 | MULTIHASH_SHA1 | MULTIHASH_SHA256 | MULTIHASH_SHA3_256)
+
+// The message is handed to the hashes in pieces small enough to stay in the L1 cache while every hash works through them
+// 8704 = 8*1088 is a multiple of both the 64-byte MD5/SHA block and the 136-byte SHA3-256 rate, so no hash ends a piece on a partial block
+#define MULTIHASH_CHUNK_SIZE (8*1088)
+
+// Size of each read from a file, and how many of those reads the threaded pipeline can have in flight at once
+#define MULTIHASH_READ_SIZE (64*1088)
+#define MULTIHASH_PIPELINE_SLOTS 8
+
+
+/********************
+*** MULTI-HASHING ***
+********************/
+/**
+ * Internal state for computing several digests of the same message incrementally
+ */
+typedef struct {
+    int algorithms; // Which of the MULTIHASH_* digests are being computed
+    md5_ctx md5;
+    sha1_ctx sha1;
+    sha256_ctx sha256;
+    sha3_ctx sha3_256;
+} multihash_ctx;
+
+/**
+ * The digests of a message, only the ones that were requested are filled in
+ */
+typedef struct {
+    uint8_t md5[128/8];
+    uint8_t sha1[160/8];
+    uint8_t sha256[256/8];
+    uint8_t sha3_256[256/8];
+} multihash_digests;
+
+/**
+ * Starts a new multi-digest hash computation
+ * @param ctx (OUTPUT) the context to initialize
+ * @param algorithms the MULTIHASH_* digests to compute, OR'd together
+ */
+void multihash_init(multihash_ctx *ctx, int algorithms) {
+    ctx->algorithms = algorithms;
+    if (algorithms & MULTIHASH_MD5) {
+        md5_init(&ctx->md5);
+    }
+    if (algorithms & MULTIHASH_SHA1) {
+        sha1_init(&ctx->sha1);
+    }
+    if (algorithms & MULTIHASH_SHA256) {
+        sha256_init(&ctx->sha256);
+    }
+    if (algorithms & MULTIHASH_SHA3_256) {
+        sha3_init(&ctx->sha3_256);
+    }
+}
+
+/**
+ * Adds more of the message to every digest of a running multi-digest hash computation
+ * The message is worked through one MULTIHASH_CHUNK_SIZE piece at a time, and each piece is passed to every hash in turn
+ * before moving on, so only the first hash has to pull it in from memory and the rest find it already in the cache
+ * @param ctx (IN/OUT) the context of the running hash
+ * @param msg the next piece of the message (may contain any bytes, including 0s)
+ * @param len the length of msg in BYTES
+ */
+void multihash_update(multihash_ctx *ctx, const uint8_t *msg, size_t len) {
+    while (len > 0) {
+        size_t chunk_len = (len < MULTIHASH_CHUNK_SIZE) ? len : MULTIHASH_CHUNK_SIZE;
+
+        if (ctx->algorithms & MULTIHASH_MD5) {
+            md5_update(&ctx->md5, msg, chunk_len);
+        }
+        if (ctx->algorithms & MULTIHASH_SHA1) {
+            sha1_update(&ctx->sha1, msg, chunk_len);
+        }
+        if (ctx->algorithms & MULTIHASH_SHA256) {
+            sha256_update(&ctx->sha256, msg, chunk_len);
+        }
+        if (ctx->algorithms & MULTIHASH_SHA3_256) {
+            sha3_update(&ctx->sha3_256, msg, chunk_len);
+        }
+
+        msg += chunk_len;
+        len -= chunk_len;
+    }
+}
+
+/**
+ * Finishes a multi-digest hash computation
+ * @param ctx (IN/OUT) the context of the running hash, must be re-initialized before being used again
+ * @param digests (OUTPUT) where the requested digests will be put (the others are left untouched)
+ */
+void multihash_final(multihash_ctx *ctx, multihash_digests *digests) {
+    if (ctx->algorithms & MULTIHASH_MD5) {
+        md5_final(&ctx->md5, digests->md5);
+    }
+    if (ctx->algorithms & MULTIHASH_SHA1) {
+        sha1_final(&ctx->sha1, digests->sha1);
+    }
+    if (ctx->algorithms & MULTIHASH_SHA256) {
+        sha256_final(&ctx->sha256, digests->sha256);
+    }
+    if (ctx->algorithms & MULTIHASH_SHA3_256) {
+        sha3_final(&ctx->sha3_256, digests->sha3_256);
+    }
+}
+
+/**
+ * Computes several digests of a message in a single pass over it
+ * @param msg the message to calculate the digests of (may contain any bytes, including 0s)
+ * @param len the length of msg in BYTES
+ * @param algorithms the MULTIHASH_* digests to compute, OR'd together
+ * @param digests (OUTPUT) where the requested digests will be put
+ */
+void multihash(const uint8_t *msg, size_t len, int algorithms, multihash_digests *digests) {
+    multihash_ctx ctx;
+    multihash_init(&ctx, algorithms);
+    multihash_update(&ctx, msg, len);
+    multihash_final(&ctx, digests);
+}
+
+
+/*******************
+*** FILE HASHING ***
+*******************/
+/**
+ * Fills buf from a file, stopping early only at the end of the file (reads from pipes can come back short)
+ * @param fd the file descriptor to read from
+ * @param buf (OUTPUT) where the data read will be put
+ * @param size the size of buf in BYTES
+ * @returns the number of bytes read (0 at the end of the file), or -1 if the read failed
+ */
+ssize_t read_full(int fd, uint8_t *buf, size_t size) {
+    size_t len = 0;
+    while (len < size) {
+        ssize_t got = read(fd, buf + len, size - len);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0) {
+            return -1;
+        }
+        if (got == 0) {
+            break;
+        }
+        len += got;
+    }
+    return len;
+}
+
+/**
+ * Ring of buffers shared between the thread reading a file and one thread per digest being computed
+ * Every buffer that is read is hashed by all of the digest threads, and is only refilled once the slowest one is done with it
+ */
+typedef struct {
+    int fd; // The file (or pipe) being read
+    uint8_t *buffers[MULTIHASH_PIPELINE_SLOTS]; // MULTIHASH_READ_SIZE buffers, used in turn
+    ssize_t lens[MULTIHASH_PIPELINE_SLOTS]; // How much of each buffer holds data (0 at the end of the file, -1 if the read failed)
+    int pending[MULTIHASH_PIPELINE_SLOTS]; // How many digest threads have yet to hash each buffer
+    size_t num_read; // Total number of buffers filled so far (buffer i lives in slot i % MULTIHASH_PIPELINE_SLOTS)
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} multihash_pipeline;
+
+/**
+ * A digest thread, and the single digest it is computing
+ */
+typedef struct {
+    multihash_pipeline *pipeline;
+    multihash_ctx ctx; // Set up to compute just one of the MULTIHASH_* digests
+    pthread_t thread;
+} multihash_worker;
+
+/**
+ * Digest thread, hashes every buffer in the ring in order until the end of the file is reached
+ * @param arg the multihash_worker for this thread
+ * @returns NULL
+ */
+void* multihash_worker_thread(void *arg) {
+    multihash_worker *worker = arg;
+    multihash_pipeline *pipeline = worker->pipeline;
+
+    for (size_t i = 0; ; i++) {
+        int slot = i % MULTIHASH_PIPELINE_SLOTS;
+
+        // Wait for the reader to fill the next buffer
+        pthread_mutex_lock(&pipeline->lock);
+        while (pipeline->num_read <= i) {
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+        }
+        ssize_t len = pipeline->lens[slot];
+        pthread_mutex_unlock(&pipeline->lock);
+
+        if (len <= 0) {
+            return NULL;
+        }
+        multihash_update(&worker->ctx, pipeline->buffers[slot], len);
+
+        // Let the reader know this thread is done with the buffer
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->pending[slot]--;
+        pthread_cond_broadcast(&pipeline->changed);
+        pthread_mutex_unlock(&pipeline->lock);
+    }
+}
+
+/**
+ * Computes the digests on one thread per digest, while this thread keeps reading the file ahead of them
+ * @param fd the file descriptor to read until the end
+ * @param algorithms the MULTIHASH_* digests to compute, OR'd together
+ * @param digests (OUTPUT) where the requested digests will be put
+ * @returns 0 on success, or -1 if the file could not be read
+ */
+int multihash_fd_threaded(int fd, int algorithms, multihash_digests *digests) {
+    multihash_pipeline pipeline = {.fd = fd};
+    for (int slot = 0; slot < MULTIHASH_PIPELINE_SLOTS; slot++) {
+        if (posix_memalign((void**)&pipeline.buffers[slot], 4096, MULTIHASH_READ_SIZE) != 0) {
+            for (int i = 0; i < slot; i++) {
+                free(pipeline.buffers[i]);
+            }
+            return -1;
+        }
+    }
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.changed, NULL);
+
+    // Start a thread for each requested digest
+    multihash_worker workers[4];
+    int num_workers = 0;
+    int result = 0;
+    for (int algorithm = MULTIHASH_MD5; algorithm <= MULTIHASH_SHA3_256; algorithm <<= 1) {
+        if (!(algorithms & algorithm)) {
+            continue;
+        }
+        multihash_worker *worker = &workers[num_workers];
+        worker->pipeline = &pipeline;
+        multihash_init(&worker->ctx, algorithm);
+        if (pthread_create(&worker->thread, NULL, multihash_worker_thread, worker) != 0) {
+            result = -1;
+            break;
+        }
+        num_workers++;
+    }
+
+    // Keep filling buffers until the end of the file (or until a thread could not be started, in which case the
+    // empty read that ends the file is sent straight away so the threads that did start will stop)
+    for (size_t i = 0; ; i++) {
+        int slot = i % MULTIHASH_PIPELINE_SLOTS;
+
+        // Wait for every digest thread to be done with this buffer
+        pthread_mutex_lock(&pipeline.lock);
+        while (pipeline.pending[slot] > 0) {
+            pthread_cond_wait(&pipeline.changed, &pipeline.lock);
+        }
+        pthread_mutex_unlock(&pipeline.lock);
+
+        ssize_t len = (result == 0) ? read_full(fd, pipeline.buffers[slot], MULTIHASH_READ_SIZE) : 0;
+
+        // Hand the buffer over to the digest threads
+        pthread_mutex_lock(&pipeline.lock);
+        pipeline.lens[slot] = len;
+        pipeline.pending[slot] = num_workers;
+        pipeline.num_read++;
+        pthread_cond_broadcast(&pipeline.changed);
+        pthread_mutex_unlock(&pipeline.lock);
+
+        if (len < 0) {
+            result = -1;
+        }
+        if (len <= 0) {
+            break;
+        }
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (result == 0) {
+            multihash_final(&workers[i].ctx, digests);
+        }
+    }
+
+    pthread_mutex_destroy(&pipeline.lock);
+    pthread_cond_destroy(&pipeline.changed);
+    for (int slot = 0; slot < MULTIHASH_PIPELINE_SLOTS; slot++) {
+        free(pipeline.buffers[slot]);
+    }
+    return result;
+}
+
+/**
+ * Computes several digests of everything that can be read from a file descriptor (a file, pipe, socket, etc.), reading it only once
+ * @param fd the file descriptor to read until the end
+ * @param algorithms the MULTIHASH_* digests to compute, OR'd together
+ * @param digests (OUTPUT) where the requested digests will be put
+ * @param threaded 0 to compute every digest on this thread, or 1 to compute each digest on its own thread
+ * @returns 0 on success, or -1 if the file could not be read
+ */
+int multihash_fd(int fd, int algorithms, multihash_digests *digests, int threaded) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL); // Only a hint, so failure (e.g. on a pipe) does not matter
+    if (threaded) {
+        return multihash_fd_threaded(fd, algorithms, digests);
+    }
+
+    uint8_t *buffer = malloc(MULTIHASH_READ_SIZE);
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    multihash_ctx ctx;
+    multihash_init(&ctx, algorithms);
+    ssize_t len;
+    while ((len = read_full(fd, buffer, MULTIHASH_READ_SIZE)) > 0) {
+        multihash_update(&ctx, buffer, len);
+    }
+    if (len == 0) {
+        multihash_final(&ctx, digests);
+    }
+
+    free(buffer);
+    return (len == 0) ? 0 : -1;
+}
+
+
+/**************
+*** TESTING ***
+**************/
+/**
+ * Prints a digest in hex
+ * @param name the name of the digest
+ * @param digest the digest to print
+ * @param len the length of digest in BYTES
+ */
+void print_digest(const char *name, const uint8_t *digest, int len) {
+    printf("%-8s = ", name);
+    for (int i = 0; i < len; i++) {
+        printf("%02x", digest[i]);
+    }
+    printf("\n");
+}
+
+/**
+ * Checks that every digest in a multihash_digests matches hashing the message with each hash function by itself
+ * @param msg the message that was hashed
+ * @param len the length of msg in BYTES
+ * @param digests the digests to check
+ * @param what a description of how the digests were computed, for the error messages
+ */
+void check_digests(const uint8_t *msg, size_t len, const multihash_digests *digests, const char *what) {
+    uint8_t *single_digest = md5(msg, len);
+    if (memcmp(digests->md5, single_digest, 128/8) != 0) {
+        printf("ERROR: %s MD5 digest and one-shot digest are NOT the same!\n", what);
+    }
+    free(single_digest);
+
+    single_digest = sha1(msg, len);
+    if (memcmp(digests->sha1, single_digest, 160/8) != 0) {
+        printf("ERROR: %s SHA-1 digest and one-shot digest are NOT the same!\n", what);
+    }
+    free(single_digest);
+
+    single_digest = sha256(msg, len);
+    if (memcmp(digests->sha256, single_digest, 256/8) != 0) {
+        printf("ERROR: %s SHA-256 digest and one-shot digest are NOT the same!\n", what);
+    }
+    free(single_digest);
+
+    sha3_ctx ctx;
+    uint8_t sha3_digest[256/8];
+    sha3_init(&ctx);
+    sha3_update(&ctx, msg, len);
+    sha3_final(&ctx, sha3_digest);
+    if (memcmp(digests->sha3_256, sha3_digest, 256/8) != 0) {
+        printf("ERROR: %s SHA3-256 digest and one-shot digest are NOT the same!\n", what);
+    }
+}
+
+int main() {
+    // Set test variables for the hashes
+    uint8_t msg[] = "The quick brown fox jumps over the lazy dog";
+    printf("message = %s\n", msg);
+
+    multihash_digests digests;
+    multihash(msg, strlen(msg), MULTIHASH_ALL, &digests);
+    print_digest("MD5", digests.md5, 128/8);
+    print_digest("SHA-1", digests.sha1, 160/8);
+    print_digest("SHA-256", digests.sha256, 256/8);
+    print_digest("SHA3-256", digests.sha3_256, 256/8);
+    check_digests(msg, strlen(msg), &digests, "In-memory");
+
+    // Sanity check hashing from a file descriptor, on this thread and then with a thread per digest
+    size_t file_len = 3*MULTIHASH_READ_SIZE + 100;
+    uint8_t *file_data = malloc(file_len);
+    for (size_t i = 0; i < file_len; i++) {
+        file_data[i] = i * 7;
+    }
+    for (int threaded = 0; threaded <= 1; threaded++) {
+        FILE *file = tmpfile();
+        multihash_digests file_digests;
+        if (file == NULL || fwrite(file_data, 1, file_len, file) != file_len || fflush(file) != 0 || lseek(fileno(file), 0, SEEK_SET) != 0
+            || multihash_fd(fileno(file), MULTIHASH_ALL, &file_digests, threaded) != 0) {
+            printf("ERROR: Could not hash the temporary file!\n");
+        }
+        else {
+            check_digests(file_data, file_len, &file_digests, threaded ? "Threaded file" : "File");
+        }
+        if (file != NULL) {
+            fclose(file);
+        }
+    }
+    free(file_data);
+
+    return 0;
+}
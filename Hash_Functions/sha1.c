@@ -2,48 +2,60 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_X86_INTRINSICS
+#endif
+
+#include "fd_reader.h" // The threaded file reader, shared with MD5
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 /****************
 *** CONSTANTS ***
 ****************/
-// Values H0[0] - H[3] were taken from the MD5 algorithm, H[4] was extended from those values
-uint32_t H0[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+// Values sha1_H0[0] - H[3] were taken from the MD5 algorithm, H[4] was extended from those values
+uint32_t sha1_H0[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
 
 
 /********************
 *** PREPROCESSING ***
 ********************/
 /**
- * Pad the message to be a multiple of the 512 bits
+ * Pads the trailing partial block of a message out to a multiple of 512 bits
  * Will append a 1, then k zero bits, and then a 64-bit block at the end containing the original msg length
- * @param msg the original message to pad
- * @param len the length of msg in BYTES
- * @param padded (OUTPUT) a double pointer where the outputted padded message will be but
- * @param len_padded (OUTPUT) the length of the padded message in BYTES
+ * Only the final (<64 byte) piece of the message is ever copied, all full blocks are compressed straight from the caller's memory
+ * @param tail the trailing bytes of the message that did not fill a whole 512-bit block
+ * @param tail_len the length of tail in BYTES (must be less than 64)
+ * @param total_len the length of the WHOLE original message in BYTES
+ * @param padded (OUTPUT) a 128-byte buffer where the padded final block(s) will be put
+ * @returns the number of 512-bit blocks written to padded (either 1 or 2)
  */
-void pad_msg(uint8_t *msg, int len, uint8_t **padded, int *len_padded) {
-    // The number of 0s needed, k, is given by: k = (512 - 64 - len - 1) = 448 - (len + 1) mod 512
-    int k = (448 - 8*len) % 512;
-    if (k < 0) {
-        k += 512;
-    }
+int sha1_pad_msg(const uint8_t *tail, size_t tail_len, uint64_t total_len, uint8_t *padded) {
+    // The padding needs 1 byte for the leading 1 bit and 8 bytes for the length
+    // If that does not fit after the tail, then the padding spills over into a second block
+    int num_blocks = (tail_len + 1 + 8 <= 64) ? 1 : 2;
 
-    // Will append a 1, then k zero bits, and then a 64-bit block at the end containing the original msg length
-    // Add an extra bit to k for the leading 1 bit, and then convert # bits to # bytes
-    *len_padded = len + (k+1)/8 + 64/8;
-    *padded = malloc(*len_padded);
-
-    memcpy(*padded, msg, len); // Copy over the original message
-    memset(*padded + len, 0, (*len_padded - len)); // Set all padded bits to 0
-    (*padded)[len] = 0x80; // Set the most significant padded bit to 1
+    memcpy(padded, tail, tail_len); // Copy over the end of the original message
+    memset(padded + tail_len, 0, 64*num_blocks - tail_len); // Set all padded bits to 0
+    padded[tail_len] = 0x80; // Set the most significant padded bit to 1
 
     // Set the last 64 bits as the 64-bit representation of the original msg length (IN BITS)
     // This implementation uses LITTLE ENDIAN, so must convert to BIG ENDIAN for SHA-1 algorithm
-    uint64_t len64 = (uint64_t)(len * 8);
+    uint64_t len64 = total_len * 8;
     for (int i = 0; i < 8; i++) {
-        (*padded)[*len_padded - 1 - i] = len64 >> 8*i;
+        padded[64*num_blocks - 1 - i] = len64 >> 8*i;
     }
+
+    return num_blocks;
 }
 
 
@@ -56,7 +68,7 @@ void pad_msg(uint8_t *msg, int len, uint8_t **padded, int *len_padded) {
  * @param n number of bits to rotate left
  * @returns the resulting rotated value
  */
-uint32_t rotl(uint32_t w, int n) {
+uint32_t sha1_rotl(uint32_t w, int n) {
     return (w << n) | (w >> (32 - n));
 }
 
@@ -67,7 +79,7 @@ uint32_t rotl(uint32_t w, int n) {
  * @param z the input to choose from when x's bit = 1
  * @returns the result of the choosing
  */
-uint32_t ch(uint32_t x, uint32_t y, uint32_t z) {
+uint32_t sha1_ch(uint32_t x, uint32_t y, uint32_t z) {
     return (x & y) ^ (~x & z);
 }
 
@@ -78,22 +90,205 @@ uint32_t ch(uint32_t x, uint32_t y, uint32_t z) {
  * @param z the third input
  * @returns the result of the majority bits within x, y, and z
  */
-uint32_t maj(uint32_t x, uint32_t y, uint32_t z) {
+uint32_t sha1_maj(uint32_t x, uint32_t y, uint32_t z) {
     return (x & y) ^ (x & z) ^ (y & z);
 }
 
+/**
+ * Performs the Parity function, which is the XOR of the respective bits of x, y, and z
+ * @param x the first input
+ * @param y the second input
+ * @param z the third input
+ * @returns the result of XOR'ing x, y, and z
+ */
+uint32_t sha1_parity(uint32_t x, uint32_t y, uint32_t z) {
+    return x ^ y ^ z;
+}
+
+/**
+ * Derives the next 4 words of the message schedule, W[t] to W[t+3], from the previous 16 words
+ * W[i] = rotl(W[i-3] ^ W[i-8] ^ W[i-14] ^ W[i-16], 1), but only the 16 most recent words are kept (W[i] overwrites W[i-16])
+ * @param W (IN/OUT) the 16-word ring buffer holding the message schedule
+ * @param t the index of the first word to derive (must be a multiple of 4)
+ */
+void sha1_schedule_4(uint32_t *W, int t) {
+#ifdef __SSE2__
+    // Each register holds 4 consecutive words, W_16 = W[t-16..t-13], W_12 = W[t-12..t-9], etc.
+    __m128i W_16 = _mm_loadu_si128((const __m128i*)&W[(t + 0) & 15]);
+    __m128i W_12 = _mm_loadu_si128((const __m128i*)&W[(t + 4) & 15]);
+    __m128i W_8 = _mm_loadu_si128((const __m128i*)&W[(t + 8) & 15]);
+    __m128i W_4 = _mm_loadu_si128((const __m128i*)&W[(t + 12) & 15]);
+
+    __m128i W_3 = _mm_srli_si128(W_4, 4); // W[t-3..t-1], with 0 in place of W[t] (which is not known yet)
+    __m128i W_14 = _mm_unpacklo_epi64(_mm_unpackhi_epi64(W_16, W_16), W_12); // W[t-14..t-11]
+    __m128i x = _mm_xor_si128(_mm_xor_si128(W_3, W_8), _mm_xor_si128(W_14, W_16));
+    __m128i result = _mm_or_si128(_mm_slli_epi32(x, 1), _mm_srli_epi32(x, 31));
+
+    // W[t+3] was missing the W[t] term, now that W[t] is known it can be XOR'ed in (rotating distributes over XOR)
+    __m128i fix = _mm_slli_si128(result, 12);
+    result = _mm_xor_si128(result, _mm_or_si128(_mm_slli_epi32(fix, 1), _mm_srli_epi32(fix, 31)));
+
+    _mm_storeu_si128((__m128i*)&W[t & 15], result);
+#else
+    for (int i = t; i < t + 4; i++) {
+        W[i & 15] = sha1_rotl(W[(i - 3) & 15] ^ W[(i - 8) & 15] ^ W[(i - 14) & 15] ^ W[(i - 16) & 15], 1);
+    }
+#endif
+}
+
+
+/****************************
+*** HARDWARE ACCELERATION ***
+****************************/
+#ifdef HAVE_X86_INTRINSICS
+/**
+ * Checks (via CPUID) whether the processor supports the SHA extensions (SHA-NI) along with the SSSE3/SSE4.1 instructions used alongside them
+ * @returns 1 if the SHA-NI compression function can be used, otherwise 0
+ */
+int sha1_cpu_has_sha_ni() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1)) {
+        return 0;
+    }
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    return (ebx & bit_SHA) ? 1 : 0;
+}
+
+/**
+ * Checks whether the SHA-NI compression function should be used (checked once via CPUID)
+ * @returns 1 if the SHA-NI compression function can be used, otherwise 0
+ */
+int sha1_use_sha_ni() {
+    static atomic_int cached_use_shani = -1; // -1 until the CPU has been checked (atomic, since the first checks can come from several threads at once)
+    int use_shani = atomic_load(&cached_use_shani);
+    if (use_shani < 0) {
+        use_shani = sha1_cpu_has_sha_ni();
+        atomic_store(&cached_use_shani, use_shani);
+    }
+    return use_shani;
+}
+
+// Performs 4 rounds using the 4 message schedule words in X, with the round function/constant chosen by FUNC (0-3 for each 20 round stage)
+// E_IN holds E from 4 rounds ago (SHA1NEXTE rotates it and adds it into X), E_OUT saves the current ABCD to become the next E
+#define SHA1NI_RNDS(FUNC, X, E_IN, E_OUT) \
+    E_IN = _mm_sha1nexte_epu32(E_IN, X); \
+    E_OUT = ABCD; \
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E_IN, FUNC)
+
+// The message schedule is derived 4 words at a time, W[i] = rotl(W[i-3] ^ W[i-8] ^ W[i-14] ^ W[i-16], 1) is split across
+// SHA1MSG1 (W[i-14] ^ W[i-16]), a plain XOR (W[i-8]), and SHA1MSG2 (W[i-3] and the rotation)
+#define SHA1NI_MSG1(A, B) A = _mm_sha1msg1_epu32(A, B)
+#define SHA1NI_XOR(A, B) A = _mm_xor_si128(A, B)
+#define SHA1NI_MSG2(A, B) A = _mm_sha1msg2_epu32(A, B)
+
+/**
+ * Performs the core compression function of SHA-1 using the SHA-NI instructions
+ * @param blocks the 512-bit blocks of the message that are being worked on
+ * @param num_blocks the number of 512-bit blocks in blocks
+ * @param prev_H (IN/OUT) the outputted hash message from the previous call to this function (or the initial hash). Will contain the resulting hash upon return
+ */
+__attribute__((target("sha,ssse3,sse4.1")))
+void sha1_compress_shani(const uint8_t *blocks, size_t num_blocks, uint32_t *prev_H) {
+    // Used to flip the block from LITTLE ENDIAN to the BIG ENDIAN that SHA works in (and to put W[0] in the top word)
+    const __m128i BSWAP = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i MSG0, MSG1, MSG2, MSG3;
+    __m128i E0, E1;
+
+    // The SHA-NI instructions expect A in the top word, and E on its own in the top word of another register
+    __m128i ABCD = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)prev_H), 0x1B);
+    __m128i E = _mm_set_epi32(prev_H[4], 0, 0, 0);
+
+    for (size_t block_index = 0; block_index < num_blocks; block_index++) {
+        const uint8_t *block = &blocks[block_index * 64];
+        __m128i ABCD_SAVE = ABCD;
+        __m128i E_SAVE = E;
+
+        // The first 16 words are set to the current block
+        MSG0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 0)), BSWAP);
+        MSG1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 16)), BSWAP);
+        MSG2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 32)), BSWAP);
+        MSG3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 48)), BSWAP);
+
+        // Rounds 0-3 use E directly (there is no previous ABCD to rotate)
+        E0 = _mm_add_epi32(E, MSG0);
+        E1 = ABCD;
+        ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+
+        // Perform the remaining 76 rounds 4 at a time, while deriving the message schedule 4 words at a time
+        SHA1NI_RNDS(0, MSG1, E1, E0); SHA1NI_MSG1(MSG0, MSG1);
+        SHA1NI_RNDS(0, MSG2, E0, E1); SHA1NI_MSG1(MSG1, MSG2); SHA1NI_XOR(MSG0, MSG2);
+        SHA1NI_MSG2(MSG0, MSG3); SHA1NI_RNDS(0, MSG3, E1, E0); SHA1NI_MSG1(MSG2, MSG3); SHA1NI_XOR(MSG1, MSG3);
+        SHA1NI_MSG2(MSG1, MSG0); SHA1NI_RNDS(0, MSG0, E0, E1); SHA1NI_MSG1(MSG3, MSG0); SHA1NI_XOR(MSG2, MSG0);
+
+        SHA1NI_MSG2(MSG2, MSG1); SHA1NI_RNDS(1, MSG1, E1, E0); SHA1NI_MSG1(MSG0, MSG1); SHA1NI_XOR(MSG3, MSG1);
+        SHA1NI_MSG2(MSG3, MSG2); SHA1NI_RNDS(1, MSG2, E0, E1); SHA1NI_MSG1(MSG1, MSG2); SHA1NI_XOR(MSG0, MSG2);
+        SHA1NI_MSG2(MSG0, MSG3); SHA1NI_RNDS(1, MSG3, E1, E0); SHA1NI_MSG1(MSG2, MSG3); SHA1NI_XOR(MSG1, MSG3);
+        SHA1NI_MSG2(MSG1, MSG0); SHA1NI_RNDS(1, MSG0, E0, E1); SHA1NI_MSG1(MSG3, MSG0); SHA1NI_XOR(MSG2, MSG0);
+        SHA1NI_MSG2(MSG2, MSG1); SHA1NI_RNDS(1, MSG1, E1, E0); SHA1NI_MSG1(MSG0, MSG1); SHA1NI_XOR(MSG3, MSG1);
+
+        SHA1NI_MSG2(MSG3, MSG2); SHA1NI_RNDS(2, MSG2, E0, E1); SHA1NI_MSG1(MSG1, MSG2); SHA1NI_XOR(MSG0, MSG2);
+        SHA1NI_MSG2(MSG0, MSG3); SHA1NI_RNDS(2, MSG3, E1, E0); SHA1NI_MSG1(MSG2, MSG3); SHA1NI_XOR(MSG1, MSG3);
+        SHA1NI_MSG2(MSG1, MSG0); SHA1NI_RNDS(2, MSG0, E0, E1); SHA1NI_MSG1(MSG3, MSG0); SHA1NI_XOR(MSG2, MSG0);
+        SHA1NI_MSG2(MSG2, MSG1); SHA1NI_RNDS(2, MSG1, E1, E0); SHA1NI_MSG1(MSG0, MSG1); SHA1NI_XOR(MSG3, MSG1);
+        SHA1NI_MSG2(MSG3, MSG2); SHA1NI_RNDS(2, MSG2, E0, E1); SHA1NI_MSG1(MSG1, MSG2); SHA1NI_XOR(MSG0, MSG2);
+
+        SHA1NI_MSG2(MSG0, MSG3); SHA1NI_RNDS(3, MSG3, E1, E0); SHA1NI_MSG1(MSG2, MSG3); SHA1NI_XOR(MSG1, MSG3);
+        SHA1NI_MSG2(MSG1, MSG0); SHA1NI_RNDS(3, MSG0, E0, E1); SHA1NI_MSG1(MSG3, MSG0); SHA1NI_XOR(MSG2, MSG0);
+        SHA1NI_MSG2(MSG2, MSG1); SHA1NI_RNDS(3, MSG1, E1, E0); SHA1NI_XOR(MSG3, MSG1);
+        SHA1NI_MSG2(MSG3, MSG2); SHA1NI_RNDS(3, MSG2, E0, E1);
+        SHA1NI_RNDS(3, MSG3, E1, E0);
+
+        // Add the results to the previous hash to get the NEW hash
+        E = _mm_sha1nexte_epu32(E0, E_SAVE);
+        ABCD = _mm_add_epi32(ABCD, ABCD_SAVE);
+    }
+
+    // Convert back into A..E order
+    _mm_storeu_si128((__m128i*)prev_H, _mm_shuffle_epi32(ABCD, 0x1B));
+    prev_H[4] = _mm_extract_epi32(E, 3);
+}
+#endif
+
 
 /**********************
 *** CORE SHA-1 HASH ***
 **********************/
+// A single iteration of the compression function
+// Rather than shifting every state variable down one (E = D, D = C, ...), the caller renames the variables for the next round
+// So only the two variables that actually change (e becomes the new A, b becomes the new C) are written
+#define SHA1_ROUND(a, b, c, d, e, f, k, i) \
+    e += sha1_rotl(a, 5) + f(b, c, d) + k + W[(i) & 15]; \
+    b = sha1_rotl(b, 30)
+
+// 4 iterations of the compression function, deriving the 4 message schedule words they use first (the first 16 words come straight from the block)
+#define SHA1_ROUNDS_4(a, b, c, d, e, f, k, i) \
+    if ((i) >= 16) { \
+        sha1_schedule_4(W, i); \
+    } \
+    SHA1_ROUND(a, b, c, d, e, f, k, (i) + 0); \
+    SHA1_ROUND(e, a, b, c, d, f, k, (i) + 1); \
+    SHA1_ROUND(d, e, a, b, c, f, k, (i) + 2); \
+    SHA1_ROUND(c, d, e, a, b, f, k, (i) + 3)
+
+// One of the four 20-iteration stages, each with its own function and constant, after which the variables are back in their original places
+#define SHA1_STAGE(f, k, i) \
+    SHA1_ROUNDS_4(A, B, C, D, E, f, k, (i) + 0); \
+    SHA1_ROUNDS_4(B, C, D, E, A, f, k, (i) + 4); \
+    SHA1_ROUNDS_4(C, D, E, A, B, f, k, (i) + 8); \
+    SHA1_ROUNDS_4(D, E, A, B, C, f, k, (i) + 12); \
+    SHA1_ROUNDS_4(E, A, B, C, D, f, k, (i) + 16)
+
 /**
  * Performs the core compression function of SHA-1
+ * All 80 iterations are unrolled into their four stages and the message schedule is computed as it is needed, so nothing is allocated
  * @param block the 512-bit block of the message that is being worked on
  * @param prev_H (IN/OUT) the outputted hash message from the previous call to this function (or the initial hash). Will contain the resulting hash upon return
  */
-void compress(uint8_t* block, uint32_t *prev_H) {
-    /*** Create the 80-entry message schedule ***/
-    uint32_t *W = calloc(80, sizeof(uint32_t));
+void sha1_compress(const uint8_t* block, uint32_t *prev_H) {
+    /*** Create the first 16 entries of the message schedule ***/
+    uint32_t W[16];
 
     // The first 16 words are set to the current block
     // Have to do extra work since SHA works in BIG ENDIAN, but this implementation is in LITTLE ENDIAN
@@ -101,11 +296,6 @@ void compress(uint8_t* block, uint32_t *prev_H) {
         W[i] = (block[4*i] << 24) | (block[4*i + 1] << 16) | (block[4*i + 2] << 8) | (block[4*i + 3]);
     }
 
-    // The remainder of the message schedule is derived from the words within the block
-    for (int i = 16; i < 80; i++) {
-        W[i] = rotl(W[i-3] ^ W[i-8] ^ W[i-14] ^ W[i-16], 1);
-    }
-
     /*** Perform the compression iteration 80 times ***/
     // Initialize the states
     uint32_t A = prev_H[0];
@@ -115,35 +305,11 @@ void compress(uint8_t* block, uint32_t *prev_H) {
     uint32_t E = prev_H[4];
 
     // Perform the iteration function
-    for (int i = 0; i < 80; i++) {
-        // Get the values for F and k
-        // Values for k were chosen by doing 2^30 times the square roots of 2, 3, 5, and 10, rounded to the nearest integer
-        uint32_t F = 0;
-        uint32_t k = 0;
-        if (i < 20) {
-            F = ch(B, C, D);
-            k = 0x5A827999;
-        }
-        else if (i < 40) {
-            F = B ^ C ^ D;
-            k = 0x6ED9EBA1;
-        }
-        else if (i < 60) {
-            F = maj(B, C, D);
-            k = 0x8F1BBCDC;
-        }
-        else {
-            F = B ^ C ^ D;
-            k = 0xCA62C1D6;
-        }
-
-        uint32_t temp = rotl(A, 5) + F + E + k + W[i];
-        E = D;
-        D = C;
-        C = rotl(B, 30);
-        B = A;
-        A = temp;
-    }
+    // Values for k were chosen by doing 2^30 times the square roots of 2, 3, 5, and 10, rounded to the nearest integer
+    SHA1_STAGE(sha1_ch, 0x5A827999, 0);
+    SHA1_STAGE(sha1_parity, 0x6ED9EBA1, 20);
+    SHA1_STAGE(sha1_maj, 0x8F1BBCDC, 40);
+    SHA1_STAGE(sha1_parity, 0xCA62C1D6, 60);
 
     // Add the results to the previous hash to get the NEW hash
     prev_H[0] += A; 
@@ -154,49 +320,177 @@ void compress(uint8_t* block, uint32_t *prev_H) {
 }
 
 /**
- * Performs the SHA-1 hash function
- * @param msg the message to calculate the hash of
- * @returns the digest of the msg
+ * Performs the compression function over several consecutive blocks
+ * Uses the SHA-NI instructions when the processor has them (checked once via CPUID), otherwise the portable sha1_compress() above
+ * Both give byte-identical results
+ * @param blocks the 512-bit blocks of the message that are being worked on
+ * @param num_blocks the number of 512-bit blocks in blocks
+ * @param prev_H (IN/OUT) the outputted hash message from the previous call to this function (or the initial hash). Will contain the resulting hash upon return
+ */
+void sha1_compress_blocks(const uint8_t *blocks, size_t num_blocks, uint32_t *prev_H) {
+#ifdef HAVE_X86_INTRINSICS
+    if (sha1_use_sha_ni()) {
+        sha1_compress_shani(blocks, num_blocks, prev_H);
+        return;
+    }
+#endif
+
+    for (size_t block_index = 0; block_index < num_blocks; block_index++) {
+        sha1_compress(&blocks[block_index * 64], prev_H);
+    }
+}
+
+/**
+ * Internal state for computing a SHA-1 hash incrementally
+ * Lets a message be hashed in pieces (e.g. as it is read from a file) without ever holding the whole thing in memory
+ */
+typedef struct {
+    uint32_t H[5]; // The most recent hash value
+    uint8_t buffer[64]; // Holds the start of a block until the caller has provided all 64 bytes of it
+    size_t buffer_len; // Number of bytes currently held in buffer
+    uint64_t total_len; // Total length of the message processed so far in BYTES
+} sha1_ctx;
+
+/**
+ * Starts a new SHA-1 hash computation
+ * @param ctx (OUTPUT) the context to initialize
+ */
+void sha1_init(sha1_ctx *ctx) {
+    memcpy(ctx->H, sha1_H0, 160/8); // Set the initial hash value to the constant sha1_H0
+    ctx->buffer_len = 0;
+    ctx->total_len = 0;
+}
+
+/**
+ * Adds more of the message to a running SHA-1 hash computation
+ * Full blocks are compressed directly out of msg, only a trailing partial block is buffered until the next call
+ * @param ctx (IN/OUT) the context of the running hash
+ * @param msg the next piece of the message (may contain any bytes, including 0s)
+ * @param len the length of msg in BYTES
  */
-uint8_t* sha1(uint8_t *msg) {
-    /*** PREPROCESSING ***/
-    // Pad the message
-    uint8_t *padded = NULL;
-    int padded_len = 0;
-    pad_msg(msg, strlen(msg), &padded, &padded_len);
-    // Breaking the padded message into blocks will be done in the main loop
+void sha1_update(sha1_ctx *ctx, const uint8_t *msg, size_t len) {
+    ctx->total_len += len;
 
-    /*** CORE HASH FUNCTIONALITY ***/
-    uint32_t H[5] = {0}; // The most recent hash value
-    memcpy(H, H0, 160/8); // Set the initial hash value to the constant H0
+    // Top up a partially filled block from a previous call first
+    if (ctx->buffer_len > 0) {
+        size_t needed = 64 - ctx->buffer_len;
+        size_t taken = (len < needed) ? len : needed;
+        memcpy(ctx->buffer + ctx->buffer_len, msg, taken);
+        ctx->buffer_len += taken;
+        msg += taken;
+        len -= taken;
 
-    // Perform the compression function for each block in the message
-    for (int block_index = 0; block_index < (padded_len / 64); block_index++) {
-        uint8_t* block = &padded[block_index * 64];
-        compress(block, H);
+        if (ctx->buffer_len < 64) {
+            return;
+        }
+        sha1_compress_blocks(ctx->buffer, 1, ctx->H);
+        ctx->buffer_len = 0;
     }
 
+    // Perform the compression function for each full block, straight from the caller's memory
+    size_t num_blocks = len / 64;
+    sha1_compress_blocks(msg, num_blocks, ctx->H);
+    msg += 64*num_blocks;
+    len -= 64*num_blocks;
+
+    // Hold onto whatever is left until more of the message arrives (or the hash is finished)
+    memcpy(ctx->buffer, msg, len);
+    ctx->buffer_len = len;
+}
+
+/**
+ * Finishes a SHA-1 hash computation by padding and compressing the last block
+ * @param ctx (IN/OUT) the context of the running hash, must be re-initialized before being used again
+ * @param digest (OUTPUT) 160-bit (20-byte) buffer where the digest of the msg will be put
+ */
+void sha1_final(sha1_ctx *ctx, uint8_t *digest) {
+    // Pad the message, only the final partial block gets copied
+    uint8_t padded[128];
+    int num_blocks = sha1_pad_msg(ctx->buffer, ctx->buffer_len, ctx->total_len, padded);
+    sha1_compress_blocks(padded, num_blocks, ctx->H);
+
     // Convert the BIG ENDIAN final hash back into LITTLE ENDIAN for this implementation
     // (Also converts the word-index hash back into byte-index)
-    uint8_t *digest = malloc(160/8);
     for (int i = 0; i < 160/8; i++) {
-        digest[i] = (H[i/4] >> (24 - 8*i)) & 0x000000FF;
+        digest[i] = (ctx->H[i/4] >> (24 - 8*(i%4))) & 0x000000FF;
     }
+}
+
+/**
+ * Performs the SHA-1 hash function
+ * @param msg the message to calculate the hash of (may contain any bytes, including 0s)
+ * @param len the length of msg in BYTES
+ * @returns the digest of the msg
+ */
+uint8_t* sha1(const uint8_t *msg, size_t len) {
+    sha1_ctx ctx;
+    sha1_init(&ctx);
+    sha1_update(&ctx, msg, len);
 
-    free(padded);
+    uint8_t *digest = malloc(160/8);
+    sha1_final(&ctx, digest);
     return digest;
 }
 
 
+/*******************
+*** FILE HASHING ***
+*******************/
+/**
+ * Adds a chunk of a file to a running SHA-1 hash computation, in the form fd_read_all() calls
+ * @param ctx the sha1_ctx of the running hash
+ * @param data the next chunk of the file
+ * @param len the length of data in BYTES
+ */
+void sha1_fd_update(void *ctx, const uint8_t *data, size_t len) {
+    sha1_update(ctx, data, len);
+}
+
+/**
+ * Performs the SHA-1 hash function on everything that can be read from a file descriptor (a file, pipe, socket, etc.)
+ * The file is never held in memory all at once, one thread reads the next chunk while this one hashes the previous one
+ * @param fd the file descriptor to read until the end
+ * @param digest (OUTPUT) 160-bit (20-byte) buffer where the digest of the file will be put
+ * @returns 0 on success, or -1 if the file could not be read
+ */
+int sha1_fd(int fd, uint8_t *digest) {
+    sha1_ctx ctx;
+    sha1_init(&ctx);
+    if (fd_read_all(fd, sha1_fd_update, &ctx) != 0) {
+        return -1;
+    }
+    sha1_final(&ctx, digest);
+    return 0;
+}
+
+
 /**************
 *** TESTING ***
 **************/
+/**
+ * Writes one million 'a' characters into a pipe, 1000 at a time, and then closes it
+ * @param arg pointer to the write end of the pipe
+ * @returns NULL
+ */
+void* million_a_writer(void *arg) {
+    int fd = *(int*)arg;
+    uint8_t piece[1000];
+    memset(piece, 'a', sizeof(piece));
+    for (int i = 0; i < 1000; i++) {
+        if (write(fd, piece, sizeof(piece)) != (ssize_t)sizeof(piece)) {
+            break;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
 int main() {    
     // Set test variables for the cipher
     uint8_t msg[] = "The quick brown fox jumps over the lazy dog";
     printf("message = %s\n", msg);
 
-    uint8_t *digest = sha1(msg);
+    uint8_t *digest = sha1(msg, strlen(msg));
     printf("digest = %s\n", digest);
     printf("       = ");
     for (int i = 0; i < 160/8; i++) {
@@ -204,6 +498,68 @@ int main() {
     }
     printf("\n");
 
+    // Sanity check the streaming interface gives the same digest when fed one byte at a time
+    sha1_ctx ctx;
+    uint8_t streamed_digest[160/8];
+    sha1_init(&ctx);
+    for (size_t i = 0; i < strlen(msg); i++) {
+        sha1_update(&ctx, &msg[i], 1);
+    }
+    sha1_final(&ctx, streamed_digest);
+    if (memcmp(digest, streamed_digest, 160/8) != 0) {
+        printf("ERROR: Streamed digest and one-shot digest are NOT the same!\n");
+    }
+
+    // Sanity check hashing from a pipe against the FIPS 180 "one million a's" known answer
+    // The writer only puts 1000 bytes in the pipe at a time, so the reads come back short
+    uint8_t expected_pipe_digest[160/8] = {
+        0x34, 0xaa, 0x97, 0x3c, 0xd4, 0xc4, 0xda, 0xa4, 0xf6, 0x1e, 0xeb, 0x2b, 0xdb, 0xad, 0x27, 0x31, 0x65, 0x34, 0x01, 0x6f
+    };
+    int pipe_fds[2];
+    pthread_t writer;
+    uint8_t pipe_digest[160/8];
+    if (pipe(pipe_fds) != 0) {
+        printf("ERROR: Could not create a pipe!\n");
+    }
+    else {
+        if (pthread_create(&writer, NULL, million_a_writer, &pipe_fds[1]) != 0) {
+            printf("ERROR: Could not start the pipe writer!\n");
+            close(pipe_fds[1]);
+        }
+        else {
+            if (sha1_fd(pipe_fds[0], pipe_digest) != 0) {
+                printf("ERROR: Could not hash the pipe!\n");
+            }
+            else if (memcmp(pipe_digest, expected_pipe_digest, 160/8) != 0) {
+                printf("ERROR: Pipe digest does NOT match the known answer!\n");
+            }
+            pthread_join(writer, NULL);
+        }
+        close(pipe_fds[0]);
+    }
+
+#ifdef HAVE_X86_INTRINSICS
+    // Sanity check the SHA-NI compression function against the portable one from a random state over random blocks
+    // (sha1_compress_blocks always picks SHA-NI when the processor has it, so nothing else here would reach sha1_compress)
+    if (sha1_use_sha_ni()) {
+        uint8_t blocks[8*64];
+        uint32_t scalar_H[5], shani_H[5];
+        for (int i = 0; i < 8*64; i++) {
+            blocks[i] = rand();
+        }
+        for (int i = 0; i < 5; i++) {
+            scalar_H[i] = shani_H[i] = ((uint32_t)rand() << 16) ^ rand();
+        }
+        for (int i = 0; i < 8; i++) {
+            sha1_compress(&blocks[i * 64], scalar_H);
+        }
+        sha1_compress_shani(blocks, 8, shani_H);
+        if (memcmp(scalar_H, shani_H, sizeof(scalar_H)) != 0) {
+            printf("ERROR: SHA-NI and portable compression functions do NOT give the same hash!\n");
+        }
+    }
+#endif
+
     free(digest);
     return 0;
 }
\ No newline at end of file
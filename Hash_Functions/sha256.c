@@ -2,13 +2,22 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "lanes.h" // The CPU feature checks and the multi-buffer lane scheduler, shared with MD5 and SHA-3
+
+#ifdef HAVE_X86_INTRINSICS
+#include <immintrin.h>
+#endif
 
 
 /****************
 *** CONSTANTS ***
 ****************/
 // Derived from the fractional parts of the cube roots of the first 64 prime numbers to show there is no backdoor
-uint32_t k[64] = {
+uint32_t sha256_k[64] = {
 	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5, 
 	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 
 	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 
@@ -20,42 +29,39 @@ uint32_t k[64] = {
 };
 
 // Derived from the fractional parts of the square roots of the first 8 prime numbers to show there is no backdoor
-uint32_t H0[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+uint32_t sha256_H0[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
 
 
 /********************
 *** PREPROCESSING ***
 ********************/
 /**
- * Pad the message to be a multiple of the 512 bits
+ * Pads the trailing partial block of a message out to a multiple of 512 bits
  * Will append a 1, then k zero bits, and then a 64-bit block at the end containing the original msg length
- * @param msg the original message to pad
- * @param len the length of msg in BYTES
- * @param padded (OUTPUT) a double pointer where the outputted padded message will be but
- * @param len_padded (OUTPUT) the length of the padded message in BYTES
+ * Only the final (<64 byte) piece of the message is ever copied, all full blocks are compressed straight from the caller's memory
+ * @param tail the trailing bytes of the message that did not fill a whole 512-bit block
+ * @param tail_len the length of tail in BYTES (must be less than 64)
+ * @param total_len the length of the WHOLE original message in BYTES
+ * @param padded (OUTPUT) a 128-byte buffer where the padded final block(s) will be put
+ * @returns the number of 512-bit blocks written to padded (either 1 or 2)
  */
-void pad_msg(uint8_t *msg, int len, uint8_t **padded, int *len_padded) {
-    // The number of 0s needed, k, is given by: k = (512 - 64 - len - 1) = 448 - (len + 1) mod 512
-    int k = (448 - 8*len) % 512;
-    if (k < 0) {
-        k += 512;
-    }
-
-    // Will append a 1, then k zero bits, and then a 64-bit block at the end containing the original msg length
-    // Add an extra bit to k for the leading 1 bit, and then convert # bits to # bytes
-    *len_padded = len + (k+1)/8 + 64/8;
-    *padded = malloc(*len_padded);
+int sha256_pad_msg(const uint8_t *tail, size_t tail_len, uint64_t total_len, uint8_t *padded) {
+    // The padding needs 1 byte for the leading 1 bit and 8 bytes for the length
+    // If that does not fit after the tail, then the padding spills over into a second block
+    int num_blocks = (tail_len + 1 + 8 <= 64) ? 1 : 2;
 
-    memcpy(*padded, msg, len); // Copy over the original message
-    memset(*padded + len, 0, (*len_padded - len)); // Set all padded bits to 0
-    (*padded)[len] = 0x80; // Set the most significant padded bit to 1
+    memcpy(padded, tail, tail_len); // Copy over the end of the original message
+    memset(padded + tail_len, 0, 64*num_blocks - tail_len); // Set all padded bits to 0
+    padded[tail_len] = 0x80; // Set the most significant padded bit to 1
 
     // Set the last 64 bits as the 64-bit representation of the original msg length (IN BITS)
     // This implementation uses LITTLE ENDIAN, so must convert to BIG ENDIAN for SHA-2 algorithm
-    uint64_t len64 = (uint64_t)(len * 8);
+    uint64_t len64 = total_len * 8;
     for (int i = 0; i < 8; i++) {
-        (*padded)[*len_padded - 1 - i] = len64 >> 8*i;
+        padded[64*num_blocks - 1 - i] = len64 >> 8*i;
     }
+
+    return num_blocks;
 }
 
 
@@ -125,7 +131,7 @@ uint32_t SIG1(uint32_t w) {
  * @param z the input to choose from when x's bit = 1
  * @returns the result of the choosing
  */
-uint32_t ch(uint32_t x, uint32_t y, uint32_t z) {
+uint32_t sha256_ch(uint32_t x, uint32_t y, uint32_t z) {
     return (x & y) ^ (~x & z);
 }
 
@@ -136,20 +142,914 @@ uint32_t ch(uint32_t x, uint32_t y, uint32_t z) {
  * @param z the third input
  * @returns the result of the majority bits within x, y, and z
  */
-uint32_t maj(uint32_t x, uint32_t y, uint32_t z) {
+uint32_t sha256_maj(uint32_t x, uint32_t y, uint32_t z) {
     return (x & y) ^ (x & z) ^ (y & z);
 }
 
 
+/****************************
+*** HARDWARE ACCELERATION ***
+****************************/
+#ifdef HAVE_X86_INTRINSICS
+/**
+ * Checks (via CPUID) whether the processor supports the SHA extensions (SHA-NI) along with the SSSE3/SSE4.1 instructions used alongside them
+ * @returns 1 if the SHA-NI compression function can be used, otherwise 0
+ */
+int sha256_cpu_has_sha_ni() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1)) {
+        return 0;
+    }
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    return (ebx & bit_SHA) ? 1 : 0;
+}
+
+/**
+ * Checks whether the SHA-NI compression function should be used (checked once via CPUID)
+ * @returns 1 if the SHA-NI compression function can be used, otherwise 0
+ */
+int sha256_use_sha_ni() {
+    static atomic_int cached_use_shani = -1; // -1 until the CPU has been checked (atomic, since the first checks can come from several threads at once)
+    int use_shani = atomic_load(&cached_use_shani);
+    if (use_shani < 0) {
+        use_shani = sha256_cpu_has_sha_ni();
+        atomic_store(&cached_use_shani, use_shani);
+    }
+    return use_shani;
+}
+
+// Performs 4 rounds (i to i+3) using the 4 message schedule words in X
+// SHA256RNDS2 only does 2 rounds at a time, so the upper half of the words+constants are moved down for the second call
+#define SHANI_RNDS(i, X) \
+    MSG = _mm_add_epi32(X, _mm_loadu_si128((const __m128i*)&sha256_k[4*(i)])); \
+    CDGH = _mm_sha256rnds2_epu32(CDGH, ABEF, MSG); \
+    MSG = _mm_shuffle_epi32(MSG, 0x0E); \
+    ABEF = _mm_sha256rnds2_epu32(ABEF, CDGH, MSG)
+
+// Finishes the next 4 message schedule words in NEXT (which already has the sigma_0 terms from SHANI_MSG1 in it)
+// Adds the W[i-7] terms (taken from the end of PREV and the start of X) and then the sigma_1 terms
+#define SHANI_MSG2(NEXT, X, PREV) \
+    NEXT = _mm_sha256msg2_epu32(_mm_add_epi32(NEXT, _mm_alignr_epi8(X, PREV, 4)), X)
+
+// Starts the message schedule words 16 ahead of PREV by adding the sigma_0 terms
+#define SHANI_MSG1(PREV, X) \
+    PREV = _mm_sha256msg1_epu32(PREV, X)
+
+/**
+ * Performs the core compression function of SHA-256 using the SHA-NI instructions
+ * The state is kept in registers across all of the blocks, so it is only shuffled into the ABEF/CDGH layout used by the instructions once
+ * @param blocks the 512-bit blocks of the message that are being worked on
+ * @param num_blocks the number of 512-bit blocks in blocks
+ * @param prev_H (IN/OUT) the outputted hash message from the previous call to this function (or the initial hash). Will contain the resulting hash upon return
+ */
+__attribute__((target("sha,ssse3,sse4.1")))
+void sha256_compress_shani(const uint8_t *blocks, size_t num_blocks, uint32_t *prev_H) {
+    // Used to flip each word from LITTLE ENDIAN to the BIG ENDIAN that SHA works in
+    const __m128i BSWAP = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i MSG, MSG0, MSG1, MSG2, MSG3;
+
+    // The SHA-NI instructions expect the state words split as ABEF and CDGH
+    __m128i DCBA = _mm_loadu_si128((const __m128i*)&prev_H[0]);
+    __m128i HGFE = _mm_loadu_si128((const __m128i*)&prev_H[4]);
+    __m128i BADC = _mm_shuffle_epi32(DCBA, 0xB1);
+    HGFE = _mm_shuffle_epi32(HGFE, 0x1B); // Now EFGH
+    __m128i ABEF = _mm_alignr_epi8(BADC, HGFE, 8);
+    __m128i CDGH = _mm_blend_epi16(HGFE, BADC, 0xF0);
+
+    for (size_t block_index = 0; block_index < num_blocks; block_index++) {
+        const uint8_t *block = &blocks[block_index * 64];
+        __m128i ABEF_SAVE = ABEF;
+        __m128i CDGH_SAVE = CDGH;
+
+        // The first 16 words are set to the current block
+        MSG0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 0)), BSWAP);
+        MSG1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 16)), BSWAP);
+        MSG2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 32)), BSWAP);
+        MSG3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 48)), BSWAP);
+
+        // Perform the 64 rounds 4 at a time, while deriving the remainder of the message schedule 4 words at a time
+        SHANI_RNDS(0, MSG0);
+        SHANI_RNDS(1, MSG1);  SHANI_MSG1(MSG0, MSG1);
+        SHANI_RNDS(2, MSG2);  SHANI_MSG1(MSG1, MSG2);
+        SHANI_RNDS(3, MSG3);  SHANI_MSG2(MSG0, MSG3, MSG2);  SHANI_MSG1(MSG2, MSG3);
+        SHANI_RNDS(4, MSG0);  SHANI_MSG2(MSG1, MSG0, MSG3);  SHANI_MSG1(MSG3, MSG0);
+        SHANI_RNDS(5, MSG1);  SHANI_MSG2(MSG2, MSG1, MSG0);  SHANI_MSG1(MSG0, MSG1);
+        SHANI_RNDS(6, MSG2);  SHANI_MSG2(MSG3, MSG2, MSG1);  SHANI_MSG1(MSG1, MSG2);
+        SHANI_RNDS(7, MSG3);  SHANI_MSG2(MSG0, MSG3, MSG2);  SHANI_MSG1(MSG2, MSG3);
+        SHANI_RNDS(8, MSG0);  SHANI_MSG2(MSG1, MSG0, MSG3);  SHANI_MSG1(MSG3, MSG0);
+        SHANI_RNDS(9, MSG1);  SHANI_MSG2(MSG2, MSG1, MSG0);  SHANI_MSG1(MSG0, MSG1);
+        SHANI_RNDS(10, MSG2); SHANI_MSG2(MSG3, MSG2, MSG1);  SHANI_MSG1(MSG1, MSG2);
+        SHANI_RNDS(11, MSG3); SHANI_MSG2(MSG0, MSG3, MSG2);  SHANI_MSG1(MSG2, MSG3);
+        SHANI_RNDS(12, MSG0); SHANI_MSG2(MSG1, MSG0, MSG3);  SHANI_MSG1(MSG3, MSG0);
+        SHANI_RNDS(13, MSG1); SHANI_MSG2(MSG2, MSG1, MSG0);
+        SHANI_RNDS(14, MSG2); SHANI_MSG2(MSG3, MSG2, MSG1);
+        SHANI_RNDS(15, MSG3);
+
+        // Add the results to the previous hash to get the NEW hash
+        ABEF = _mm_add_epi32(ABEF, ABEF_SAVE);
+        CDGH = _mm_add_epi32(CDGH, CDGH_SAVE);
+    }
+
+    // Convert the ABEF/CDGH layout back into A..H order
+    __m128i FEBA = _mm_shuffle_epi32(ABEF, 0x1B);
+    __m128i DCHG = _mm_shuffle_epi32(CDGH, 0xB1);
+    DCBA = _mm_blend_epi16(FEBA, DCHG, 0xF0);
+    HGFE = _mm_alignr_epi8(DCHG, FEBA, 8);
+    _mm_storeu_si128((__m128i*)&prev_H[0], DCBA);
+    _mm_storeu_si128((__m128i*)&prev_H[4], HGFE);
+}
+
+// Versions of the compression helpers that work on every lane of a vector at once
+#define VEC_rotr(w, n) (((w) >> (n)) | ((w) << (32 - (n))))
+#define VEC_sig0(w) (VEC_rotr(w, 7) ^ VEC_rotr(w, 18) ^ ((w) >> 3))
+#define VEC_sig1(w) (VEC_rotr(w, 17) ^ VEC_rotr(w, 19) ^ ((w) >> 10))
+#define VEC_SIG0(w) (VEC_rotr(w, 2) ^ VEC_rotr(w, 13) ^ VEC_rotr(w, 22))
+#define VEC_SIG1(w) (VEC_rotr(w, 6) ^ VEC_rotr(w, 11) ^ VEC_rotr(w, 25))
+#define VEC_ch(x, y, z) (((x) & (y)) ^ (~(x) & (z)))
+#define VEC_maj(x, y, z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+
+/**
+ * Defines a compression function that works on LANES independent messages at once (one 512-bit block from each)
+ * This is the same as sha256_compress(), except each variable holds one word from every message instead of just one
+ * Lanes given a NULL block are masked off, so their hash values are left unchanged
+ * @param name the name of the function to define
+ * @param LANES the number of messages worked on at once
+ * @param vec_t the vector type holding one word from each message
+ * @param isa the instruction set extension the function is compiled for
+ */
+#define SHA256_DEFINE_COMPRESS_LANES(name, LANES, vec_t, isa) \
+__attribute__((target(isa))) \
+void name(const uint8_t **blocks, uint32_t *state) { \
+    vec_t W[16]; /* Only the 16 most recent message schedule words are ever needed */ \
+    vec_t mask; \
+    LANES_LOAD_BLOCKS(W, mask, blocks, LANES, 1) /* The first 16 words are the current block of each message (in BIG ENDIAN) */ \
+    \
+    /* Initialize the states, state[i*LANES + lane] holds word i of the hash for each lane */ \
+    vec_t A, B, C, D, E, F, G, H; \
+    memcpy(&A, &state[0*LANES], sizeof(vec_t)); \
+    memcpy(&B, &state[1*LANES], sizeof(vec_t)); \
+    memcpy(&C, &state[2*LANES], sizeof(vec_t)); \
+    memcpy(&D, &state[3*LANES], sizeof(vec_t)); \
+    memcpy(&E, &state[4*LANES], sizeof(vec_t)); \
+    memcpy(&F, &state[5*LANES], sizeof(vec_t)); \
+    memcpy(&G, &state[6*LANES], sizeof(vec_t)); \
+    memcpy(&H, &state[7*LANES], sizeof(vec_t)); \
+    vec_t A_SAVE = A, B_SAVE = B, C_SAVE = C, D_SAVE = D, E_SAVE = E, F_SAVE = F, G_SAVE = G, H_SAVE = H; \
+    \
+    /* Perform the iteration function, deriving the message schedule 16 words at a time as it goes */ \
+    for (int j = 0; j < 64; j += 16) { \
+        for (int i = 0; i < 16; i++) { \
+            if (j > 0) { \
+                W[i] += VEC_sig1(W[(i + 14) & 15]) + W[(i + 9) & 15] + VEC_sig0(W[(i + 1) & 15]); \
+            } \
+            vec_t temp1 = H + VEC_SIG1(E) + VEC_ch(E, F, G) + sha256_k[j + i] + W[i]; \
+            vec_t temp2 = VEC_SIG0(A) + VEC_maj(A, B, C); \
+            H = G; \
+            G = F; \
+            F = E; \
+            E = D + temp1; \
+            D = C; \
+            C = B; \
+            B = A; \
+            A = temp1 + temp2; \
+        } \
+    } \
+    \
+    /* Add the results to the previous hash to get the NEW hash (masked off lanes add 0) */ \
+    A = A_SAVE + (A & mask); \
+    B = B_SAVE + (B & mask); \
+    C = C_SAVE + (C & mask); \
+    D = D_SAVE + (D & mask); \
+    E = E_SAVE + (E & mask); \
+    F = F_SAVE + (F & mask); \
+    G = G_SAVE + (G & mask); \
+    H = H_SAVE + (H & mask); \
+    memcpy(&state[0*LANES], &A, sizeof(vec_t)); \
+    memcpy(&state[1*LANES], &B, sizeof(vec_t)); \
+    memcpy(&state[2*LANES], &C, sizeof(vec_t)); \
+    memcpy(&state[3*LANES], &D, sizeof(vec_t)); \
+    memcpy(&state[4*LANES], &E, sizeof(vec_t)); \
+    memcpy(&state[5*LANES], &F, sizeof(vec_t)); \
+    memcpy(&state[6*LANES], &G, sizeof(vec_t)); \
+    memcpy(&state[7*LANES], &H, sizeof(vec_t)); \
+}
+
+SHA256_DEFINE_COMPRESS_LANES(sha256_compress_x8_avx2, 8, v8u32, "avx2")
+SHA256_DEFINE_COMPRESS_LANES(sha256_compress_x16_avx512, 16, v16u32, "avx512f")
+#endif
+
+
 /************************
 *** CORE SHA-256 HASH ***
 ************************/
+// The message schedule only ever looks back 16 words, so it is kept in a 16-word ring buffer and derived on the fly
+// W(i) reads word i of the block, SCHEDULE(i) overwrites word i-16 with word i of the schedule
+#define W_BLOCK(i) (W[i])
+#define W_SCHEDULE(i) (W[(i) & 15] += sig1(W[((i) - 2) & 15]) + W[((i) - 7) & 15] + sig0(W[((i) - 15) & 15]))
+
+// A single iteration of the compression function
+// Rather than shifting every state variable down one (H = G, G = F, ...), the caller renames the variables for the next round
+// So only the two variables that actually change (d becomes the new E, h becomes the new A) are written
+#define SHA256_ROUND(a, b, c, d, e, f, g, h, i, w) \
+    do { \
+        uint32_t temp1 = h + SIG1(e) + sha256_ch(e, f, g) + sha256_k[i] + (w); \
+        d += temp1; \
+        h = temp1 + SIG0(a) + sha256_maj(a, b, c); \
+    } while (0)
+
+// 8 iterations of the compression function, after which the variables are back in their original places
+#define SHA256_ROUNDS_8(i, w) \
+    SHA256_ROUND(A, B, C, D, E, F, G, H, (i) + 0, w((i) + 0)); \
+    SHA256_ROUND(H, A, B, C, D, E, F, G, (i) + 1, w((i) + 1)); \
+    SHA256_ROUND(G, H, A, B, C, D, E, F, (i) + 2, w((i) + 2)); \
+    SHA256_ROUND(F, G, H, A, B, C, D, E, (i) + 3, w((i) + 3)); \
+    SHA256_ROUND(E, F, G, H, A, B, C, D, (i) + 4, w((i) + 4)); \
+    SHA256_ROUND(D, E, F, G, H, A, B, C, (i) + 5, w((i) + 5)); \
+    SHA256_ROUND(C, D, E, F, G, H, A, B, (i) + 6, w((i) + 6)); \
+    SHA256_ROUND(B, C, D, E, F, G, H, A, (i) + 7, w((i) + 7))
+
 /**
  * Performs the core compression function of SHA-256
+ * All 64 iterations are unrolled and the message schedule is computed as it is needed, so nothing is allocated
  * @param block the 512-bit block of the message that is being worked on
  * @param prev_H (IN/OUT) the outputted hash message from the previous call to this function (or the initial hash). Will contain the resulting hash upon return
  */
-void compress(uint8_t* block, uint32_t *prev_H) {
+void sha256_compress(const uint8_t* block, uint32_t *prev_H) {
+    /*** Create the first 16 entries of the message schedule ***/
+    uint32_t W[16];
+
+    // The first 16 words are set to the current block
+    // Have to do extra work since SHA works in BIG ENDIAN, but this implementation is in LITTLE ENDIAN
+    for (int i = 0; i < 16; i++) {
+        W[i] = (block[4*i] << 24) | (block[4*i + 1] << 16) | (block[4*i + 2] << 8) | (block[4*i + 3]);
+    }
+
+    /*** Perform the compression iteration 64 times ***/
+    // Initialize the states
+    uint32_t A = prev_H[0];
+    uint32_t B = prev_H[1];
+    uint32_t C = prev_H[2];
+    uint32_t D = prev_H[3];
+    uint32_t E = prev_H[4];
+    uint32_t F = prev_H[5];
+    uint32_t G = prev_H[6];
+    uint32_t H = prev_H[7];
+
+    // Perform the iteration function
+    // The first 16 iterations use the block directly, the remainder derive the message schedule from the words within the block
+    SHA256_ROUNDS_8(0, W_BLOCK);
+    SHA256_ROUNDS_8(8, W_BLOCK);
+    SHA256_ROUNDS_8(16, W_SCHEDULE);
+    SHA256_ROUNDS_8(24, W_SCHEDULE);
+    SHA256_ROUNDS_8(32, W_SCHEDULE);
+    SHA256_ROUNDS_8(40, W_SCHEDULE);
+    SHA256_ROUNDS_8(48, W_SCHEDULE);
+    SHA256_ROUNDS_8(56, W_SCHEDULE);
+
+    // Add the results to the previous hash to get the NEW hash
+    prev_H[0] += A; 
+    prev_H[1] += B; 
+    prev_H[2] += C; 
+    prev_H[3] += D; 
+    prev_H[4] += E; 
+    prev_H[5] += F; 
+    prev_H[6] += G; 
+    prev_H[7] += H; 
+}
+
+/**
+ * Performs the compression function over several consecutive blocks
+ * Uses the SHA-NI instructions when the processor has them (checked once via CPUID), otherwise the portable sha256_compress() above
+ * Both give byte-identical results
+ * @param blocks the 512-bit blocks of the message that are being worked on
+ * @param num_blocks the number of 512-bit blocks in blocks
+ * @param prev_H (IN/OUT) the outputted hash message from the previous call to this function (or the initial hash). Will contain the resulting hash upon return
+ */
+void sha256_compress_blocks(const uint8_t *blocks, size_t num_blocks, uint32_t *prev_H) {
+#ifdef HAVE_X86_INTRINSICS
+    if (sha256_use_sha_ni()) {
+        sha256_compress_shani(blocks, num_blocks, prev_H);
+        return;
+    }
+#endif
+
+    for (size_t block_index = 0; block_index < num_blocks; block_index++) {
+        sha256_compress(&blocks[block_index * 64], prev_H);
+    }
+}
+
+/**
+ * Internal state for computing a SHA-256 hash incrementally
+ * Lets a message be hashed in pieces (e.g. as it is read from a file) without ever holding the whole thing in memory
+ */
+typedef struct {
+    uint32_t H[8]; // The most recent hash value
+    uint8_t buffer[64]; // Holds the start of a block until the caller has provided all 64 bytes of it
+    size_t buffer_len; // Number of bytes currently held in buffer
+    uint64_t total_len; // Total length of the message processed so far in BYTES
+} sha256_ctx;
+
+/**
+ * Starts a new SHA-256 hash computation
+ * @param ctx (OUTPUT) the context to initialize
+ */
+void sha256_init(sha256_ctx *ctx) {
+    memcpy(ctx->H, sha256_H0, 256/8); // Set the initial hash value to the constant sha256_H0
+    ctx->buffer_len = 0;
+    ctx->total_len = 0;
+}
+
+/**
+ * Adds more of the message to a running SHA-256 hash computation
+ * Full blocks are compressed directly out of msg, only a trailing partial block is buffered until the next call
+ * @param ctx (IN/OUT) the context of the running hash
+ * @param msg the next piece of the message (may contain any bytes, including 0s)
+ * @param len the length of msg in BYTES
+ */
+void sha256_update(sha256_ctx *ctx, const uint8_t *msg, size_t len) {
+    ctx->total_len += len;
+
+    // Top up a partially filled block from a previous call first
+    if (ctx->buffer_len > 0) {
+        size_t needed = 64 - ctx->buffer_len;
+        size_t taken = (len < needed) ? len : needed;
+        memcpy(ctx->buffer + ctx->buffer_len, msg, taken);
+        ctx->buffer_len += taken;
+        msg += taken;
+        len -= taken;
+
+        if (ctx->buffer_len < 64) {
+            return;
+        }
+        sha256_compress_blocks(ctx->buffer, 1, ctx->H);
+        ctx->buffer_len = 0;
+    }
+
+    // Perform the compression function for each full block, straight from the caller's memory
+    size_t num_blocks = len / 64;
+    sha256_compress_blocks(msg, num_blocks, ctx->H);
+    msg += 64*num_blocks;
+    len -= 64*num_blocks;
+
+    // Hold onto whatever is left until more of the message arrives (or the hash is finished)
+    memcpy(ctx->buffer, msg, len);
+    ctx->buffer_len = len;
+}
+
+/**
+ * Finishes a SHA-256 hash computation by padding and compressing the last block
+ * @param ctx (IN/OUT) the context of the running hash, must be re-initialized before being used again
+ * @param digest (OUTPUT) 256-bit (32-byte) buffer where the digest of the msg will be put
+ */
+void sha256_final(sha256_ctx *ctx, uint8_t *digest) {
+    // Pad the message, only the final partial block gets copied
+    uint8_t padded[128];
+    int num_blocks = sha256_pad_msg(ctx->buffer, ctx->buffer_len, ctx->total_len, padded);
+    sha256_compress_blocks(padded, num_blocks, ctx->H);
+
+    // Convert the BIG ENDIAN final hash back into LITTLE ENDIAN for this implementation
+    // (Also converts the word-index hash back into byte-index)
+    for (int i = 0; i < 32; i++) {
+        digest[i] = (ctx->H[i/4] >> (24 - 8*(i%4))) & 0x000000FF;
+    }
+}
+
+/**
+ * Performs the SHA-256 hash function
+ * @param msg the message to calculate the hash of (may contain any bytes, including 0s)
+ * @param len the length of msg in BYTES
+ * @returns the digest of the msg
+ */
+uint8_t* sha256(const uint8_t *msg, size_t len) {
+    sha256_ctx ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, msg, len);
+
+    uint8_t *digest = malloc(256/8);
+    sha256_final(&ctx, digest);
+    return digest;
+}
+
+#ifdef HAVE_X86_INTRINSICS
+/**
+ * Picks the widest multi-buffer compression function the processor supports
+ * A single SHA-NI stream keeps up with 8 AVX2 lanes, so AVX2 is only used on processors without SHA-NI
+ * @param compress_lanes (OUTPUT) the multi-buffer compression function to use
+ * @returns the number of lanes compress_lanes works on, or 1 if multi-buffer hashing should not be used
+ */
+int sha256_select_compress_lanes(compress_lanes_fn *compress_lanes) {
+    int num_lanes = cpu_avx_lanes(16, sha256_use_sha_ni() ? 1 : 8);
+    *compress_lanes = (num_lanes == 16) ? sha256_compress_x16_avx512 : sha256_compress_x8_avx2;
+    return num_lanes;
+}
+#endif
+
+// How the shared multi-buffer scheduler runs SHA-256
+const md_hash sha256_md_hash = {8, 1, sha256_H0, sha256_pad_msg, sha256_compress_blocks};
+
+/**
+ * Performs the SHA-256 hash function on many independent messages at once
+ * Uses 16 lanes with AVX-512 or 8 lanes with AVX2 when the processor has them, otherwise hashes the messages one after another
+ * @param msgs the messages to calculate the hash of (may contain any bytes, including 0s)
+ * @param lens the length of each message in BYTES
+ * @param num_msgs the number of messages
+ * @param digests (OUTPUT) the 256-bit digest of each message
+ */
+void sha256_batch(const uint8_t **msgs, const size_t *lens, size_t num_msgs, uint8_t (*digests)[32]) {
+#ifdef HAVE_X86_INTRINSICS
+    compress_lanes_fn compress_lanes;
+    int num_lanes = sha256_select_compress_lanes(&compress_lanes);
+    if (num_lanes > 1) {
+        md_batch_lanes(&sha256_md_hash, msgs, lens, num_msgs, &digests[0][0], num_lanes, compress_lanes);
+        return;
+    }
+#endif
+
+    for (size_t i = 0; i < num_msgs; i++) {
+        sha256_ctx ctx;
+        sha256_init(&ctx);
+        sha256_update(&ctx, msgs[i], lens[i]);
+        sha256_final(&ctx, digests[i]);
+    }
+}
+
+
+/***********************
+*** HMAC AND PBKDF2 ***
+***********************/
+/**
+ * A key prepared for HMAC-SHA256
+ * HMAC hashes (key ^ ipad) || msg and then (key ^ opad) || inner hash, both pads fill exactly one block
+ * So the hash values after compressing each pad block (the midstates) are the same for every message, and only need to be computed once per key
+ */
+typedef struct {
+    uint32_t inner_H[8]; // Hash value after compressing the block key ^ ipad
+    uint32_t outer_H[8]; // Hash value after compressing the block key ^ opad
+} hmac_sha256_key;
+
+/**
+ * Prepares a key for HMAC-SHA256 by compressing its inner and outer pad blocks
+ * @param hkey (OUTPUT) the prepared key
+ * @param key the secret key (keys longer than 64 bytes are hashed first)
+ * @param key_len the length of key in BYTES
+ */
+void hmac_sha256_set_key(hmac_sha256_key *hkey, const uint8_t *key, size_t key_len) {
+    uint8_t key_block[64] = {0};
+    if (key_len > 64) {
+        sha256_ctx ctx;
+        sha256_init(&ctx);
+        sha256_update(&ctx, key, key_len);
+        sha256_final(&ctx, key_block);
+    }
+    else {
+        memcpy(key_block, key, key_len);
+    }
+
+    uint8_t pad_block[64];
+    for (int i = 0; i < 64; i++) {
+        pad_block[i] = key_block[i] ^ 0x36; // ipad
+    }
+    memcpy(hkey->inner_H, sha256_H0, 256/8);
+    sha256_compress_blocks(pad_block, 1, hkey->inner_H);
+
+    for (int i = 0; i < 64; i++) {
+        pad_block[i] = key_block[i] ^ 0x5c; // opad
+    }
+    memcpy(hkey->outer_H, sha256_H0, 256/8);
+    sha256_compress_blocks(pad_block, 1, hkey->outer_H);
+}
+
+/**
+ * Starts a new HMAC-SHA256 computation, picking up from the key's inner midstate
+ * The message is then added with sha256_update()
+ * @param ctx (OUTPUT) the context to initialize
+ * @param hkey the prepared key
+ */
+void hmac_sha256_init(sha256_ctx *ctx, const hmac_sha256_key *hkey) {
+    memcpy(ctx->H, hkey->inner_H, 256/8);
+    ctx->buffer_len = 0;
+    ctx->total_len = 64; // The ipad block has already been compressed
+}
+
+/**
+ * Finishes an HMAC-SHA256 computation by hashing the inner hash from the key's outer midstate
+ * @param ctx (IN/OUT) the context of the running MAC, must be re-initialized before being used again
+ * @param hkey the prepared key
+ * @param mac (OUTPUT) 256-bit (32-byte) buffer where the MAC will be put
+ */
+void hmac_sha256_final(sha256_ctx *ctx, const hmac_sha256_key *hkey, uint8_t *mac) {
+    uint8_t inner_hash[32];
+    sha256_final(ctx, inner_hash);
+
+    memcpy(ctx->H, hkey->outer_H, 256/8);
+    ctx->buffer_len = 0;
+    ctx->total_len = 64; // The opad block has already been compressed
+    sha256_update(ctx, inner_hash, 32);
+    sha256_final(ctx, mac);
+}
+
+/**
+ * Performs HMAC-SHA256 on a whole message
+ * @param hkey the prepared key
+ * @param msg the message to calculate the MAC of
+ * @param len the length of msg in BYTES
+ * @param mac (OUTPUT) 256-bit (32-byte) buffer where the MAC will be put
+ */
+void hmac_sha256(const hmac_sha256_key *hkey, const uint8_t *msg, size_t len, uint8_t *mac) {
+    sha256_ctx ctx;
+    hmac_sha256_init(&ctx, hkey);
+    sha256_update(&ctx, msg, len);
+    hmac_sha256_final(&ctx, hkey, mac);
+}
+
+/**
+ * Builds the single padded block used for every PBKDF2 iteration after the first
+ * Each iteration hashes a 32-byte value from one of the midstates, so the padding and length never change and only the first 32 bytes need re-writing
+ * @param block (OUTPUT) the 64-byte block to build
+ */
+void pbkdf2_block_init(uint8_t *block) {
+    memset(block, 0, 64);
+    block[32] = 0x80; // The leading 1 bit of the padding
+
+    // The message is the 64-byte pad block plus the 32-byte value = 768 bits, stored in BIG ENDIAN
+    uint64_t len64 = (64 + 32) * 8;
+    for (int i = 0; i < 8; i++) {
+        block[63 - i] = len64 >> 8*i;
+    }
+}
+
+/**
+ * Writes a hash value into the first 32 bytes of a block (converting it to BIG ENDIAN bytes)
+ * @param H the 8-word hash value
+ * @param block (OUTPUT) where the 32 bytes will be put
+ */
+void pbkdf2_store_hash(const uint32_t *H, uint8_t *block) {
+    for (int i = 0; i < 32; i++) {
+        block[i] = (H[i/4] >> (24 - 8*(i%4))) & 0x000000FF;
+    }
+}
+
+/**
+ * Computes one 32-byte block T_i of PBKDF2-HMAC-SHA256 output
+ * T_i = U_1 ^ U_2 ^ ... ^ U_c, where U_1 = HMAC(password, salt || i) and U_j = HMAC(password, U_j-1)
+ * @param hkey the password, prepared as an HMAC key
+ * @param salt the salt
+ * @param salt_len the length of salt in BYTES
+ * @param block_num the (1-based) index i of the output block
+ * @param iterations the iteration count c
+ * @param output (OUTPUT) 32-byte buffer where T_i will be put
+ */
+void pbkdf2_sha256_block(const hmac_sha256_key *hkey, const uint8_t *salt, size_t salt_len,
+                         uint32_t block_num, uint32_t iterations, uint8_t *output) {
+    // U_1 = HMAC(password, salt || INT(i))
+    uint8_t index[4] = {block_num >> 24, block_num >> 16, block_num >> 8, block_num};
+    uint8_t U[32];
+    sha256_ctx ctx;
+    hmac_sha256_init(&ctx, hkey);
+    sha256_update(&ctx, salt, salt_len);
+    sha256_update(&ctx, index, 4);
+    hmac_sha256_final(&ctx, hkey, U);
+    memcpy(output, U, 32);
+
+    // Every later U_j is exactly two compressions, of pre-padded blocks from the cached midstates
+    uint8_t inner_block[64], outer_block[64];
+    pbkdf2_block_init(inner_block);
+    pbkdf2_block_init(outer_block);
+    memcpy(inner_block, U, 32);
+
+    uint32_t H[8];
+    for (uint32_t j = 1; j < iterations; j++) {
+        memcpy(H, hkey->inner_H, 256/8);
+        sha256_compress_blocks(inner_block, 1, H);
+        pbkdf2_store_hash(H, outer_block);
+
+        memcpy(H, hkey->outer_H, 256/8);
+        sha256_compress_blocks(outer_block, 1, H);
+        pbkdf2_store_hash(H, inner_block);
+
+        for (int i = 0; i < 32; i++) {
+            output[i] ^= inner_block[i];
+        }
+    }
+}
+
+#ifdef HAVE_X86_INTRINSICS
+/**
+ * Computes several 32-byte blocks of PBKDF2-HMAC-SHA256 output at once, one per lane of a multi-buffer compression function
+ * The iterations of one block depend on each other, but the different output blocks do not, so they are run side by side
+ * @param hkey the password, prepared as an HMAC key
+ * @param salt the salt
+ * @param salt_len the length of salt in BYTES
+ * @param first_block_num the (1-based) index of the first output block to compute
+ * @param num_blocks the number of output blocks to compute (at most num_lanes)
+ * @param iterations the iteration count c
+ * @param output (OUTPUT) buffer where the num_blocks 32-byte blocks will be put
+ * @param num_lanes the number of messages compress_lanes works on at once
+ * @param compress_lanes the multi-buffer compression function to use
+ */
+void pbkdf2_sha256_lanes(const hmac_sha256_key *hkey, const uint8_t *salt, size_t salt_len,
+                         uint32_t first_block_num, int num_blocks, uint32_t iterations, uint8_t *output,
+                         int num_lanes, compress_lanes_fn compress_lanes) {
+    uint8_t inner_blocks[16][64], outer_blocks[16][64];
+    const uint8_t *blocks[16];
+    uint32_t state[8*16];
+    uint32_t H[8];
+
+    for (int lane = 0; lane < num_blocks; lane++) {
+        pbkdf2_sha256_block(hkey, salt, salt_len, first_block_num + lane, 1, &output[32*lane]);
+        pbkdf2_block_init(inner_blocks[lane]);
+        pbkdf2_block_init(outer_blocks[lane]);
+        memcpy(inner_blocks[lane], &output[32*lane], 32);
+    }
+
+    for (uint32_t j = 1; j < iterations; j++) {
+        // Inner hash of every lane, starting from the ipad midstate
+        for (int lane = 0; lane < num_lanes; lane++) {
+            blocks[lane] = (lane < num_blocks) ? inner_blocks[lane] : NULL;
+            for (int i = 0; i < 8; i++) {
+                state[i*num_lanes + lane] = hkey->inner_H[i];
+            }
+        }
+        compress_lanes(blocks, state);
+        for (int lane = 0; lane < num_blocks; lane++) {
+            for (int i = 0; i < 8; i++) {
+                H[i] = state[i*num_lanes + lane];
+            }
+            pbkdf2_store_hash(H, outer_blocks[lane]);
+        }
+
+        // Outer hash of every lane, starting from the opad midstate
+        for (int lane = 0; lane < num_lanes; lane++) {
+            blocks[lane] = (lane < num_blocks) ? outer_blocks[lane] : NULL;
+            for (int i = 0; i < 8; i++) {
+                state[i*num_lanes + lane] = hkey->outer_H[i];
+            }
+        }
+        compress_lanes(blocks, state);
+        for (int lane = 0; lane < num_blocks; lane++) {
+            for (int i = 0; i < 8; i++) {
+                H[i] = state[i*num_lanes + lane];
+            }
+            pbkdf2_store_hash(H, inner_blocks[lane]);
+            for (int i = 0; i < 32; i++) {
+                output[32*lane + i] ^= inner_blocks[lane][i];
+            }
+        }
+    }
+}
+#endif
+
+/**
+ * Performs PBKDF2-HMAC-SHA256 key derivation
+ * When enough output blocks are requested, they are computed side by side with the multi-buffer compression function
+ * @param password the password to derive the key from
+ * @param password_len the length of password in BYTES
+ * @param salt the salt
+ * @param salt_len the length of salt in BYTES
+ * @param iterations the iteration count
+ * @param output (OUTPUT) where the derived key will be put
+ * @param output_len the length of the derived key to produce in BYTES
+ */
+void pbkdf2_hmac_sha256(const uint8_t *password, size_t password_len, const uint8_t *salt, size_t salt_len,
+                        uint32_t iterations, uint8_t *output, size_t output_len) {
+    hmac_sha256_key hkey;
+    hmac_sha256_set_key(&hkey, password, password_len);
+
+    size_t num_blocks = (output_len + 31) / 32;
+    size_t block_index = 0;
+    uint8_t T[16*32];
+
+#ifdef HAVE_X86_INTRINSICS
+    // Only worth running the lanes if at least half of them will be busy
+    compress_lanes_fn compress_lanes;
+    int num_lanes = sha256_select_compress_lanes(&compress_lanes);
+    while (num_lanes > 1 && num_blocks - block_index >= (size_t)num_lanes / 2) {
+        size_t group = (num_blocks - block_index < (size_t)num_lanes) ? num_blocks - block_index : (size_t)num_lanes;
+        pbkdf2_sha256_lanes(&hkey, salt, salt_len, block_index + 1, group, iterations, T, num_lanes, compress_lanes);
+
+        size_t len = (output_len - 32*block_index < 32*group) ? output_len - 32*block_index : 32*group;
+        memcpy(&output[32*block_index], T, len);
+        block_index += group;
+    }
+#endif
+
+    for (; block_index < num_blocks; block_index++) {
+        pbkdf2_sha256_block(&hkey, salt, salt_len, block_index + 1, iterations, T);
+        size_t len = (output_len - 32*block_index < 32) ? output_len - 32*block_index : 32;
+        memcpy(&output[32*block_index], T, len);
+    }
+}
+
+
+/**************************
+*** MERKLE TREE HASHING ***
+**************************/
+/**
+ * A Merkle tree of SHA-256 hashes over a (large) message
+ * The message is split into fixed-size chunks (the leaves), each chunk is hashed on its own, and then pairs of hashes are hashed together level by level up to a single root hash
+ * Since the leaves are independent they can be hashed in parallel, and changing one chunk only requires re-hashing the path from that leaf up to the root
+ * To keep a leaf from ever being mistaken for an inner node, leaves hash 0x00 || chunk and inner nodes hash 0x01 || left || right
+ * When a level has an odd number of hashes, the last one is moved up to the next level unchanged
+ */
+typedef struct {
+    uint64_t len; // Length of the whole message in BYTES
+    size_t chunk_size; // Size of every leaf chunk in BYTES (only the last chunk may be shorter)
+    size_t num_chunks; // Number of leaf chunks (an empty message still has 1 empty chunk)
+    int num_levels; // Number of levels in the tree, levels[0] holds the leaf (per-chunk) hashes and levels[num_levels - 1] holds the root
+    size_t level_len[64]; // Number of hashes in each level
+    uint8_t (*levels[64])[32]; // The hashes in each level
+    uint8_t root[32]; // The root hash of the whole message
+} sha256_tree;
+
+/**
+ * Hashes a single leaf chunk of a Merkle tree
+ * @param chunk the chunk of the message to hash
+ * @param len the length of chunk in BYTES
+ * @param digest (OUTPUT) the 256-bit hash of the leaf
+ */
+void sha256_tree_leaf(const uint8_t *chunk, size_t len, uint8_t *digest) {
+    const uint8_t leaf_prefix = 0x00;
+    sha256_ctx ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, &leaf_prefix, 1);
+    sha256_update(&ctx, chunk, len);
+    sha256_final(&ctx, digest);
+}
+
+/**
+ * Hashes one inner node of a Merkle tree from the two hashes below it
+ * @param left the hash of the left child
+ * @param right the hash of the right child
+ * @param digest (OUTPUT) the 256-bit hash of the node
+ */
+void sha256_tree_node(const uint8_t *left, const uint8_t *right, uint8_t *digest) {
+    uint8_t node[1 + 2*32];
+    node[0] = 0x01;
+    memcpy(&node[1], left, 32);
+    memcpy(&node[1 + 32], right, 32);
+
+    sha256_ctx ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, node, sizeof(node));
+    sha256_final(&ctx, digest);
+}
+
+/**
+ * Re-computes the hash at a given position of a level from the level below it
+ * @param tree (IN/OUT) the tree to update
+ * @param level the level of the hash to re-compute (must be at least 1)
+ * @param index the position of the hash within the level
+ */
+void sha256_tree_combine(sha256_tree *tree, int level, size_t index) {
+    uint8_t (*below)[32] = tree->levels[level - 1];
+    if (2*index + 1 < tree->level_len[level - 1]) {
+        sha256_tree_node(below[2*index], below[2*index + 1], tree->levels[level][index]);
+    }
+    else {
+        memcpy(tree->levels[level][index], below[2*index], 32); // Odd one out moves up unchanged
+    }
+}
+
+/**
+ * The work shared between the threads hashing the leaves of a tree
+ */
+typedef struct {
+    sha256_tree *tree;
+    const uint8_t *msg;
+    uint64_t len;
+    atomic_size_t next_chunk; // The next chunk that has not been claimed by a thread yet
+} sha256_tree_work;
+
+/**
+ * Thread pool worker, keeps claiming and hashing leaf chunks until there are none left
+ * @param arg the sha256_tree_work shared by all of the threads
+ * @returns NULL
+ */
+void* sha256_tree_worker(void *arg) {
+    sha256_tree_work *work = arg;
+    sha256_tree *tree = work->tree;
+
+    size_t chunk;
+    while ((chunk = atomic_fetch_add(&work->next_chunk, 1)) < tree->num_chunks) {
+        uint64_t start = (uint64_t)chunk * tree->chunk_size;
+        uint64_t chunk_len = (work->len - start < tree->chunk_size) ? work->len - start : tree->chunk_size;
+        sha256_tree_leaf(work->msg + start, chunk_len, tree->levels[0][chunk]);
+    }
+    return NULL;
+}
+
+/**
+ * Frees the memory held by a tree
+ * @param tree the tree to free
+ */
+void sha256_tree_free(sha256_tree *tree) {
+    for (int level = 0; level < tree->num_levels; level++) {
+        free(tree->levels[level]);
+    }
+    tree->num_levels = 0;
+}
+
+/**
+ * Builds the Merkle tree of a message, hashing the leaf chunks in parallel
+ * @param tree (OUTPUT) the tree to build, must be freed with sha256_tree_free() on success
+ * @param msg the message to calculate the tree hash of
+ * @param len the length of msg in BYTES
+ * @param chunk_size the size of each leaf chunk in BYTES (e.g. 1 MiB)
+ * @param num_threads the number of threads to hash the leaves with (including the calling thread)
+ * @returns 0 on success, or -1 if chunk_size is 0 or the tree could not be allocated (nothing is left allocated)
+ */
+int sha256_tree_hash(sha256_tree *tree, const uint8_t *msg, uint64_t len, size_t chunk_size, int num_threads) {
+    memset(tree, 0, sizeof(*tree));
+    if (chunk_size == 0) {
+        return -1;
+    }
+    tree->len = len;
+    tree->chunk_size = chunk_size;
+    tree->num_chunks = (len == 0) ? 1 : (len + chunk_size - 1) / chunk_size;
+
+    // Allocate every level, halving (rounding up) until only the root is left
+    size_t level_len = tree->num_chunks;
+    while (1) {
+        tree->level_len[tree->num_levels] = level_len;
+        tree->levels[tree->num_levels] = malloc(level_len * 32);
+        tree->num_levels++;
+        if (tree->levels[tree->num_levels - 1] == NULL) {
+            sha256_tree_free(tree); // Free the levels allocated so far
+            return -1;
+        }
+        if (level_len == 1) {
+            break;
+        }
+        level_len = (level_len + 1) / 2;
+    }
+
+    // Hash the leaves across a pool of threads, the calling thread counts as one of them
+    sha256_tree_work work = {.tree = tree, .msg = msg, .len = len};
+    atomic_init(&work.next_chunk, 0);
+    pthread_t threads[64];
+    int num_started = 0;
+    for (int i = 1; i < num_threads && i < 64; i++) {
+        if (pthread_create(&threads[num_started], NULL, sha256_tree_worker, &work) == 0) {
+            num_started++;
+        }
+    }
+    sha256_tree_worker(&work);
+    for (int i = 0; i < num_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // Combine the hashes up the tree (this is tiny compared to hashing the leaves)
+    for (int level = 1; level < tree->num_levels; level++) {
+        for (size_t index = 0; index < tree->level_len[level]; index++) {
+            sha256_tree_combine(tree, level, index);
+        }
+    }
+    memcpy(tree->root, tree->levels[tree->num_levels - 1][0], 32);
+    return 0;
+}
+
+/**
+ * Updates the tree after one chunk of the message has changed, only re-hashing the path from that leaf to the root
+ * @param tree (IN/OUT) the tree to update
+ * @param chunk_index which chunk of the message changed
+ * @param chunk the new contents of the chunk
+ * @param len the length of chunk in BYTES (must be the same as before)
+ * @returns 0 on success, or -1 if chunk_index is past the last chunk or len is not the chunk's length (the tree is left unchanged)
+ */
+int sha256_tree_update(sha256_tree *tree, size_t chunk_index, const uint8_t *chunk, size_t len) {
+    if (chunk_index >= tree->num_chunks) {
+        return -1;
+    }
+    uint64_t chunk_start = (uint64_t)chunk_index * tree->chunk_size;
+    uint64_t chunk_len = (tree->len - chunk_start < tree->chunk_size) ? tree->len - chunk_start : tree->chunk_size;
+    if (len != chunk_len) {
+        return -1;
+    }
+
+    sha256_tree_leaf(chunk, len, tree->levels[0][chunk_index]);
+
+    size_t index = chunk_index;
+    for (int level = 1; level < tree->num_levels; level++) {
+        index /= 2;
+        sha256_tree_combine(tree, level, index);
+    }
+    memcpy(tree->root, tree->levels[tree->num_levels - 1][0], 32);
+    return 0;
+}
+
+
+/**************
+*** TESTING ***
+**************/
+/**
+ * The original loop-based compression function of SHA-256, kept to benchmark sha256_compress() against
+ * Builds the full 64-entry message schedule on the heap for every block and shifts every state variable each iteration
+ * @param block the 512-bit block of the message that is being worked on
+ * @param prev_H (IN/OUT) the outputted hash message from the previous call to this function (or the initial hash). Will contain the resulting hash upon return
+ */
+void sha256_compress_reference(const uint8_t* block, uint32_t *prev_H) {
     /*** Create the 64-entry message schedule ***/
     uint32_t *W = calloc(64, sizeof(uint32_t));
 
@@ -177,8 +1077,8 @@ void compress(uint8_t* block, uint32_t *prev_H) {
 
     // Perform the iteration function
     for (int i = 0; i < 64; i++) {
-        uint32_t temp1 = H + SIG1(E) + ch(E, F, G) + k[i] + W[i];
-        uint32_t temp2 = SIG0(A) + maj(A, B, C);
+        uint32_t temp1 = H + SIG1(E) + sha256_ch(E, F, G) + sha256_k[i] + W[i];
+        uint32_t temp2 = SIG0(A) + sha256_maj(A, B, C);
         H = G;
         G = F;
         F = E;
@@ -198,52 +1098,101 @@ void compress(uint8_t* block, uint32_t *prev_H) {
     prev_H[5] += F; 
     prev_H[6] += G; 
     prev_H[7] += H; 
+
+    free(W);
 }
 
+#ifdef HAVE_X86_INTRINSICS
 /**
- * Performs the SHA-256 hash function
- * @param msg the message to calculate the hash of
- * @returns the digest of the msg
+ * Runs the SHA-NI compression function on a single block, so it can be benchmarked the same way as sha256_compress()
+ * @param block the 512-bit block of the message that is being worked on
+ * @param prev_H (IN/OUT) the outputted hash message from the previous call to this function (or the initial hash). Will contain the resulting hash upon return
  */
-uint8_t* sha256(uint8_t *msg) {
-    /*** PREPROCESSING ***/
-    // Pad the message
-    uint8_t *padded = NULL;
-    int padded_len = 0;
-    pad_msg(msg, strlen(msg), &padded, &padded_len);
-    // Breaking the padded message into blocks will be done in the main loop
+void sha256_compress_shani_block(const uint8_t *block, uint32_t *prev_H) {
+    sha256_compress_shani(block, 1, prev_H);
+}
+#endif
 
-    /*** CORE HASH FUNCTIONALITY ***/
-    uint32_t H[8] = {0}; // The most recent hash value
-    memcpy(H, H0, 256/8); // Set the initial hash value to the constant H0
+/**
+ * Reads the processor's cycle counter (or a nanosecond clock on processors without one)
+ * @returns the current cycle count
+ */
+uint64_t read_cycles() {
+#ifdef HAVE_X86_INTRINSICS
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
 
-    // Perform the compression function for each block in the message
-    for (int block_index = 0; block_index < (padded_len / 64); block_index++) {
-        uint8_t* block = &padded[block_index * 64];
-        compress(block, H);
+/**
+ * Sorts measurements in place (there are only a few of them, so a simple insertion sort is plenty)
+ * @param values (IN/OUT) the measurements to sort
+ * @param count the number of measurements
+ */
+void sort_doubles(double *values, int count) {
+    for (int i = 1; i < count; i++) {
+        double value = values[i];
+        int j = i;
+        for (; j > 0 && values[j - 1] > value; j--) {
+            values[j] = values[j - 1];
+        }
+        values[j] = value;
     }
+}
 
-    // Convert the BIG ENDIAN final hash back into LITTLE ENDIAN for this implementation
-    // (Also converts the word-index hash back into byte-index)
-    uint8_t *digest = malloc(256/8);
-    for (int i = 0; i < 32; i++) {
-        digest[i] = (H[i/4] >> (24 - 8*i)) & 0x000000FF;
+/**
+ * Measures how many cycles per byte each compression function takes, and how fast each is relative to the first one
+ * The functions take turns within every run, so a slow stretch of the machine (frequency changes, other processes) hits
+ * all of them alike, and the medians over the runs are reported so one lucky or interrupted run does not decide the result
+ * (For the steadiest numbers also pin the process to one core, e.g. "taskset -c 0 ./sha256 benchmark")
+ * @param names the names to print for the compression functions
+ * @param compress_fns the compression functions to measure, the first is the baseline the others are compared to
+ * @param count the number of compression functions (at most 4)
+ */
+void benchmark_compress(const char **names, void (**compress_fns)(const uint8_t*, uint32_t*), int count) {
+    uint8_t blocks[64 * 64];
+    uint32_t H[8];
+    memcpy(H, sha256_H0, 256/8);
+    for (int i = 0; i < 64 * 64; i++) {
+        blocks[i] = i;
     }
 
-    free(padded);
-    return digest;
-}
+    // The first run only warms up the caches and branch predictors
+    double cycles_per_byte[4][31], speedup[4][31];
+    for (int run = -1; run < 31; run++) {
+        for (int fn = 0; fn < count; fn++) {
+            uint64_t start = read_cycles();
+            for (int rep = 0; rep < 100; rep++) {
+                for (int block_index = 0; block_index < 64; block_index++) {
+                    compress_fns[fn](&blocks[block_index * 64], H);
+                }
+            }
+            uint64_t cycles = read_cycles() - start;
+            if (run >= 0) {
+                cycles_per_byte[fn][run] = (double)cycles / (100 * 64 * 64);
+            }
+        }
+        for (int fn = 0; run >= 0 && fn < count; fn++) {
+            speedup[fn][run] = cycles_per_byte[0][run] / cycles_per_byte[fn][run];
+        }
+    }
 
+    for (int fn = 0; fn < count; fn++) {
+        sort_doubles(cycles_per_byte[fn], 31);
+        sort_doubles(speedup[fn], 31);
+        printf("%-20s %6.2f cycles/byte %6.2fx %s (medians of 31 runs)\n", names[fn], cycles_per_byte[fn][15], speedup[fn][15], names[0]);
+    }
+}
 
-/**************
-*** TESTING ***
-**************/
-int main() {    
+int main(int argc, char **argv) {    
     // Set test variables for the cipher
     uint8_t msg[] = "sha-256 test msg!";
     printf("message = %s\n", msg);
 
-    uint8_t *digest = sha256(msg);
+    uint8_t *digest = sha256(msg, strlen(msg));
     printf("digest = %s\n", digest);
     printf("       = ");
     for (int i = 0; i < 256/8; i++) {
@@ -251,6 +1200,140 @@ int main() {
     }
     printf("\n");
 
+    // Sanity check the streaming interface gives the same digest when fed one byte at a time
+    sha256_ctx ctx;
+    uint8_t streamed_digest[256/8];
+    sha256_init(&ctx);
+    for (size_t i = 0; i < strlen(msg); i++) {
+        sha256_update(&ctx, &msg[i], 1);
+    }
+    sha256_final(&ctx, streamed_digest);
+    if (memcmp(digest, streamed_digest, 256/8) != 0) {
+        printf("ERROR: Streamed digest and one-shot digest are NOT the same!\n");
+    }
+
+    // Sanity check the batch interface against hashing each message by itself, using a mix of message lengths
+    uint8_t batch_data[2000];
+    const uint8_t *batch_msgs[40];
+    size_t batch_lens[40];
+    uint8_t batch_digests[40][256/8];
+    for (int i = 0; i < 2000; i++) {
+        batch_data[i] = i * 7;
+    }
+    for (int i = 0; i < 40; i++) {
+        batch_msgs[i] = &batch_data[i];
+        batch_lens[i] = (i * 97) % 1000;
+    }
+    sha256_batch(batch_msgs, batch_lens, 40, batch_digests);
+    for (int i = 0; i < 40; i++) {
+        uint8_t *single_digest = sha256(batch_msgs[i], batch_lens[i]);
+        if (memcmp(batch_digests[i], single_digest, 256/8) != 0) {
+            printf("ERROR: Batch digest %d and one-shot digest are NOT the same!\n", i);
+        }
+        free(single_digest);
+    }
+
+    // Sanity check that updating one chunk of a tree gives the same root as rebuilding the whole tree
+    uint8_t tree_data[10000];
+    for (int i = 0; i < 10000; i++) {
+        tree_data[i] = i * 13;
+    }
+    sha256_tree tree, rebuilt_tree;
+    sha256_tree_hash(&tree, tree_data, sizeof(tree_data), 1024, 4);
+    tree_data[5000] ^= 1;
+    if (sha256_tree_update(&tree, 5000 / 1024, &tree_data[(5000 / 1024) * 1024], 1024) != 0) {
+        printf("ERROR: Updating a chunk of the tree failed!\n");
+    }
+    sha256_tree_hash(&rebuilt_tree, tree_data, sizeof(tree_data), 1024, 1);
+    if (memcmp(tree.root, rebuilt_tree.root, 256/8) != 0) {
+        printf("ERROR: Updated tree root and rebuilt tree root are NOT the same!\n");
+    }
+    if (sha256_tree_update(&tree, 10, tree_data, 1024) != -1 || sha256_tree_update(&tree, 9, &tree_data[9*1024], 1024) != -1) {
+        printf("ERROR: Tree update past the last chunk or with the wrong chunk length was NOT rejected!\n");
+    }
+    if (memcmp(tree.root, rebuilt_tree.root, 256/8) != 0) {
+        printf("ERROR: Rejected tree updates changed the tree!\n");
+    }
+    sha256_tree_free(&tree);
+    sha256_tree_free(&rebuilt_tree);
+    if (sha256_tree_hash(&tree, tree_data, sizeof(tree_data), 0, 1) != -1) {
+        printf("ERROR: Tree with a chunk size of 0 was NOT rejected!\n");
+    }
+
+    // Sanity check HMAC-SHA256 and PBKDF2-HMAC-SHA256 against known answers (RFC 4231 test case 2, RFC 7914 section 11)
+    uint8_t mac[256/8];
+    uint8_t expected_mac[256/8] = {
+        0x5b, 0xdc, 0xc1, 0x46, 0xbf, 0x60, 0x75, 0x4e, 0x6a, 0x04, 0x24, 0x26, 0x08, 0x95, 0x75, 0xc7,
+        0x5a, 0x00, 0x3f, 0x08, 0x9d, 0x27, 0x39, 0x83, 0x9d, 0xec, 0x58, 0xb9, 0x64, 0xec, 0x38, 0x43
+    };
+    hmac_sha256_key hkey;
+    hmac_sha256_set_key(&hkey, (const uint8_t *)"Jefe", 4);
+    hmac_sha256(&hkey, (const uint8_t *)"what do ya want for nothing?", 28, mac);
+    if (memcmp(mac, expected_mac, 256/8) != 0) {
+        printf("ERROR: HMAC-SHA256 does NOT match the known answer!\n");
+    }
+
+    uint8_t derived_key[64];
+    uint8_t expected_key[64] = {
+        0x55, 0xac, 0x04, 0x6e, 0x56, 0xe3, 0x08, 0x9f, 0xec, 0x16, 0x91, 0xc2, 0x25, 0x44, 0xb6, 0x05,
+        0xf9, 0x41, 0x85, 0x21, 0x6d, 0xde, 0x04, 0x65, 0xe6, 0x8b, 0x9d, 0x57, 0xc2, 0x0d, 0xac, 0xbc,
+        0x49, 0xca, 0x9c, 0xcc, 0xf1, 0x79, 0xb6, 0x45, 0x99, 0x16, 0x64, 0xb3, 0x9d, 0x77, 0xef, 0x31,
+        0x7c, 0x71, 0xb8, 0x45, 0xb1, 0xe3, 0x0b, 0xd5, 0x09, 0x11, 0x20, 0x41, 0xd3, 0xa1, 0x97, 0x83
+    };
+    pbkdf2_hmac_sha256((const uint8_t *)"passwd", 6, (const uint8_t *)"salt", 4, 1, derived_key, 64);
+    if (memcmp(derived_key, expected_key, 64) != 0) {
+        printf("ERROR: PBKDF2-HMAC-SHA256 does NOT match the known answer!\n");
+    }
+
+    // A long output (16 full blocks and 1 partial block) with many iterations, so the blocks also go through the lanes
+    // (the known answer is the SHA-256 of the whole 520-byte derived key, computed with Python's hashlib)
+    uint8_t long_derived_key[520];
+    uint8_t expected_long_key_digest[256/8] = {
+        0xd2, 0x5a, 0x5b, 0xd2, 0xdb, 0x54, 0x8a, 0x93, 0x96, 0xc5, 0xde, 0x18, 0x0b, 0xed, 0xc7, 0x36,
+        0x7c, 0xf0, 0x7f, 0x9b, 0xd6, 0xa6, 0xd8, 0x07, 0x0b, 0x01, 0xdd, 0xf4, 0x9d, 0x68, 0x76, 0x3c
+    };
+    pbkdf2_hmac_sha256((const uint8_t *)"passwd", 6, (const uint8_t *)"salt", 4, 100, long_derived_key, sizeof(long_derived_key));
+    uint8_t *long_key_digest = sha256(long_derived_key, sizeof(long_derived_key));
+    if (memcmp(long_key_digest, expected_long_key_digest, 256/8) != 0) {
+        printf("ERROR: Long PBKDF2-HMAC-SHA256 output does NOT match the known answer!\n");
+    }
+    free(long_key_digest);
+
+#ifdef HAVE_X86_INTRINSICS
+    // Sanity check the SHA-NI compression function against the portable one from a random state over random blocks
+    // (sha256_compress_blocks always picks SHA-NI when the processor has it, so nothing else here would reach sha256_compress)
+    if (sha256_use_sha_ni()) {
+        uint8_t blocks[8*64];
+        uint32_t scalar_H[8], shani_H[8];
+        for (int i = 0; i < 8*64; i++) {
+            blocks[i] = rand();
+        }
+        for (int i = 0; i < 8; i++) {
+            scalar_H[i] = shani_H[i] = ((uint32_t)rand() << 16) ^ rand();
+        }
+        for (int i = 0; i < 8; i++) {
+            sha256_compress(&blocks[i * 64], scalar_H);
+        }
+        sha256_compress_shani(blocks, 8, shani_H);
+        if (memcmp(scalar_H, shani_H, sizeof(scalar_H)) != 0) {
+            printf("ERROR: SHA-NI and portable compression functions do NOT give the same hash!\n");
+        }
+    }
+#endif
+
+    // Compare the speed of the compression functions when run as "./sha256 benchmark"
+    if (argc > 1 && strcmp(argv[1], "benchmark") == 0) {
+        const char *names[3] = {"compress_reference", "compress", "compress_shani"};
+        void (*compress_fns[3])(const uint8_t*, uint32_t*) = {sha256_compress_reference, sha256_compress, NULL};
+        int num_fns = 2;
+#ifdef HAVE_X86_INTRINSICS
+        if (sha256_cpu_has_sha_ni()) {
+            compress_fns[num_fns++] = sha256_compress_shani_block;
+        }
+#endif
+        benchmark_compress(names, compress_fns, num_fns);
+    }
+
     free(digest);
     return 0;
 }
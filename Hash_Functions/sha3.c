@@ -2,10 +2,12 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+
+#include "lanes.h" // The CPU feature checks and the multi-buffer lane scheduler, shared with MD5 and SHA-256
 
 
 /**
- * This is made to only work with string inputs. Modifications will be needed for file or binary calculations
  * This implementation operates on byte index inputs (meaning it does not work for inputs with bit lengths that are not byte multiples)
  */
 
@@ -25,24 +27,57 @@
 | SHAKE256 |       1600      |     1088     |     512      |       256      |     any     |
 */
 
-// This implementation is performing SHA3-256
+// sha3() and the sha3_* functions perform SHA3-256, the keccak_* functions can perform any of the variants
 #define OUTPUT_BITS 256
 #define STATE_BITS 1600
 #define RATE_BITS 1088
 #define WIDTH 25 // The total depth of each lane (AKA how many values in each lane)
 #define CAPACITY_BITS (STATE_BITS - RATE_BITS) // This determines the security level!
 
+#define MAX_RATE_BYTES (1344/8) // The largest rate, used by SHAKE128
+
+// The variants in the table above
+typedef enum {
+    SHA3_224,
+    SHA3_256,
+    SHA3_384,
+    SHA3_512,
+    SHAKE128,
+    SHAKE256
+} keccak_variant;
+
+// The rate (in BYTES), domain suffix, and digest length (in BYTES, 0 for the XOFs) of each variant
+// The suffix byte holds the domain bits (01 for SHA-3, 1111 for SHAKE) followed by the first 1 bit of the padding
+const struct {
+    int rate;
+    uint8_t suffix;
+    int output_len;
+} keccak_variants[6] = {
+    {1152/8, 0x06, 224/8},
+    {1088/8, 0x06, 256/8},
+    { 832/8, 0x06, 384/8},
+    { 576/8, 0x06, 512/8},
+    {1344/8, 0x1F, 0},
+    {1088/8, 0x1F, 0}
+};
+
+// Where the j'th lane of a block goes in a state ordered [x][y] (x = j % 5, y = j / 5)
+const int block_lane_index[25] = {
+    0, 5, 10, 15, 20, 1, 6, 11, 16, 21, 2, 7, 12, 17, 22, 3, 8, 13, 18, 23, 4, 9, 14, 19, 24
+};
+
 #define MOD(x, n) (((x) % (n) + (n)) % (n))
-#define ROTR(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
-#define ROTL(x, n) (((x) << (n)) | ((x) >> (64 - (n)))) 
+#define ROTR(x, n) (((x) >> ((n) & 63)) | ((x) << ((64 - (n)) & 63))) // The & 63 keeps a rotation by 0 from shifting by 64
+#define ROTL(x, n) (((x) << ((n) & 63)) | ((x) >> ((64 - (n)) & 63)))
 
+// Indexed [x][y], already reduced mod 64 (the specification lists them unreduced, e.g. 300 rather than 44)
 int rho_offsets[5][5] = {
-//   0    1    2    3    4   = x
-    {  0,  36,   3, 105, 210},      // y = 0
-    {  1, 300,  10,  45,  66},      // y = 1
-    {190,   6, 171,  15, 253},      // y = 2
-    { 28,  55, 153,  21, 120},      // y = 3
-    { 91, 276, 231, 136,  78}       // y = 4
+//   0    1    2    3    4   = y
+    {  0,  36,   3,  41,  18},      // x = 0
+    {  1,  44,  10,  45,   2},      // x = 1
+    { 62,   6,  43,  15,  61},      // x = 2
+    { 28,  55,  25,  21,  56},      // x = 3
+    { 27,  20,  39,   8,  14}       // x = 4
 };
 
 uint64_t RC[24] = {
@@ -74,36 +109,56 @@ uint64_t RC[24] = {
 
 
 
-/********************
-*** PREPROCESSING ***
-********************/
+/**********************
+*** KECCAK TRACING ***
+**********************/
 /**
- * Pad the message to be a multiple of the 512 bits
- * Will append a 1, then k zero bits, and then a 64-bit block at the end containing the original msg length
- * @param msg the original message to pad
- * @param len the length of msg in BYTES
- * @param padded (OUTPUT) a double pointer where the outputted padded message will be put
- * @param len_padded (OUTPUT) the length of the padded message in BYTES
+ * Callback that is given the state after each step of keccak_f, for following along with how the permutation works
+ * @param step the name of the step that was just performed ("ROUND" is given at the start of each round, "FINAL" after the last one)
+ * @param round_num the round the step belongs to (0-23, or 24 for "FINAL")
+ * @param state the current state
+ * @param arg the value of keccak_trace_arg
  */
-void pad_msg(uint8_t *msg, int len, uint8_t **padded, int *len_padded) {
-    // Calculate the number of 0s needed, k 
-    // The message must have the 2-bit suffix added regardless of length
-    // Pads the message by adding 10*1, where 0* = 0000...0
-    // Note that 0* can be the empty string, so the smallest possible padding would be the suffix + '11'
-    int k = (RATE_BITS - ((8*(len) + 2) % RATE_BITS)) % RATE_BITS; // The +2 accounts for the suffix and the minimum possible padding
-    
-    // Create the new padded message
-    int remainder = ((8*(len) + 2 + k) % 8) ? 1 : 0;
-    *len_padded = ((8*(len) + 2 + k) / 8) + remainder;
-    *padded = malloc(*len_padded);
-    memset(*padded, 0, *len_padded); // Set all bits to 0
-    memcpy(*padded, msg, len); // Copy over the original message
+typedef void (*keccak_trace_fn)(const char *step, int round_num, uint64_t state[5][5], void *arg);
+
+// Tracing is compiled out entirely when NDEBUG is defined (release builds)
+// Otherwise it costs one NULL check per step, and is only turned on by setting keccak_trace
+#ifndef NDEBUG
+keccak_trace_fn keccak_trace = NULL;
+void *keccak_trace_arg = NULL;
+#define KECCAK_TRACE(step, round_num, state) \
+    do { \
+        if (keccak_trace != NULL) { \
+            keccak_trace(step, round_num, state, keccak_trace_arg); \
+        } \
+    } while (0)
+#else
+#define KECCAK_TRACE(step, round_num, state) do { } while (0)
+#endif
+
+/**
+ * A keccak_trace_fn that prints the state after each step
+ * @param step the name of the step that was just performed
+ * @param round_num the round the step belongs to
+ * @param state the current state
+ * @param arg the FILE to print to, or NULL to print to stdout
+ */
+void print_keccak_trace(const char *step, int round_num, uint64_t state[5][5], void *arg) {
+    FILE *out = (arg != NULL) ? arg : stdout;
+    if (strcmp(step, "ROUND") == 0) {
+        fprintf(out, "\n\n========================= ROUND %d =========================\n", round_num);
+    }
+    else if (strcmp(step, "FINAL") == 0) {
+        fprintf(out, "\n\n========================= FINAL =========================\n");
+    }
+    else {
+        fprintf(out, "-----%s-----\n", step);
+    }
 
-    // Apply the suffix and padding bits
-    // For this simpler implementation, the msg will ALWAYS be aligned on a byte boundary, so we can safely apply the suffix on the first padding byte
-    // If we have multiple bytes of padding, the first byte of padding will always be SUFFIX || 10*, and the last byte will always be 0*1
-    (*padded)[len] = 0x06; // Make the first bits SUFFIX || 10* in the first padding byte, which is 01 || 10* = 01100000 = 0x06 (in little endian)
-    (*padded)[*len_padded - 1] |= 0x80; // Make the last bit in the last padding byte 1
+    for (int i = 0; i < 25; i++) {
+        fprintf(out, "%lx", state[i % 5][i / 5]);
+    }
+    fprintf(out, (strcmp(step, "FINAL") == 0) ? "\n\n" : "\n");
 }
 
 
@@ -206,135 +261,867 @@ void iota(uint64_t state[5][5], int round_num) {
 
 
 /**
- * Perform the overall Keccak-f round function
+ * Perform the Keccak-p permutation with a reduced number of rounds, one step at a time exactly as the specification describes it
+ * Keccak-p[1600, n] is the LAST n rounds of Keccak-f (so it uses round constants 24-n to 23), and Keccak-f is Keccak-p[1600, 24]
+ * The state can be traced after each step by setting keccak_trace (see KECCAK TRACING above), otherwise this does no I/O
+ * @param state (IN/OUT) the state to permute
+ * @param num_rounds the number of rounds (1-24)
 */
-void keccak_f(uint64_t state[5][5]) {
-    for (int i = 0; i < 24; i++) {
-        printf("\n\n========================= ROUND %d =========================\n", i);
-        for (int i = 0; i < 25; i++) {
-            printf("%lx", state[i % 5][i / 5]);
-        }
-        printf("\n");
+void keccak_p_reference(uint64_t state[5][5], int num_rounds) {
+    for (int i = 24 - num_rounds; i < 24; i++) {
+        KECCAK_TRACE("ROUND", i, state);
 
         theta(state);
-        printf("-----THETA-----\n");
-        for (int i = 0; i < 25; i++) {
-            printf("%lx", state[i % 5][i / 5]);
-        }
-        printf("\n");
+        KECCAK_TRACE("THETA", i, state);
 
         rho(state);
         pi(state);
-        printf("-----RHO PI-----\n");
-        for (int i = 0; i < 25; i++) {
-            printf("%lx", state[i % 5][i / 5]);
-        }
-        printf("\n");
+        KECCAK_TRACE("RHO PI", i, state);
 
         chi(state);
-        printf("-----CHI-----\n");
-        for (int i = 0; i < 25; i++) {
-            printf("%lx", state[i % 5][i / 5]);
-        }
-        printf("\n");
+        KECCAK_TRACE("CHI", i, state);
 
         iota(state, i);
     }
 
-    printf("\n\n========================= FINAL =========================\n");
-    for (int i = 0; i < 25; i++) {
-        printf("%lx", state[i % 5][i / 5]);
+    KECCAK_TRACE("FINAL", 24, state);
+}
+
+/**
+ * Perform the overall Keccak-f round function, one step at a time exactly as the specification describes it
+ * This is kept as the reference to test the optimized keccak_f against, and is also what the trace follows
+ */
+void keccak_f_reference(uint64_t state[5][5]) {
+    keccak_p_reference(state, 24);
+}
+
+
+/*************************
+*** OPTIMIZED KECCAK-f ***
+*************************/
+/*
+ * The optimized permutation keeps all 25 lanes in local variables, named A<row><column> after their (x, y) position:
+ * the column (x = 0..4) is the letter a, e, i, o, u and the row (y = 0..4) is the letter b, g, k, m, s
+ * (e.g. Abe is state[1][0] and Asa is state[0][4])
+ *
+ * Each round is done as one pass:
+ *   - theta's column parities C and their effects D are computed first
+ *   - rho and pi are then fused, each lane is XOR'ed with its D, rotated, and stored straight into its permuted position B
+ *   - chi is then computed one row of B at a time, and iota is folded into the first lane
+ *
+ * chi needs a NOT in every lane (out = a ^ (~b & c)), but if some lanes are kept complemented between rounds,
+ * then De Morgan's laws let most of those NOTs be absorbed (~b & c = ~(b | ~c), etc.)
+ * Keeping the 6 lanes Abe, Abi, Ago, Aki, Ami, Asa complemented leaves only 1 NOT per row (5 per round instead of 25)
+ * Theta is unaffected, since the complements cancel out in pairs or pass straight through the XORs
+ * The lanes are complemented once before the first round, and once again after the last one
+ */
+
+/**
+ * Performs one round of the optimized Keccak-f, reading the lanes A.. and writing the new lanes E..
+ * @param A the prefix of the input lane variables
+ * @param E the prefix of the output lane variables
+ * @param round_num the round number (0-23), selects the round constant for iota
+ */
+#define KECCAK_ROUND(A, E, round_num) \
+    /* Theta: the parity of each column, and the value each column is XOR'ed with */ \
+    Ca = A##ba ^ A##ga ^ A##ka ^ A##ma ^ A##sa; \
+    Ce = A##be ^ A##ge ^ A##ke ^ A##me ^ A##se; \
+    Ci = A##bi ^ A##gi ^ A##ki ^ A##mi ^ A##si; \
+    Co = A##bo ^ A##go ^ A##ko ^ A##mo ^ A##so; \
+    Cu = A##bu ^ A##gu ^ A##ku ^ A##mu ^ A##su; \
+    Da = Cu ^ ROTL(Ce, 1); \
+    De = Ca ^ ROTL(Ci, 1); \
+    Di = Ce ^ ROTL(Co, 1); \
+    Do = Ci ^ ROTL(Cu, 1); \
+    Du = Co ^ ROTL(Ca, 1); \
+    \
+    /* Rho and pi into row b of B, then chi and iota for that row */ \
+    Bba = A##ba ^ Da; \
+    Bbe = ROTL(A##ge ^ De, 44); \
+    Bbi = ROTL(A##ki ^ Di, 43); \
+    Bbo = ROTL(A##mo ^ Do, 21); \
+    Bbu = ROTL(A##su ^ Du, 14); \
+    E##ba = Bba ^ (Bbe | Bbi) ^ RC[round_num]; \
+    E##be = Bbe ^ (~Bbi | Bbo); \
+    E##bi = Bbi ^ (Bbo & Bbu); \
+    E##bo = Bbo ^ (Bbu | Bba); \
+    E##bu = Bbu ^ (Bba & Bbe); \
+    \
+    /* Row g */ \
+    Bga = ROTL(A##bo ^ Do, 28); \
+    Bge = ROTL(A##gu ^ Du, 20); \
+    Bgi = ROTL(A##ka ^ Da, 3); \
+    Bgo = ROTL(A##me ^ De, 45); \
+    Bgu = ROTL(A##si ^ Di, 61); \
+    E##ga = Bga ^ (Bge | Bgi); \
+    E##ge = Bge ^ (Bgi & Bgo); \
+    E##gi = Bgi ^ (Bgo | ~Bgu); \
+    E##go = Bgo ^ (Bgu | Bga); \
+    E##gu = Bgu ^ (Bga & Bge); \
+    \
+    /* Row k */ \
+    Bka = ROTL(A##be ^ De, 1); \
+    Bke = ROTL(A##gi ^ Di, 6); \
+    Bki = ROTL(A##ko ^ Do, 25); \
+    Bko = ROTL(A##mu ^ Du, 8); \
+    Bku = ROTL(A##sa ^ Da, 18); \
+    E##ka = Bka ^ (Bke | Bki); \
+    E##ke = Bke ^ (Bki & Bko); \
+    E##ki = Bki ^ (~Bko & Bku); \
+    E##ko = ~Bko ^ (Bku | Bka); \
+    E##ku = Bku ^ (Bka & Bke); \
+    \
+    /* Row m */ \
+    Bma = ROTL(A##bu ^ Du, 27); \
+    Bme = ROTL(A##ga ^ Da, 36); \
+    Bmi = ROTL(A##ke ^ De, 10); \
+    Bmo = ROTL(A##mi ^ Di, 15); \
+    Bmu = ROTL(A##so ^ Do, 56); \
+    E##ma = Bma ^ (Bme & Bmi); \
+    E##me = Bme ^ (Bmi | Bmo); \
+    E##mi = Bmi ^ (~Bmo | Bmu); \
+    E##mo = ~Bmo ^ (Bmu & Bma); \
+    E##mu = Bmu ^ (Bma | Bme); \
+    \
+    /* Row s */ \
+    Bsa = ROTL(A##bi ^ Di, 62); \
+    Bse = ROTL(A##go ^ Do, 55); \
+    Bsi = ROTL(A##ku ^ Du, 39); \
+    Bso = ROTL(A##ma ^ Da, 41); \
+    Bsu = ROTL(A##se ^ De, 2); \
+    E##sa = Bsa ^ (~Bse & Bsi); \
+    E##se = ~Bse ^ (Bsi | Bso); \
+    E##si = Bsi ^ (Bso & Bsu); \
+    E##so = Bso ^ (Bsu | Bsa); \
+    E##su = Bsu ^ (Bsa & Bse);
+
+/**
+ * Perform the Keccak-p permutation with a reduced number of rounds, with every round done in registers (see OPTIMIZED KECCAK-f above)
+ * Gives the same result as keccak_p_reference
+ * @param state (IN/OUT) the state to permute
+ * @param num_rounds the number of rounds (must be even, since the rounds are done in pairs)
+ */
+void keccak_p(uint64_t state[5][5], int num_rounds) {
+#ifndef NDEBUG
+    // Tracing needs the state after each separate step, which only the reference has
+    if (keccak_trace != NULL) {
+        keccak_p_reference(state, num_rounds);
+        return;
     }
-    printf("\n\n");
+#endif
+
+    uint64_t Ca, Ce, Ci, Co, Cu;
+    uint64_t Da, De, Di, Do, Du;
+    uint64_t Bba, Bbe, Bbi, Bbo, Bbu, Bga, Bge, Bgi, Bgo, Bgu, Bka, Bke, Bki, Bko, Bku, Bma, Bme, Bmi, Bmo, Bmu, Bsa, Bse, Bsi, Bso, Bsu;
+    uint64_t Eba, Ebe, Ebi, Ebo, Ebu, Ega, Ege, Egi, Ego, Egu, Eka, Eke, Eki, Eko, Eku, Ema, Eme, Emi, Emo, Emu, Esa, Ese, Esi, Eso, Esu;
+
+    // Load the lanes, complementing the ones that are kept complemented
+    uint64_t Aba = state[0][0], Abe = ~state[1][0], Abi = ~state[2][0], Abo = state[3][0], Abu = state[4][0];
+    uint64_t Aga = state[0][1], Age = state[1][1], Agi = state[2][1], Ago = ~state[3][1], Agu = state[4][1];
+    uint64_t Aka = state[0][2], Ake = state[1][2], Aki = ~state[2][2], Ako = state[3][2], Aku = state[4][2];
+    uint64_t Ama = state[0][3], Ame = state[1][3], Ami = ~state[2][3], Amo = state[3][3], Amu = state[4][3];
+    uint64_t Asa = ~state[0][4], Ase = state[1][4], Asi = state[2][4], Aso = state[3][4], Asu = state[4][4];
+
+    // Alternate between the A and E lanes, so the state never has to be copied
+    for (int i = 24 - num_rounds; i < 24; i += 2) {
+        KECCAK_ROUND(A, E, i)
+        KECCAK_ROUND(E, A, i + 1)
+    }
+
+    // Store the lanes, undoing the complementing
+    state[0][0] = Aba; state[1][0] = ~Abe; state[2][0] = ~Abi; state[3][0] = Abo; state[4][0] = Abu;
+    state[0][1] = Aga; state[1][1] = Age; state[2][1] = Agi; state[3][1] = ~Ago; state[4][1] = Agu;
+    state[0][2] = Aka; state[1][2] = Ake; state[2][2] = ~Aki; state[3][2] = Ako; state[4][2] = Aku;
+    state[0][3] = Ama; state[1][3] = Ame; state[2][3] = ~Ami; state[3][3] = Amo; state[4][3] = Amu;
+    state[0][4] = ~Asa; state[1][4] = Ase; state[2][4] = Asi; state[3][4] = Aso; state[4][4] = Asu;
+}
+
+/**
+ * Perform the overall Keccak-f round function (all 24 rounds) with the optimized permutation
+ * Gives the same result as keccak_f_reference
+ * @param state (IN/OUT) the state to permute
+ */
+void keccak_f(uint64_t state[5][5]) {
+    keccak_p(state, 24);
 }
 
 
 /**********************
 *** CORE SHA-3 HASH ***
 **********************/
-uint64_t extend_block(uint8_t* block) {
-    uint64_t extended_block = 0;
-    for (int i = 0; i < 8; i++) {
-        // printf("\tByte: %lx\n", (uint64_t)block[i]);
-        extended_block |= ((uint64_t)block[i]) << (8*i);
-    }
-    return extended_block;
-}
-
-uint8_t* sha3(uint8_t *msg) {
-    /*** PREPROCESSING ***/
-    // Pad the message
-    uint8_t *padded_msg = NULL;
-    int padded_len = 0;
-    pad_msg(msg, strlen(msg), &padded_msg, &padded_len);
-
-    // for (int i = 0; i < padded_len; i++) {
-    //     if (i == strlen(msg)) {
-    //         printf("|");
-    //     }
-    //     printf("%02x", padded_msg[i]);
-    // }
-    // printf("\n");
-
-
-    // Create the internal SHA-3 state 
-    uint64_t state[5][5] = {0}; // Each index is a lane, which contains 64 bits, for a total of 5*5*64 = 1600 state bits
-    
-    /*** ABSORBING PHASE ***/
-    // Break padded message into RATE_BITS sized blocks
-    for (int i = 0; i < padded_len; i += RATE_BITS/8) {
-        uint8_t* block = padded_msg + i*RATE_BITS;
-
-        // XOR the current block with the RATE component of the state
-        for (int j = 0; j < RATE_BITS/(8*8); j++) { // Loop through by LANE
-            // printf("Extended block: %lx\n", extend_block(block + 8*j));
-            state[j % 5][j / 5] ^= extend_block(block + 8*j);
+/**
+ * Reads 8 bytes of a message as a lane, in LITTLE ENDIAN (the byte order the sponge uses)
+ * @param bytes the 8 bytes to read
+ * @returns the lane
+ */
+uint64_t load_lane(const uint8_t *bytes) {
+    uint64_t lane;
+    memcpy(&lane, bytes, 8); // A single (unaligned) 64-bit load
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    lane = __builtin_bswap64(lane);
+#endif
+    return lane;
+}
+
+/**
+ * Writes a lane out as 8 bytes in LITTLE ENDIAN (the opposite of load_lane)
+ * The compiler turns the separate byte writes into a single store
+ * @param bytes (OUTPUT) where the 8 bytes go
+ * @param lane the lane to write out
+ */
+void store_lane(uint8_t *bytes, uint64_t lane) {
+    bytes[0] = (uint8_t)lane;
+    bytes[1] = (uint8_t)(lane >> 8);
+    bytes[2] = (uint8_t)(lane >> 16);
+    bytes[3] = (uint8_t)(lane >> 24);
+    bytes[4] = (uint8_t)(lane >> 32);
+    bytes[5] = (uint8_t)(lane >> 40);
+    bytes[6] = (uint8_t)(lane >> 48);
+    bytes[7] = (uint8_t)(lane >> 56);
+}
+
+/**
+ * XORs bytes into the RATE component of a state, starting part way through it
+ * Only used for the ends of a message that do not fill a whole lane, everything else is absorbed with load_lane
+ * @param words (IN/OUT) lane (0, 0) of the state, with lane (x, y) at words[(x*5 + y)*stride]
+ * @param stride the distance between lanes of the same state (1, unless states are interleaved)
+ * @param offset how many bytes into the RATE component to start at
+ * @param bytes the bytes to XOR in
+ * @param len the number of bytes
+ */
+void xor_bytes(uint64_t *words, int stride, size_t offset, const uint8_t *bytes, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        words[block_lane_index[(offset + i) / 8]*stride] ^= (uint64_t)bytes[i] << 8*((offset + i) % 8);
+    }
+}
+
+
+/**
+ * Internal state of a sponge, which can be any of the variants in the table at the top (see keccak_init)
+ * Lets a message be hashed in pieces (e.g. as it is read from a file) without ever holding the whole thing in memory,
+ * and lets output be squeezed out in pieces too
+ * The message is XOR'ed straight into the state as it arrives, so it is never copied, and is only padded once squeezing starts
+ */
+typedef struct {
+    uint64_t state[5][5]; // The sponge state, indexed [x][y] like in keccak_f
+    uint8_t buffer[MAX_RATE_BYTES]; // While squeezing, holds the block of output most recently squeezed out of the state
+    size_t offset; // While absorbing, how many bytes of the current block have been XOR'ed into the state
+                   // While squeezing, how many bytes of buffer have been output
+    int squeezing; // Whether the message has been padded, and output is now being squeezed out
+    int rate; // The rate in BYTES
+    uint8_t suffix; // The domain suffix byte (including the first bit of the padding)
+    int output_len; // The length of the digest in BYTES, or 0 for the XOFs (SHAKE) which have no fixed length
+} keccak_ctx;
+
+// A sponge that is always SHA3-256, and is only used with the sha3_* functions
+// These are the same as the keccak_* functions, except the rate and suffix are constants, so they compile to simpler code
+// (The context is also shared by other sponges built on a Keccak permutation, see DEFINE_SPONGE)
+typedef keccak_ctx sha3_ctx;
+
+/**
+ * XORs one rate sized block into the RATE component of the state, and then performs the Keccak round function
+ * (A macro rather than a function so that a constant rate can be folded into the loop)
+ * @param ctx the context of the sponge
+ * @param block the block to absorb
+ * @param RATE the rate in BYTES
+ * @param PERMUTE the permutation of the sponge (keccak_f for SHA-3 and SHAKE)
+ */
+#define SPONGE_ABSORB_BLOCK(ctx, block, RATE, PERMUTE) \
+    do { \
+        for (int j = 0; j < (RATE)/8; j++) { /* Loop through by LANE */ \
+            ((uint64_t*)(ctx)->state)[block_lane_index[j]] ^= load_lane((block) + 8*j); \
+        } \
+        PERMUTE((ctx)->state); \
+    } while (0)
+
+/**
+ * Copies the RATE component of the state out into the buffer, ready to be handed out as output
+ * @param ctx the context of the sponge
+ * @param RATE the rate in BYTES
+ */
+#define SPONGE_SQUEEZE_BLOCK(ctx, RATE) \
+    do { \
+        for (int j = 0; j < (RATE)/8; j++) { /* Loop through by LANE */ \
+            store_lane((ctx)->buffer + 8*j, ((uint64_t*)(ctx)->state)[block_lane_index[j]]); \
+        } \
+    } while (0)
+
+/**
+ * Defines the absorbing (prefix_update) and squeezing (prefix_squeeze) functions of a sponge
+ * With a constant rate and suffix this gives a version specialized to one variant, otherwise they can be read from the context
+ * @param prefix the prefix of the names of the functions to define
+ * @param RATE the rate in BYTES
+ * @param SUFFIX the domain suffix byte
+ * @param PERMUTE the permutation of the sponge (keccak_f for SHA-3 and SHAKE, reduced round versions for e.g. KangarooTwelve)
+ */
+#define DEFINE_SPONGE(prefix, RATE, SUFFIX, PERMUTE) \
+/** \
+ * Adds more of the message to a running sponge \
+ * Full blocks are absorbed directly out of msg a lane at a time, a trailing partial block is XOR'ed in byte by byte \
+ * @param ctx (IN/OUT) the context of the sponge, which must not have started squeezing \
+ * @param msg the next piece of the message (may contain any bytes, including 0s) \
+ * @param len the length of msg in BYTES \
+ */ \
+void prefix##_update(keccak_ctx *ctx, const uint8_t *msg, size_t len) { \
+    /* Finish off a block that a previous call started first */ \
+    if (ctx->offset > 0) { \
+        size_t needed = (RATE) - ctx->offset; \
+        size_t taken = (len < needed) ? len : needed; \
+        xor_bytes((uint64_t*)ctx->state, 1, ctx->offset, msg, taken); \
+        ctx->offset += taken; \
+        msg += taken; \
+        len -= taken; \
+        \
+        if (ctx->offset < (size_t)(RATE)) { \
+            return; \
+        } \
+        PERMUTE(ctx->state); \
+        ctx->offset = 0; \
+    } \
+    \
+    /* Absorb each full block, straight from the caller's memory */ \
+    while (len >= (size_t)(RATE)) { \
+        SPONGE_ABSORB_BLOCK(ctx, msg, RATE, PERMUTE); \
+        msg += (RATE); \
+        len -= (RATE); \
+    } \
+    \
+    /* Start the next block with whatever is left, it is permuted once the rest of it arrives (or once it is padded) */ \
+    xor_bytes((uint64_t*)ctx->state, 1, 0, msg, len); \
+    ctx->offset = len; \
+} \
+\
+/** \
+ * Squeezes the next len bytes of output out of a sponge, can be called as many times as needed \
+ * The first call pads and absorbs the last block of the message. After that, the state is only permuted again \
+ * once a whole rate sized block of output has been handed out \
+ * @param ctx (IN/OUT) the context of the sponge, no more of the message can be added once squeezing starts \
+ * @param output (OUTPUT) where the next len bytes of output will be put \
+ * @param len how many bytes of output to squeeze out \
+ */ \
+void prefix##_squeeze(keccak_ctx *ctx, uint8_t *output, size_t len) { \
+    if (!ctx->squeezing) { \
+        /* Pad the message by XOR'ing in SUFFIX || 10*1, where 0* = 0000...0 (the state already holds the 0s) */ \
+        /* The suffix byte includes the first 1 bit, and if the message ends 1 byte short of a block the two 1s share a byte */ \
+        uint8_t padding_start = (SUFFIX); \
+        uint8_t padding_end = 0x80; \
+        xor_bytes((uint64_t*)ctx->state, 1, ctx->offset, &padding_start, 1); \
+        xor_bytes((uint64_t*)ctx->state, 1, (RATE) - 1, &padding_end, 1); \
+        PERMUTE(ctx->state); \
+        SPONGE_SQUEEZE_BLOCK(ctx, RATE); \
+        ctx->offset = 0; \
+        ctx->squeezing = 1; \
+    } \
+    \
+    while (len > 0) { \
+        /* Only once this block of output is used up does the state need to be permuted for the next one */ \
+        if (ctx->offset == (size_t)(RATE)) { \
+            PERMUTE(ctx->state); \
+            SPONGE_SQUEEZE_BLOCK(ctx, RATE); \
+            ctx->offset = 0; \
+        } \
+        size_t available = (RATE) - ctx->offset; \
+        size_t taken = (len < available) ? len : available; \
+        memcpy(output, ctx->buffer + ctx->offset, taken); \
+        ctx->offset += taken; \
+        output += taken; \
+        len -= taken; \
+    } \
+}
+
+DEFINE_SPONGE(keccak, ctx->rate, ctx->suffix, keccak_f)
+DEFINE_SPONGE(sha3, RATE_BITS/8, 0x06, keccak_f)
+
+/**
+ * Starts a new sponge computation for any of the SHA-3 or SHAKE variants
+ * @param ctx (OUTPUT) the context to initialize
+ * @param variant which of the variants to compute
+ */
+void keccak_init(keccak_ctx *ctx, keccak_variant variant) {
+    memset(ctx->state, 0, sizeof(ctx->state));
+    ctx->offset = 0;
+    ctx->squeezing = 0;
+    ctx->rate = keccak_variants[variant].rate;
+    ctx->suffix = keccak_variants[variant].suffix;
+    ctx->output_len = keccak_variants[variant].output_len;
+}
+
+/**
+ * Finishes a SHA-3 hash computation, by squeezing out the digest
+ * @param ctx (IN/OUT) the context of the running hash (not SHAKE), must be re-initialized before being used again
+ * @param digest (OUTPUT) buffer where the digest of the msg will be put, the length depends on the variant (28, 32, 48, or 64 bytes)
+ */
+void keccak_final(keccak_ctx *ctx, uint8_t *digest) {
+    keccak_squeeze(ctx, digest, ctx->output_len);
+}
+
+/**
+ * Computes any of the SHA-3 or SHAKE variants of a message all at once
+ * @param variant which of the variants to compute
+ * @param msg the message (may contain any bytes, including 0s)
+ * @param len the length of msg in BYTES
+ * @param output (OUTPUT) where the output will be put
+ * @param output_len how many bytes of output to produce (for the SHA-3 variants, this should be the digest length)
+ */
+void keccak_hash(keccak_variant variant, const uint8_t *msg, size_t len, uint8_t *output, size_t output_len) {
+    keccak_ctx ctx;
+    keccak_init(&ctx, variant);
+    keccak_update(&ctx, msg, len);
+    keccak_squeeze(&ctx, output, output_len);
+}
+
+/**
+ * Starts a new SHA3-256 hash computation
+ * @param ctx (OUTPUT) the context to initialize
+ */
+void sha3_init(sha3_ctx *ctx) {
+    keccak_init(ctx, SHA3_256);
+}
+
+/**
+ * Finishes a SHA3-256 hash computation, by squeezing out the digest
+ * @param ctx (IN/OUT) the context of the running hash, must be re-initialized before being used again
+ * @param digest (OUTPUT) 256-bit (32-byte) buffer where the digest of the msg will be put
+ */
+void sha3_final(sha3_ctx *ctx, uint8_t *digest) {
+    sha3_squeeze(ctx, digest, OUTPUT_BITS/8);
+}
+
+/**
+ * Performs the SHA3-256 hash function
+ * @param msg the message to calculate the hash of (may contain any bytes, including 0s)
+ * @param len the length of msg in BYTES
+ * @returns the digest of the msg
+ */
+uint8_t* sha3(const uint8_t *msg, size_t len) {
+    sha3_ctx ctx;
+    sha3_init(&ctx);
+    sha3_update(&ctx, msg, len);
+
+    uint8_t *digest = malloc(OUTPUT_BITS/8);
+    sha3_final(&ctx, digest);
+    return digest;
+}
+
+
+/***************************
+*** MULTI-BUFFER HASHING ***
+***************************/
+/*
+ * Many independent messages can be hashed at once by permuting several states together, one state per vector element
+ * The states are interleaved so that lane (x, y) of every state sits side by side: states[(x*5 + y)*LANES + state_num]
+ * (With LANES = 1 this is the same layout as a single uint64_t state[5][5])
+ *
+ * This works for any rate and domain suffix, so it covers both SHA3-256 digests and SHAKE (XOF) output of any length
+ */
+
+/**
+ * Keeps track of which message a state of the multi-buffer permutation is working on, and how far through it the state is
+ */
+typedef struct {
+    size_t msg_index; // Index of the message (and output) this state is working on
+    const uint8_t *msg; // The part of the message that has not been absorbed yet
+    size_t len; // Length of msg in BYTES
+    int squeezing; // Whether the padded final block has been absorbed, and output is now being squeezed out
+    uint8_t *output; // Where the next squeezed bytes go
+    size_t output_len; // How many more bytes need to be squeezed
+} keccak_lane;
+
+/**
+ * XORs the next block of a lane's message into its state, padding the final block with SUFFIX || 10*1
+ * @param lane (IN/OUT) the lane, becomes squeezing once its final block has been absorbed
+ * @param words (IN/OUT) lane (0, 0) of the lane's state, with lane (x, y) at words[(x*5 + y)*stride]
+ * @param stride the distance between lanes of the same state (the number of interleaved states)
+ * @param rate the rate in BYTES
+ * @param suffix the domain suffix byte (0x06 for SHA-3, 0x1F for SHAKE), including the first bit of the padding
+ */
+void keccak_lane_absorb(keccak_lane *lane, uint64_t *words, int stride, int rate, uint8_t suffix) {
+    if (lane->len >= (size_t)rate) {
+        for (int j = 0; j < rate/8; j++) { // Loop through by LANE
+            words[block_lane_index[j]*stride] ^= load_lane(lane->msg + 8*j);
         }
+        lane->msg += rate;
+        lane->len -= rate;
+        return;
+    }
 
-        // Perform the Keccak round function
-        keccak_f(state);
+    // The final block: XOR in what is left of the message and the padding, without copying it into a padded block
+    uint8_t padding_end = 0x80;
+    size_t j = 0;
+    for (; 8*j + 8 <= lane->len; j++) {
+        words[block_lane_index[j]*stride] ^= load_lane(lane->msg + 8*j);
     }
+    xor_bytes(words, stride, 8*j, lane->msg + 8*j, lane->len - 8*j);
+    xor_bytes(words, stride, lane->len, &suffix, 1);
+    xor_bytes(words, stride, rate - 1, &padding_end, 1);
+    lane->len = 0;
+    lane->squeezing = 1;
+}
+
+/**
+ * Copies as much of a lane's output as the rate allows out of its state
+ * @param lane (IN/OUT) the lane, its output is finished once output_len reaches 0
+ * @param words lane (0, 0) of the lane's state, with lane (x, y) at words[(x*5 + y)*stride]
+ * @param stride the distance between lanes of the same state (the number of interleaved states)
+ * @param rate the rate in BYTES
+ */
+void keccak_lane_squeeze(keccak_lane *lane, const uint64_t *words, int stride, int rate) {
+    size_t num_bytes = (lane->output_len < (size_t)rate) ? lane->output_len : (size_t)rate;
+    uint8_t *output = lane->output;
+
+    // Whole lanes first, then whatever part of a lane is left
+    size_t j = 0;
+    for (; 8*j + 8 <= num_bytes; j++) {
+        store_lane(output + 8*j, words[block_lane_index[j]*stride]);
+    }
+    if (8*j < num_bytes) {
+        uint8_t last[8];
+        store_lane(last, words[block_lane_index[j]*stride]);
+        memcpy(output + 8*j, last, num_bytes - 8*j);
+    }
+    lane->output += num_bytes;
+    lane->output_len -= num_bytes;
+}
+
+/**
+ * Starts a lane working on a new message
+ * @param lane (OUTPUT) the lane to set up
+ * @param words (OUTPUT) lane (0, 0) of the lane's state, which is cleared
+ * @param stride the distance between lanes of the same state (the number of interleaved states)
+ * @param msg_index the index of the message (and output)
+ * @param msg the message
+ * @param len the length of msg in BYTES
+ * @param output where the output of the message goes
+ * @param output_len how many bytes of output to squeeze out
+ */
+void keccak_lane_load(keccak_lane *lane, uint64_t *words, int stride, size_t msg_index,
+                      const uint8_t *msg, size_t len, uint8_t *output, size_t output_len) {
+    lane->msg_index = msg_index;
+    lane->msg = msg;
+    lane->len = len;
+    lane->squeezing = 0;
+    lane->output = output;
+    lane->output_len = output_len;
+    for (int i = 0; i < 25; i++) {
+        words[i*stride] = 0;
+    }
+}
 
-    /*** SQUEEZING PHASE ***/
-    uint8_t* output = malloc(OUTPUT_BITS/8);
-    int offset = 0;
-
-    // Squeeze until the desired output length is reached
-    while (offset < OUTPUT_BITS/8) {
-        // Extract output from the RATE component of the state 
-        for (int i = 0; i < RATE_BITS/(8*8); i++) { // Loop through by LANE
-            uint64_t lane = state[i % 5][i / 5];
-
-            // Fill the output up one BYTE at a time so we do not accidentally overflow
-            for (int j = 0; j < 64/8; j++) {
-                output[offset] = (uint8_t)((lane >> 8*j) & 0xFF);
-                offset++;
-                
-                // Once the output is full, return
-                if (offset >= OUTPUT_BITS/8) {
-                    free(padded_msg);
-                    return output;
-                }
-            }
+/**
+ * Finishes a lane on its own with a single state permutation
+ * @param lane (IN/OUT) the lane to finish
+ * @param state (IN/OUT) the lane's state
+ * @param rate the rate in BYTES
+ * @param suffix the domain suffix byte
+ * @param permute the single state permutation (keccak_f for SHA-3 and SHAKE)
+ */
+void keccak_lane_finish(keccak_lane *lane, uint64_t state[5][5], int rate, uint8_t suffix, void (*permute)(uint64_t state[5][5])) {
+    while (!lane->squeezing || lane->output_len > 0) {
+        if (!lane->squeezing) {
+            keccak_lane_absorb(lane, (uint64_t*)state, 1, rate, suffix);
         }
+        permute(state);
+        if (lane->squeezing) {
+            keccak_lane_squeeze(lane, (uint64_t*)state, 1, rate);
+        }
+    }
+}
 
-        // Perform the Keccak round function
-        keccak_f(state);
+#ifdef HAVE_X86_INTRINSICS
+// Vectors of 4 and 8 64-bit lanes, each element holds the same lane of a different state
+typedef uint64_t v4u64 __attribute__((vector_size(32)));
+typedef uint64_t v8u64 __attribute__((vector_size(64)));
+
+/**
+ * Defines a Keccak-p that permutes LANES interleaved states at once
+ * This is the same as keccak_p (and uses the same KECCAK_ROUND), except each variable holds one lane from every state
+ * @param name the name of the function to define
+ * @param LANES the number of states permuted at once
+ * @param vec_t the vector type holding one lane from each state
+ * @param isa the instruction set extension the function is compiled for
+ * @param NUM_ROUNDS the number of rounds (24 for Keccak-f)
+ */
+#define DEFINE_KECCAK_F_LANES(name, LANES, vec_t, isa, NUM_ROUNDS) \
+__attribute__((target(isa))) \
+void name(uint64_t *states) { \
+    vec_t Ca, Ce, Ci, Co, Cu; \
+    vec_t Da, De, Di, Do, Du; \
+    vec_t Bba, Bbe, Bbi, Bbo, Bbu, Bga, Bge, Bgi, Bgo, Bgu, Bka, Bke, Bki, Bko, Bku, Bma, Bme, Bmi, Bmo, Bmu, Bsa, Bse, Bsi, Bso, Bsu; \
+    vec_t Eba, Ebe, Ebi, Ebo, Ebu, Ega, Ege, Egi, Ego, Egu, Eka, Eke, Eki, Eko, Eku, Ema, Eme, Emi, Emo, Emu, Esa, Ese, Esi, Eso, Esu; \
+    vec_t Aba, Abe, Abi, Abo, Abu, Aga, Age, Agi, Ago, Agu, Aka, Ake, Aki, Ako, Aku, Ama, Ame, Ami, Amo, Amu, Asa, Ase, Asi, Aso, Asu; \
+    \
+    /* Load the lanes, complementing the ones that are kept complemented */ \
+    vec_t lanes[25]; \
+    memcpy(lanes, states, sizeof(lanes)); \
+    Aba = lanes[0*5 + 0]; Abe = ~lanes[1*5 + 0]; Abi = ~lanes[2*5 + 0]; Abo = lanes[3*5 + 0]; Abu = lanes[4*5 + 0]; \
+    Aga = lanes[0*5 + 1]; Age = lanes[1*5 + 1]; Agi = lanes[2*5 + 1]; Ago = ~lanes[3*5 + 1]; Agu = lanes[4*5 + 1]; \
+    Aka = lanes[0*5 + 2]; Ake = lanes[1*5 + 2]; Aki = ~lanes[2*5 + 2]; Ako = lanes[3*5 + 2]; Aku = lanes[4*5 + 2]; \
+    Ama = lanes[0*5 + 3]; Ame = lanes[1*5 + 3]; Ami = ~lanes[2*5 + 3]; Amo = lanes[3*5 + 3]; Amu = lanes[4*5 + 3]; \
+    Asa = ~lanes[0*5 + 4]; Ase = lanes[1*5 + 4]; Asi = lanes[2*5 + 4]; Aso = lanes[3*5 + 4]; Asu = lanes[4*5 + 4]; \
+    \
+    for (int i = 24 - (NUM_ROUNDS); i < 24; i += 2) { \
+        KECCAK_ROUND(A, E, i) \
+        KECCAK_ROUND(E, A, i + 1) \
+    } \
+    \
+    /* Store the lanes, undoing the complementing */ \
+    lanes[0*5 + 0] = Aba; lanes[1*5 + 0] = ~Abe; lanes[2*5 + 0] = ~Abi; lanes[3*5 + 0] = Abo; lanes[4*5 + 0] = Abu; \
+    lanes[0*5 + 1] = Aga; lanes[1*5 + 1] = Age; lanes[2*5 + 1] = Agi; lanes[3*5 + 1] = ~Ago; lanes[4*5 + 1] = Agu; \
+    lanes[0*5 + 2] = Aka; lanes[1*5 + 2] = Ake; lanes[2*5 + 2] = ~Aki; lanes[3*5 + 2] = Ako; lanes[4*5 + 2] = Aku; \
+    lanes[0*5 + 3] = Ama; lanes[1*5 + 3] = Ame; lanes[2*5 + 3] = ~Ami; lanes[3*5 + 3] = Amo; lanes[4*5 + 3] = Amu; \
+    lanes[0*5 + 4] = ~Asa; lanes[1*5 + 4] = Ase; lanes[2*5 + 4] = Asi; lanes[3*5 + 4] = Aso; lanes[4*5 + 4] = Asu; \
+    memcpy(states, lanes, sizeof(lanes)); \
+}
+
+DEFINE_KECCAK_F_LANES(keccak_f_x4_avx2, 4, v4u64, "avx2", 24)
+DEFINE_KECCAK_F_LANES(keccak_f_x8_avx512, 8, v8u64, "avx512f", 24)
+
+/**
+ * The state of a batch of messages being run through the sponge
+ */
+typedef struct {
+    const uint8_t **msgs;
+    const size_t *lens;
+    int rate; // The rate in BYTES
+    uint8_t suffix; // The domain suffix byte
+    uint8_t *outputs; // output_len bytes of output for each message, one after another
+    size_t output_len;
+    int num_lanes;
+    void (*permute_lanes)(uint64_t *states);
+    void (*permute)(uint64_t state[5][5]);
+    keccak_lane lanes[8];
+    uint64_t states[25*8]; // The interleaved states, lane (x, y) of each state is at states[(x*5 + y)*num_lanes + lane]
+} keccak_batch_state;
+
+/**
+ * Starts a lane working on a new message, clearing its state
+ * @param arg the keccak_batch_state
+ * @param lane the lane to load
+ * @param msg_index the index of the message (and output)
+ */
+void keccak_batch_load(void *arg, int lane, size_t msg_index) {
+    keccak_batch_state *batch = arg;
+    keccak_lane_load(&batch->lanes[lane], &batch->states[lane], batch->num_lanes, msg_index, batch->msgs[msg_index],
+                     batch->lens[msg_index], batch->outputs + msg_index*batch->output_len, batch->output_len);
+}
+
+/**
+ * Absorbs the next block of every active lane that is not squeezing yet, and permutes every state (idle lanes are permuted too, but never read)
+ * @param arg the keccak_batch_state
+ * @param active whether each lane has a message
+ */
+void keccak_batch_step(void *arg, const int *active) {
+    keccak_batch_state *batch = arg;
+    for (int lane = 0; lane < batch->num_lanes; lane++) {
+        if (active[lane] && !batch->lanes[lane].squeezing) {
+            keccak_lane_absorb(&batch->lanes[lane], &batch->states[lane], batch->num_lanes, batch->rate, batch->suffix);
+        }
+    }
+    batch->permute_lanes(batch->states);
+}
+
+/**
+ * Squeezes out the output of a lane once it has absorbed all of its message
+ * @param arg the keccak_batch_state
+ * @param lane the lane
+ * @returns 1 if all of the lane's output has been squeezed out, otherwise 0
+ */
+int keccak_batch_done(void *arg, int lane) {
+    keccak_batch_state *batch = arg;
+    keccak_lane *l = &batch->lanes[lane];
+    if (!l->squeezing) {
+        return 0;
+    }
+    keccak_lane_squeeze(l, &batch->states[lane], batch->num_lanes, batch->rate);
+    return l->output_len == 0;
+}
+
+/**
+ * Finishes a lane on its own with the single state permutation
+ * @param arg the keccak_batch_state
+ * @param lane the lane to finish
+ */
+void keccak_batch_finish(void *arg, int lane) {
+    keccak_batch_state *batch = arg;
+    uint64_t state[5][5];
+    for (int i = 0; i < 25; i++) {
+        ((uint64_t*)state)[i] = batch->states[i*batch->num_lanes + lane];
+    }
+    keccak_lane_finish(&batch->lanes[lane], state, batch->rate, batch->suffix, batch->permute);
+}
+
+const lane_ops keccak_lane_ops = {keccak_batch_load, keccak_batch_step, keccak_batch_done, keccak_batch_finish};
+
+/**
+ * Runs the sponge over many independent messages, by running permute_lanes over num_lanes interleaved states at once
+ * @param msgs the messages to absorb
+ * @param lens the length of each message in BYTES
+ * @param num_msgs the number of messages
+ * @param rate the rate in BYTES
+ * @param suffix the domain suffix byte
+ * @param outputs (OUTPUT) output_len bytes of output for each message, one after another
+ * @param output_len how many bytes of output to squeeze out for each message
+ * @param num_lanes the number of states permute_lanes works on at once (at most 8)
+ * @param permute_lanes the multi-buffer Keccak-f to use
+ * @param permute the single state version of permute_lanes, used for the last few messages
+ */
+void keccak_batch_lanes(const uint8_t **msgs, const size_t *lens, size_t num_msgs, int rate, uint8_t suffix,
+                        uint8_t *outputs, size_t output_len, int num_lanes, void (*permute_lanes)(uint64_t *states),
+                        void (*permute)(uint64_t state[5][5])) {
+    keccak_batch_state batch = {
+        .msgs = msgs,
+        .lens = lens,
+        .rate = rate,
+        .suffix = suffix,
+        .outputs = outputs,
+        .output_len = output_len,
+        .num_lanes = num_lanes,
+        .permute_lanes = permute_lanes,
+        .permute = permute
+    };
+    lanes_run(&batch, &keccak_lane_ops, num_lanes, num_msgs);
+}
+
+/**
+ * Picks the widest multi-buffer Keccak-f the processor supports
+ * @param permute_lanes (OUTPUT) the multi-buffer Keccak-f to use
+ * @returns the number of states permute_lanes works on, or 1 if multi-buffer hashing should not be used
+ */
+int select_keccak_f_lanes(void (**permute_lanes)(uint64_t *states)) {
+    int num_lanes = cpu_avx_lanes(8, 4);
+    *permute_lanes = (num_lanes == 8) ? keccak_f_x8_avx512 : keccak_f_x4_avx2;
+    return num_lanes;
+}
+#endif
+
+/**
+ * Runs the sponge over many independent messages at once
+ * Uses 8 states at once with AVX-512 or 4 with AVX2 when the processor has them, otherwise does the messages one after another
+ * @param msgs the messages to absorb (may contain any bytes, including 0s)
+ * @param lens the length of each message in BYTES
+ * @param num_msgs the number of messages
+ * @param rate the rate in BYTES
+ * @param suffix the domain suffix byte
+ * @param outputs (OUTPUT) output_len bytes of output for each message, one after another
+ * @param output_len how many bytes of output to squeeze out for each message
+ */
+void keccak_batch(const uint8_t **msgs, const size_t *lens, size_t num_msgs, int rate, uint8_t suffix,
+                  uint8_t *outputs, size_t output_len) {
+#ifdef HAVE_X86_INTRINSICS
+    void (*permute_lanes)(uint64_t *states);
+    int num_lanes = select_keccak_f_lanes(&permute_lanes);
+    if (num_lanes > 1) {
+        keccak_batch_lanes(msgs, lens, num_msgs, rate, suffix, outputs, output_len, num_lanes, permute_lanes, keccak_f);
+        return;
+    }
+#endif
+
+    for (size_t i = 0; i < num_msgs; i++) {
+        keccak_lane lane;
+        uint64_t state[5][5];
+        keccak_lane_load(&lane, (uint64_t*)state, 1, i, msgs[i], lens[i], outputs + i*output_len, output_len);
+        keccak_lane_finish(&lane, state, rate, suffix, keccak_f);
     }
 }
 
+/**
+ * Performs the SHA3-256 hash function on many independent messages at once
+ * @param msgs the messages to calculate the hash of (may contain any bytes, including 0s)
+ * @param lens the length of each message in BYTES
+ * @param num_msgs the number of messages
+ * @param digests (OUTPUT) the 256-bit digest of each message
+ */
+void sha3_batch(const uint8_t **msgs, const size_t *lens, size_t num_msgs, uint8_t (*digests)[OUTPUT_BITS/8]) {
+    keccak_batch(msgs, lens, num_msgs, RATE_BITS/8, 0x06, &digests[0][0], OUTPUT_BITS/8);
+}
+
+/**
+ * Performs the SHAKE128 extendable-output function on many independent inputs at once (e.g. expanding many seeds)
+ * @param msgs the inputs (may contain any bytes, including 0s)
+ * @param lens the length of each input in BYTES
+ * @param num_msgs the number of inputs
+ * @param outputs (OUTPUT) output_len bytes of output for each input, one after another
+ * @param output_len how many bytes of output to produce for each input (any length)
+ */
+void shake128_batch(const uint8_t **msgs, const size_t *lens, size_t num_msgs, uint8_t *outputs, size_t output_len) {
+    keccak_batch(msgs, lens, num_msgs, keccak_variants[SHAKE128].rate, keccak_variants[SHAKE128].suffix, outputs, output_len);
+}
+
+/**
+ * Performs the SHAKE256 extendable-output function on many independent inputs at once
+ * @param msgs the inputs (may contain any bytes, including 0s)
+ * @param lens the length of each input in BYTES
+ * @param num_msgs the number of inputs
+ * @param outputs (OUTPUT) output_len bytes of output for each input, one after another
+ * @param output_len how many bytes of output to produce for each input (any length)
+ */
+void shake256_batch(const uint8_t **msgs, const size_t *lens, size_t num_msgs, uint8_t *outputs, size_t output_len) {
+    keccak_batch(msgs, lens, num_msgs, keccak_variants[SHAKE256].rate, keccak_variants[SHAKE256].suffix, outputs, output_len);
+}
 
 
 /**************
 *** TESTING ***
 **************/
+/**
+ * Measures how many Keccak-f permutations can be performed per second
+ * @param name the name to print the result under
+ * @param permute the Keccak-f implementation to time
+ * @param num_permutations how many permutations to time in each run
+ */
+void benchmark_keccak_f(const char *name, void (*permute)(uint64_t[5][5]), int num_permutations) {
+    uint64_t state[5][5] = {0};
+
+    // Take the best of several runs so that interruptions do not skew the results
+    double best = 0;
+    for (int run = 0; run < 5; run++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < num_permutations; i++) {
+            permute(state);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        best = (num_permutations / seconds > best) ? num_permutations / seconds : best;
+    }
+
+    printf("%-20s %12.0f permutations/second\n", name, best);
+}
+
 // Test examples: https://csrc.nist.gov/projects/cryptographic-standards-and-guidelines/example-values#aHashing
-int main() {    
+int main(int argc, char **argv) {    
+    // Compare the speed of keccak_f with and without tracing when run as "./sha3 benchmark"
+    if (argc > 1 && strcmp(argv[1], "benchmark") == 0) {
+#ifndef NDEBUG
+        // The trace is written to /dev/null, so this only counts the cost of formatting it, not of a terminal displaying it
+        FILE *null_file = fopen("/dev/null", "w");
+        if (null_file != NULL) {
+            keccak_trace = print_keccak_trace;
+            keccak_trace_arg = null_file;
+            benchmark_keccak_f("keccak_f (traced)", keccak_f, 2000);
+            keccak_trace = NULL;
+            keccak_trace_arg = NULL;
+            fclose(null_file);
+        }
+#endif
+        benchmark_keccak_f("keccak_f_reference", keccak_f_reference, 200000);
+        benchmark_keccak_f("keccak_f", keccak_f, 2000000);
+        return 0;
+    }
+
+#ifndef NDEBUG
+    // Print the state after every step of every permutation when run as "./sha3 trace"
+    if (argc > 1 && strcmp(argv[1], "trace") == 0) {
+        keccak_trace = print_keccak_trace;
+    }
+#endif
+
     // Set test variables for the cipher
     uint8_t msg[] = "abc";
     printf("message = %s\n", msg);
 
-    uint8_t *digest = sha3(msg);
+    uint8_t *digest = sha3(msg, strlen(msg));
     printf("digest = %s\n", digest);
     printf("       = ");
     for (int i = 0; i < OUTPUT_BITS/8; i++) {
@@ -342,6 +1129,124 @@ int main() {
     }
     printf("\n");
 
+    // Sanity check the streaming interface gives the same digest when fed one byte at a time
+    sha3_ctx ctx;
+    uint8_t streamed_digest[OUTPUT_BITS/8];
+    sha3_init(&ctx);
+    for (size_t i = 0; i < strlen(msg); i++) {
+        sha3_update(&ctx, &msg[i], 1);
+    }
+    sha3_final(&ctx, streamed_digest);
+    if (memcmp(digest, streamed_digest, OUTPUT_BITS/8) != 0) {
+        printf("ERROR: Streamed digest and one-shot digest are NOT the same!\n");
+    }
+
+    // Sanity check the batch interface with messages whose lengths fall on either side of the 136-byte rate,
+    // against hashing each one by itself and against the NIST example for 200 bytes of 0xA3
+    uint8_t batch_data[3*136];
+    memset(batch_data, 0xA3, sizeof(batch_data));
+    size_t batch_lens[16] = {0, 1, 8, 64, 127, 128, 135, 136, 137, 143, 200, 271, 272, 273, 300, 3*136};
+    const uint8_t *batch_msgs[16];
+    uint8_t batch_digests[16][OUTPUT_BITS/8];
+    for (int i = 0; i < 16; i++) {
+        batch_msgs[i] = batch_data;
+    }
+    sha3_batch(batch_msgs, batch_lens, 16, batch_digests);
+    for (int i = 0; i < 16; i++) {
+        sha3_init(&ctx);
+        sha3_update(&ctx, batch_msgs[i], batch_lens[i]);
+        sha3_final(&ctx, streamed_digest);
+        if (memcmp(batch_digests[i], streamed_digest, OUTPUT_BITS/8) != 0) {
+            printf("ERROR: Batch digest of a %zu-byte message and one-shot digest are NOT the same!\n", batch_lens[i]);
+        }
+    }
+    uint8_t nist_a3_digest[OUTPUT_BITS/8] = {
+        0x79, 0xf3, 0x8a, 0xde, 0xc5, 0xc2, 0x03, 0x07, 0xa9, 0x8e, 0xf7, 0x6e, 0x83, 0x24, 0xaf, 0xbf,
+        0xd4, 0x6c, 0xfd, 0x81, 0xb2, 0x2e, 0x39, 0x73, 0xc6, 0x5f, 0xa1, 0xbd, 0x9d, 0xe3, 0x17, 0x87
+    };
+    if (memcmp(batch_digests[10], nist_a3_digest, OUTPUT_BITS/8) != 0) {
+        printf("ERROR: Batch digest of 200 bytes of 0xA3 does NOT match the NIST example!\n");
+    }
+
+    // Sanity check batch SHAKE128 output that is longer than the 168-byte rate, with messages of different lengths
+    // (more than 8 of them, so the 8-lane permutation is used), against the full known output for an empty input
+    // and against running SHAKE128 on each message by itself
+    const char *shake_empty_expected =
+        "7f9c2ba4e88f827d616045507605853ed73b8093f6efbc88eb1a6eacfa66ef263cb1eea988004b93103cfb0aeefd2a686e01"
+        "fa4a58e8a3639ca8a1e3f9ae57e235b8cc873c23dc62b8d260169afa2f75ab916a58d974918835d25e6a435085b2badfd6df"
+        "aac359a5efbb7bcc4b59d538df9a04302e10c8bc1cbf1a0b3a5120ea17cda7cfad765f5623474d368ccca8af0007cd9f5e4c"
+        "849f167a580b14aabdefaee7eef47cb0fca9767be1fda69419dfb927e9df07348b196691abaeb580b32def58538b8d23f877";
+    size_t shake_lens[10] = {0, 1, 100, 167, 168, 169, 200, 335, 336, 337};
+    const uint8_t *shake_msgs[10];
+    uint8_t shake_outputs[10][200];
+    for (int i = 0; i < 10; i++) {
+        shake_msgs[i] = batch_data;
+    }
+    shake128_batch(shake_msgs, shake_lens, 10, &shake_outputs[0][0], 200);
+    char shake_hex[2*200 + 1];
+    for (int i = 0; i < 200; i++) {
+        sprintf(&shake_hex[2*i], "%02x", shake_outputs[0][i]);
+    }
+    if (strcmp(shake_hex, shake_empty_expected) != 0) {
+        printf("ERROR: Batch SHAKE128 output for an empty input does NOT match the known output!\n");
+    }
+    for (int i = 0; i < 10; i++) {
+        uint8_t shake_single[200];
+        keccak_hash(SHAKE128, shake_msgs[i], shake_lens[i], shake_single, 200);
+        if (memcmp(shake_outputs[i], shake_single, 200) != 0) {
+            printf("ERROR: Batch SHAKE128 output of a %zu-byte input and one-shot output are NOT the same!\n", shake_lens[i]);
+        }
+    }
+
+    // Sanity check the other SHA-3 variants against the NIST examples for "abc"
+    const char *variant_names[3] = {"SHA3-224", "SHA3-384", "SHA3-512"};
+    keccak_variant variants[3] = {SHA3_224, SHA3_384, SHA3_512};
+    const char *variant_expected[3] = {
+        "e642824c3f8cf24ad09234ee7d3c766fc9a3a5168d0c94ad73b46fdf",
+        "ec01498288516fc926459f58e2c6ad8df9b473cb0fc08c2596da7cf0e49be4b298d88cea927ac7f539f1edf228376d25",
+        "b751850b1a57168a5693cd924b6b096e08f621827444f70d884f5d0240d2712e10e116e9192af3c91a7ec57647e3934057340b4cf408d5a56592f8274eec53f0"
+    };
+    for (int v = 0; v < 3; v++) {
+        uint8_t variant_digest[512/8];
+        char variant_hex[2*512/8 + 1];
+        keccak_hash(variants[v], msg, strlen(msg), variant_digest, keccak_variants[variants[v]].output_len);
+        for (int i = 0; i < keccak_variants[variants[v]].output_len; i++) {
+            sprintf(&variant_hex[2*i], "%02x", variant_digest[i]);
+        }
+        if (strcmp(variant_hex, variant_expected[v]) != 0) {
+            printf("ERROR: %s digest is NOT correct!\n", variant_names[v]);
+        }
+    }
+
+    // Sanity check squeezing SHAKE output a few bytes at a time gives the same output as squeezing it all at once
+    uint8_t squeezed[3*136];
+    uint8_t squeezed_at_once[3*136];
+    keccak_ctx shake_ctx;
+    keccak_init(&shake_ctx, SHAKE256);
+    keccak_update(&shake_ctx, msg, strlen(msg));
+    for (size_t offset = 0, piece = 1; offset < sizeof(squeezed); offset += piece, piece = piece*2 + 1) {
+        keccak_squeeze(&shake_ctx, &squeezed[offset], (offset + piece < sizeof(squeezed)) ? piece : sizeof(squeezed) - offset);
+    }
+    keccak_hash(SHAKE256, msg, strlen(msg), squeezed_at_once, sizeof(squeezed_at_once));
+    if (memcmp(squeezed, squeezed_at_once, sizeof(squeezed)) != 0) {
+        printf("ERROR: SHAKE256 output squeezed in pieces and squeezed all at once are NOT the same!\n");
+    }
+
+    // Sanity check the optimized Keccak-f against the reference, on a state with every lane different
+    uint64_t state[5][5];
+    uint64_t reference_state[5][5];
+    for (int i = 0; i < 25; i++) {
+        state[i % 5][i / 5] = 0x0123456789ABCDEF * (i + 1);
+    }
+    memcpy(reference_state, state, sizeof(state));
+    for (int i = 0; i < 10; i++) {
+        keccak_f(state);
+        keccak_f_reference(reference_state);
+    }
+    if (memcmp(state, reference_state, sizeof(state)) != 0) {
+        printf("ERROR: Optimized keccak_f and keccak_f_reference are NOT the same!\n");
+    }
+
     free(digest);
     return 0;
 }
\ No newline at end of file
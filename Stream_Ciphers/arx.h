@@ -0,0 +1,454 @@
+#ifndef ARX_H
+#define ARX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define HAVE_X86_INTRINSICS
+#endif
+
+
+/**
+ * The add-rotate-XOR (ARX) core shared by ChaCha and Salsa20
+ * Both ciphers mix the same 4x4 state of 32-bit words with quarter-rounds made of only additions, rotations, and XORs,
+ * they just arrange the words and the quarter-round differently, and both come in 8, 12, and 20 round versions
+ * Every (cipher, number of rounds) pair gets its own fully unrolled functions, so the number of rounds costs nothing at run time,
+ * and arx_select picks between them at run time (so e.g. ChaCha12 and ChaCha20 can both be used by the same program)
+ */
+
+
+#ifndef KEY_SIZE_BITS
+#define KEY_SIZE_BITS 256 // Can be 256 or 128
+#endif
+
+
+/****************
+*** CONSTANTS ***
+****************/
+// Nothing-up-my-sleve numbers to protect against 0s in the key or nonce, the ASCII strings read as 4 LITTLE ENDIAN words
+const uint32_t ARX_SIGMA[4] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574}; // "expand 32-byte k", for 256-bit keys
+const uint32_t ARX_TAU[4] = {0x61707865, 0x3120646e, 0x79622d36, 0x6b206574}; // "expand 16-byte k", for 128-bit keys
+
+#define CHACHA_COUNTER 12 // The lower 32 bits of the ChaCha block counter/position are in state[12], the upper bits in state[13]
+#define SALSA_COUNTER 8 // The lower 32 bits of the Salsa20 block counter/position are in state[8], the upper bits in state[9]
+
+
+/**********************
+*** ROUND FUNCTIONS ***
+**********************/
+/*
+ * These are macros rather than functions so that the same code works on single words and on vectors of words
+ * (where each element of a vector is the same word from a different block, see DEFINE_ARX_BLOCKS)
+ */
+
+// Rotation to the left (ROTL), which wraps the bits shifted off the top back around to the bottom
+#define ROTL(value, shift) (((value) << (shift)) | ((value) >> (32 - (shift))))
+
+// ChaCha Quarter-Round (QR), applied to a single column/diagonal of the state
+#define CHACHA_QR(a, b, c, d) \
+    a += b; d = ROTL(d ^ a, 16); \
+    c += d; b = ROTL(b ^ c, 12); \
+    a += b; d = ROTL(d ^ a, 8); \
+    c += d; b = ROTL(b ^ c, 7);
+
+// Salsa20 Quarter-Round (QR), applied to a single column/row of the state
+#define SALSA_QR(a, b, c, d) \
+    b ^= ROTL(a + d, 7); \
+    c ^= ROTL(b + a, 9); \
+    d ^= ROTL(c + b, 13); \
+    a ^= ROTL(d + c, 18);
+
+// ChaCha double round: the first (odd) round is on the columns, the second (even) round is on the diagonals
+#define CHACHA_DOUBLE_ROUND(x) \
+    CHACHA_QR(x[0], x[4], x[8],  x[12]) \
+    CHACHA_QR(x[1], x[5], x[9],  x[13]) \
+    CHACHA_QR(x[2], x[6], x[10], x[14]) \
+    CHACHA_QR(x[3], x[7], x[11], x[15]) \
+    CHACHA_QR(x[0], x[5], x[10], x[15]) \
+    CHACHA_QR(x[1], x[6], x[11], x[12]) \
+    CHACHA_QR(x[2], x[7], x[8],  x[13]) \
+    CHACHA_QR(x[3], x[4], x[9],  x[14])
+
+// Salsa20 double round: the first (odd) round is on the columns, the second (even) round is on the rows
+#define SALSA_DOUBLE_ROUND(x) \
+    SALSA_QR(x[0],  x[4],  x[8],  x[12]) \
+    SALSA_QR(x[5],  x[9],  x[13], x[1]) \
+    SALSA_QR(x[10], x[14], x[2],  x[6]) \
+    SALSA_QR(x[15], x[3],  x[7],  x[11]) \
+    SALSA_QR(x[0],  x[1],  x[2],  x[3]) \
+    SALSA_QR(x[5],  x[6],  x[7],  x[4]) \
+    SALSA_QR(x[10], x[11], x[8],  x[9]) \
+    SALSA_QR(x[15], x[12], x[13], x[14])
+
+// All the rounds, written out in full (ROUNDS must be 8, 12, or 20)
+#define ARX_ROUNDS(DOUBLE_ROUND, x, ROUNDS) ARX_ROUNDS_##ROUNDS(DOUBLE_ROUND, x)
+#define ARX_ROUNDS_8(DOUBLE_ROUND, x) DOUBLE_ROUND(x) DOUBLE_ROUND(x) DOUBLE_ROUND(x) DOUBLE_ROUND(x)
+#define ARX_ROUNDS_12(DOUBLE_ROUND, x) ARX_ROUNDS_8(DOUBLE_ROUND, x) DOUBLE_ROUND(x) DOUBLE_ROUND(x)
+#define ARX_ROUNDS_20(DOUBLE_ROUND, x) ARX_ROUNDS_12(DOUBLE_ROUND, x) ARX_ROUNDS_8(DOUBLE_ROUND, x)
+
+
+/****************************
+*** MULTI-BLOCK KEYSTREAM ***
+****************************/
+/*
+ * Every block of keystream only depends on the key, nonce, and its own position, so many blocks can be computed at once
+ * The blocks are laid out "vertically": each variable is a vector holding the same state word from LANES consecutive blocks,
+ * so each QR works on LANES blocks at once, with exactly the same code as for one block (only the counters differ)
+ * (Unlike laying out one block's rows in 4 vectors, this needs no shuffles to line up the diagonals between rounds)
+ */
+#ifdef HAVE_X86_INTRINSICS
+#define TARGET(isa) __attribute__((target(isa)))
+
+/**
+ * Checks (via CPUID) whether the processor supports AVX2 or AVX-512, and whether the OS saves the vector registers they use
+ * @param want_avx512 1 to check for AVX-512 (foundation), 0 to check for AVX2
+ * @returns 1 if the requested instructions can be used, otherwise 0
+ */
+int cpu_has_avx(int want_avx512) {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE) || !(ecx & bit_AVX)) {
+        return 0;
+    }
+
+    // The OS must be saving the wider registers on context switches (XMM/YMM, plus the opmask/ZMM state for AVX-512)
+    unsigned int xcr0_lo, xcr0_hi;
+    __asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    unsigned int needed = want_avx512 ? 0xE6 : 0x06;
+    if ((xcr0_lo & needed) != needed) {
+        return 0;
+    }
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    return want_avx512 ? ((ebx & bit_AVX512F) ? 1 : 0) : ((ebx & bit_AVX2) ? 1 : 0);
+}
+#else
+#define TARGET(isa) // The generic vectors are compiled for whatever SIMD the target has (e.g. NEON)
+#endif
+
+// Vectors of 4, 8, and 16 32-bit words, each element holds the same state word of a different block
+typedef uint32_t v4u32 __attribute__((vector_size(16)));
+typedef uint32_t v8u32 __attribute__((vector_size(32)));
+typedef uint32_t v16u32 __attribute__((vector_size(64)));
+
+/**
+ * Defines a function that runs every round on a single state (without adding the original state back in)
+ * @param name the name of the function to define
+ * @param DOUBLE_ROUND CHACHA_DOUBLE_ROUND or SALSA_DOUBLE_ROUND
+ * @param ROUNDS the number of rounds (8, 12, or 20)
+ */
+#define DEFINE_ARX_PERMUTE(name, DOUBLE_ROUND, ROUNDS) \
+void name(uint32_t *x) { \
+    uint32_t w[16]; \
+    memcpy(w, x, sizeof(w)); /* Local copies, so the compiler can keep every word in a register */ \
+    ARX_ROUNDS(DOUBLE_ROUND, w, ROUNDS) \
+    memcpy(x, w, sizeof(w)); \
+}
+
+/**
+ * Defines a function that applies LANES consecutive blocks of keystream to the input, starting at the state's position
+ * This is the same as a single block (followed by the XOR with the input), except each variable holds a word from every block
+ * The state is not changed, the caller moves the position forward by LANES afterwards
+ * @param name the name of the function to define
+ * @param LANES the number of blocks computed at once
+ * @param vec_t the vector type holding one word from each block
+ * @param isa the instruction set extension the function is compiled for
+ * @param DOUBLE_ROUND CHACHA_DOUBLE_ROUND or SALSA_DOUBLE_ROUND
+ * @param ROUNDS the number of rounds (8, 12, or 20)
+ * @param COUNTER the index of the lower word of the block counter (CHACHA_COUNTER or SALSA_COUNTER)
+ */
+#define DEFINE_ARX_BLOCKS(name, LANES, vec_t, isa, DOUBLE_ROUND, ROUNDS, COUNTER) \
+TARGET(isa) \
+void name(const uint32_t *state, const uint8_t *input, uint8_t *output) { \
+    vec_t x[16], original[16]; \
+    for (int i = 0; i < 16; i++) { \
+        original[i] = (vec_t){0} + state[i]; /* Every block starts with the same state... */ \
+    } \
+    \
+    /* ...except for the position, block i of the batch is at position + i (carrying into the upper 32 bits) */ \
+    uint32_t lane_offsets[LANES]; \
+    vec_t offsets; \
+    for (int lane = 0; lane < LANES; lane++) { \
+        lane_offsets[lane] = lane; \
+    } \
+    memcpy(&offsets, lane_offsets, sizeof(offsets)); \
+    original[COUNTER] += offsets; \
+    original[COUNTER + 1] -= (vec_t)(original[COUNTER] < state[COUNTER]); /* A true comparison is all 1s (-1), so this adds the carry */ \
+    \
+    /* Perform the actual rounds on every block at once */ \
+    for (int i = 0; i < 16; i++) { \
+        x[i] = original[i]; \
+    } \
+    ARX_ROUNDS(DOUBLE_ROUND, x, ROUNDS) \
+    \
+    /* Add the original state back in, and transpose so each block's keystream is contiguous */ \
+    uint32_t words[16][LANES]; \
+    for (int i = 0; i < 16; i++) { \
+        x[i] += original[i]; \
+        memcpy(words[i], &x[i], sizeof(vec_t)); \
+    } \
+    \
+    /* XOR each block's keystream into the input a whole vector at a time */ \
+    for (int lane = 0; lane < LANES; lane++) { \
+        uint32_t keystream[16]; \
+        for (int i = 0; i < 16; i++) { \
+            keystream[i] = words[i][lane]; \
+        } \
+        for (int j = 0; j < 64; j += sizeof(vec_t)) { \
+            vec_t in, ks; \
+            memcpy(&in, input + 64*lane + j, sizeof(vec_t)); \
+            memcpy(&ks, (uint8_t*)keystream + j, sizeof(vec_t)); \
+            in ^= ks; \
+            memcpy(output + 64*lane + j, &in, sizeof(vec_t)); \
+        } \
+    } \
+}
+
+
+/****************
+*** ARX CORES ***
+****************/
+typedef enum {
+    ARX_CHACHA,
+    ARX_SALSA
+} arx_variant;
+
+typedef void (*arx_blocks_fn)(const uint32_t *state, const uint8_t *input, uint8_t *output);
+
+/**
+ * The functions for one cipher at one number of rounds
+ */
+typedef struct {
+    arx_variant variant;
+    int num_rounds;
+    int counter; // The index of the lower word of the block counter
+    void (*permute)(uint32_t *x); // Every round on one state, without adding the original state back in
+    arx_blocks_fn blocks_x4; // 4 blocks (SSE2, or the generic vectors elsewhere)
+    arx_blocks_fn blocks_x8; // 8 blocks (AVX2), NULL if it was not compiled in
+    arx_blocks_fn blocks_x16; // 16 blocks (AVX-512), NULL if it was not compiled in
+} arx_core;
+
+// The wider kernels only exist on x86, where the instruction set can be picked per function
+#ifdef HAVE_X86_INTRINSICS
+#define DEFINE_ARX_WIDE_BLOCKS(prefix, DOUBLE_ROUND, ROUNDS, COUNTER) \
+    DEFINE_ARX_BLOCKS(prefix##_blocks_x8_avx2, 8, v8u32, "avx2", DOUBLE_ROUND, ROUNDS, COUNTER) \
+    DEFINE_ARX_BLOCKS(prefix##_blocks_x16_avx512, 16, v16u32, "avx512f", DOUBLE_ROUND, ROUNDS, COUNTER)
+#define ARX_WIDE_BLOCKS(prefix) prefix##_blocks_x8_avx2, prefix##_blocks_x16_avx512
+#else
+#define DEFINE_ARX_WIDE_BLOCKS(prefix, DOUBLE_ROUND, ROUNDS, COUNTER)
+#define ARX_WIDE_BLOCKS(prefix) NULL, NULL
+#endif
+
+/**
+ * Defines every function for one cipher at one number of rounds, and the arx_core (named prefix_core) that holds them
+ * @param prefix the start of the names of the functions (e.g. chacha20)
+ * @param variant ARX_CHACHA or ARX_SALSA
+ * @param DOUBLE_ROUND CHACHA_DOUBLE_ROUND or SALSA_DOUBLE_ROUND
+ * @param ROUNDS the number of rounds (8, 12, or 20)
+ * @param COUNTER the index of the lower word of the block counter (CHACHA_COUNTER or SALSA_COUNTER)
+ */
+#define DEFINE_ARX_CORE(prefix, variant, DOUBLE_ROUND, ROUNDS, COUNTER) \
+    DEFINE_ARX_PERMUTE(prefix##_permute, DOUBLE_ROUND, ROUNDS) \
+    DEFINE_ARX_BLOCKS(prefix##_blocks_x4, 4, v4u32, "sse2", DOUBLE_ROUND, ROUNDS, COUNTER) \
+    DEFINE_ARX_WIDE_BLOCKS(prefix, DOUBLE_ROUND, ROUNDS, COUNTER) \
+    const arx_core prefix##_core = {variant, ROUNDS, COUNTER, prefix##_permute, prefix##_blocks_x4, ARX_WIDE_BLOCKS(prefix)};
+
+DEFINE_ARX_CORE(chacha8, ARX_CHACHA, CHACHA_DOUBLE_ROUND, 8, CHACHA_COUNTER)
+DEFINE_ARX_CORE(chacha12, ARX_CHACHA, CHACHA_DOUBLE_ROUND, 12, CHACHA_COUNTER)
+DEFINE_ARX_CORE(chacha20, ARX_CHACHA, CHACHA_DOUBLE_ROUND, 20, CHACHA_COUNTER)
+DEFINE_ARX_CORE(salsa8, ARX_SALSA, SALSA_DOUBLE_ROUND, 8, SALSA_COUNTER)
+DEFINE_ARX_CORE(salsa12, ARX_SALSA, SALSA_DOUBLE_ROUND, 12, SALSA_COUNTER)
+DEFINE_ARX_CORE(salsa20, ARX_SALSA, SALSA_DOUBLE_ROUND, 20, SALSA_COUNTER)
+
+/**
+ * Finds the functions for a cipher at a number of rounds
+ * @param variant ARX_CHACHA or ARX_SALSA
+ * @param num_rounds the number of rounds (8, 12, or 20)
+ * @returns the core, or NULL if there is none for that number of rounds
+ */
+const arx_core* arx_select(arx_variant variant, int num_rounds) {
+    switch (num_rounds) {
+        case 8:  return (variant == ARX_CHACHA) ? &chacha8_core : &salsa8_core;
+        case 12: return (variant == ARX_CHACHA) ? &chacha12_core : &salsa12_core;
+        case 20: return (variant == ARX_CHACHA) ? &chacha20_core : &salsa20_core;
+        default: return NULL;
+    }
+}
+
+/**
+ * Picks the widest multi-block function the processor supports (checked once via CPUID)
+ * @param core the cipher and number of rounds
+ * @param apply_blocks (OUTPUT) the multi-block function to use
+ * @returns the number of blocks apply_blocks works on at once
+ */
+int arx_widest_blocks(const arx_core *core, arx_blocks_fn *apply_blocks) {
+    static atomic_int cached_num_lanes = -1; // -1 until the CPU has been checked (atomic, since the first checks can come from several threads at once)
+    int num_lanes = atomic_load(&cached_num_lanes);
+    if (num_lanes < 0) {
+#ifdef HAVE_X86_INTRINSICS
+        unsigned int eax, ebx, ecx, edx;
+        int has_sse2 = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (edx & bit_SSE2);
+        num_lanes = cpu_has_avx(1) ? 16 : (cpu_has_avx(0) ? 8 : (has_sse2 ? 4 : 1));
+#else
+        num_lanes = 4;
+#endif
+        atomic_store(&cached_num_lanes, num_lanes);
+    }
+    *apply_blocks = (num_lanes == 16) ? core->blocks_x16 : ((num_lanes == 8) ? core->blocks_x8 : core->blocks_x4);
+    return num_lanes;
+}
+
+
+/**************************
+*** KEYSTREAM FUNCTIONS ***
+**************************/
+/**
+ * Gets the keystream for a given block
+ * A "block" is another name for the 4x4 state matrix (which is shaped like a block)
+ * @param core the cipher and number of rounds
+ * @param state the internal state of the cipher, should already be initialized with the proper key, nonce, and have the correct block number/position set
+ * @param keystream OUTPUT the 512-bit (16 32-bit words) output keystream for the given block position
+ */
+void arx_block(const arx_core *core, const uint32_t *state, uint32_t *keystream) {
+    // Copy the current state to a working variable, and perform the actual rounds on it to mix it up
+    uint32_t mixed_block[16];
+    memcpy(mixed_block, state, sizeof(mixed_block));
+    core->permute(mixed_block);
+
+    // Set the keystream to the addition of the original state and the recently mixed state
+    for (int i = 0; i < 16; i++) {
+        keystream[i] = mixed_block[i] + state[i];
+    }
+}
+
+/**
+ * Moves the block counter/position in the state forward
+ * The counter is 64 bits split over two words (lower 32 bits first), so it has to carry between them
+ * @param core the cipher (which decides where the counter is)
+ * @param state (IN/OUT) the internal state of the cipher
+ * @param num_blocks how many blocks to move forward by
+ */
+void arx_advance(const arx_core *core, uint32_t *state, uint64_t num_blocks) {
+    uint64_t position = ((uint64_t)state[core->counter + 1] << 32) | state[core->counter];
+    position += num_blocks;
+    state[core->counter] = (uint32_t)position;
+    state[core->counter + 1] = (uint32_t)(position >> 32);
+}
+
+/**
+ * Applies the cipher to a whole number of blocks and then a partial last block, starting at the state's position
+ * @param core the cipher and number of rounds
+ * @param state (IN/OUT) the internal state of the cipher, its position is moved past every block that is used
+ * @param input the input to apply the cipher to
+ * @param len length of the input/output in BYTES
+ * @param output OUTPUT the output of the cipher (may be the same as input)
+ */
+void arx_apply(const arx_core *core, uint32_t *state, const uint8_t *input, size_t len, uint8_t *output) {
+    uint8_t keystream[64]; // The keystream generated by the cipher use to encrypt/decrypt, for the last few blocks
+
+    // Each block's keystream only depends on its position, so as many blocks as the processor can fit are computed in parallel
+    // The widest kernel goes first, then the 4 block kernel picks up what it leaves, then the rest are done one block at a time
+    arx_blocks_fn apply_blocks;
+    int num_lanes = arx_widest_blocks(core, &apply_blocks);
+    size_t block_pos = 0;
+    if (num_lanes >= 4) {
+        for (; block_pos + 64*num_lanes <= len; block_pos += 64*num_lanes) {
+            apply_blocks(state, input + block_pos, output + block_pos);
+            arx_advance(core, state, num_lanes);
+        }
+        for (; block_pos + 64*4 <= len; block_pos += 64*4) {
+            core->blocks_x4(state, input + block_pos, output + block_pos);
+            arx_advance(core, state, 4);
+        }
+    }
+
+    // Loop through the rest of the input message, generate the keystream for the current block, and XOR it with the current input block to get the output
+    // The cipher works in 512-bit (64-byte) blocks, because that is the size of the keystream generated for each block
+    // However, it is still a stream cipher since each bit is encrypted individually, it just so happens that the cipher generates the keystream in chunks/blocks
+    for (; block_pos < len; block_pos += 64) { // For each 512-bit (64-byte) block in the input, apply the cipher
+        // Generate the 512-bit keystream for the current block
+        arx_block(core, state, (uint32_t*)keystream);
+
+        // Apply the cipher to the input text
+        for (size_t i = 0; (i < 64) && ((block_pos + i) < len); i++) { // Apply bits until either the keystream is used up, OR we get to the end of the input
+            output[block_pos + i] = input[block_pos + i] ^ keystream[i];
+        }
+
+        // Increment the block position counter (which is stored in the state)
+        arx_advance(core, state, 1);
+    }
+}
+
+
+/*******************
+*** BENCHMARKING ***
+*******************/
+/**
+ * Prints how fast a multi-block function (or the single block loop, if apply_blocks is NULL) applies the cipher
+ * @param name the name to print
+ * @param core the cipher and number of rounds
+ * @param apply_blocks the multi-block function to time, or NULL for arx_block
+ * @param num_lanes the number of blocks apply_blocks works on at once
+ */
+void benchmark_arx_blocks(const char *name, const arx_core *core, arx_blocks_fn apply_blocks, int num_lanes) {
+    size_t len = 16 << 20;
+    uint8_t *buffer = calloc(len, 1);
+    uint32_t state[16] = {0};
+    uint32_t keystream[16];
+    memcpy(state, (core->variant == ARX_CHACHA) ? ARX_SIGMA : ARX_TAU, sizeof(ARX_SIGMA)); // Anything will do, as long as it is the same every time
+
+    double best = 0;
+    for (int run = 0; run < 3; run++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (size_t pos = 0; pos < len; pos += 64*num_lanes) {
+            if (apply_blocks != NULL) {
+                apply_blocks(state, buffer + pos, buffer + pos);
+            }
+            else {
+                arx_block(core, state, keystream);
+                for (int i = 0; i < 64; i++) {
+                    buffer[pos + i] ^= ((uint8_t*)keystream)[i];
+                }
+            }
+            arx_advance(core, state, num_lanes);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        best = (len / seconds > best) ? len / seconds : best;
+    }
+
+    printf("%s%-2d %-24s %8.1f MB/s\n", (core->variant == ARX_CHACHA) ? "ChaCha" : "Salsa20/", core->num_rounds, name, best / 1e6);
+    free(buffer);
+}
+
+/**
+ * Prints how fast one block at a time and each multi-block function the processor has apply the cipher, at 20, 12, and 8 rounds
+ * @param variant ARX_CHACHA or ARX_SALSA
+ */
+void benchmark_arx(arx_variant variant) {
+    int round_counts[3] = {20, 12, 8};
+    arx_blocks_fn widest;
+    for (int i = 0; i < 3; i++) {
+        const arx_core *core = arx_select(variant, round_counts[i]);
+        int num_lanes = arx_widest_blocks(core, &widest);
+        benchmark_arx_blocks("1 block", core, NULL, 1);
+        benchmark_arx_blocks("4 blocks", core, core->blocks_x4, 4);
+        if (num_lanes >= 8) {
+            benchmark_arx_blocks("8 blocks (AVX2)", core, core->blocks_x8, 8);
+        }
+        if (num_lanes >= 16) {
+            benchmark_arx_blocks("16 blocks (AVX-512)", core, core->blocks_x16, 16);
+        }
+    }
+}
+
+#endif
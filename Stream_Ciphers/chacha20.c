@@ -1,79 +1,19 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
+#include "arx.h" // The rounds and the multi-block keystream functions, shared with Salsa20
 
-#define KEY_SIZE_BITS 256 // Can be 256 or 128
-#define NUM_ROUNDS 20 // Can be 20, 12, or 8
 
-
-/****************************
-*** INNER ROUND FUNCTIONS ***
-****************************/
-/**
- * Rotation to the left (ROTL), which rotates the given value by n bytes
- * @param value 32-bit word to rotate
- * @param shift integer value for number of bits to rotate
- */
-uint32_t ROTL(uint32_t value, int shift) {
-    // Wrap the bits around back to the start when shifting
-    return (value << shift) | (value >> (32 - shift));
-}
-
-/**
- * Quarter-Round (QR) function, which adds, rotates, and XORs (ARX) the 4 input words 
- * This is applied to a single column/diagonal of the state
- * Since there are 4 columns/diagonals in total, a single call to this funciton is a "quarter of a round"
- * Applying it to each column/diagonal, would then be a "round"
- * @param a 32-bit word
- * @param b 32-bit word
- * @param c 32-bit word
- * @param d 32-bit word
- */
-void QR(uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d) {
-    *a = *a + *b;
-    *d = ROTL(*d ^ *a, 16);
-    *c = *c + *d;
-    *b = ROTL(*b ^ *c, 12);
-    *a = *a + *b;
-    *d = ROTL(*d ^ *a, 8);
-    *c = *c + *d;
-    *b = ROTL(*b ^ *c, 7);
-}
-
-/**
- * Odd number round of the ChaCha20 cipher
- * Operates on the columns of the ChaCha20 state matrix
- * @param state the 4x4 matrix containing the 16 32-bit state values
- */
-void column_round(uint32_t *state) {
-    QR(&state[0], &state[4], &state[8],  &state[12]);
-    QR(&state[1], &state[5], &state[9],  &state[13]);
-    QR(&state[2], &state[6], &state[10], &state[14]);
-    QR(&state[3], &state[7], &state[11], &state[15]);
-}
-
-/**
- * Even number round of the ChaCha20 cipher
- * Operates on the diagonals of the ChaCha20 state matrix
- * @param state the 4x4 matrix containing the 16 32-bit state values
- */
-void diagonal_round(uint32_t *state) {
-    QR(&state[0], &state[5], &state[10], &state[15]);
-    QR(&state[1], &state[6], &state[11], &state[12]);
-    QR(&state[2], &state[7], &state[8],  &state[13]);
-    QR(&state[3], &state[4], &state[9],  &state[14]);
-}
-
-/**
- * Performs a two rounds (double round) of the ChaCha20 cipher
- * The first (odd) round is on the columns, the second (even) round is on the diagonals
- * @param state the 4x4 matrix containing the 16 32-bit state values
- */
-void double_round(uint32_t *state) {
-    column_round(state);
-    diagonal_round(state);
-}
+// Inputs at least this long are split into chunks and encrypted on every processor by chacha20_parallel (see the benchmark)
+#define PARALLEL_THRESHOLD (1 << 20)
+#define PARALLEL_CHUNK_SIZE (256 << 10) // Must be a multiple of 64 (a whole number of blocks)
+#define MAX_THREADS 64
 
 
 /**********************************
@@ -89,7 +29,7 @@ void double_round(uint32_t *state) {
  */
 void chacha20_init(uint32_t *key, uint32_t *nonce, uint32_t *position, uint32_t *state) {
     // Nothing-up-my-sleve number to protect against 0s in the key or nonce
-    uint32_t *constants = (KEY_SIZE_BITS == 256) ? "expand 32-byte k" : "expand 16-byte k";
+    const uint32_t *constants = (KEY_SIZE_BITS == 256) ? ARX_SIGMA : ARX_TAU;
 
     state[0] = constants[0]; // First 32 bits of the constant value
     state[1] = constants[1]; 
@@ -120,21 +60,101 @@ void chacha20_init(uint32_t *key, uint32_t *nonce, uint32_t *position, uint32_t
  * @param keystream OUTPUT the 512-bit (16 32-bit words) output keystream for the given block position
  */
 void chacha20_block(uint32_t *state, uint32_t *keystream) {
-    // Copy the current state to a working variable
-    uint32_t mixed_block[16];
-    for (int i = 0; i < 16; i++) {
-        mixed_block[i] = state[i];
-    }
+    arx_block(&chacha20_core, state, keystream);
+}
 
-    // Perform the actual rounds on the state to mix it up
-    for (int i = 0; i < NUM_ROUNDS / 2; i++) {
-        double_round(mixed_block);
+/**
+ * Moves the block counter/position in the state forward
+ * The counter is 64 bits split over state[12] (lower 32 bits) and state[13] (upper 32 bits), so it has to carry between them
+ * @param state (IN/OUT) the internal state of the cipher
+ * @param num_blocks how many blocks to move forward by
+ */
+void chacha20_advance(uint32_t *state, uint64_t num_blocks) {
+    arx_advance(&chacha20_core, state, num_blocks); // The counter is in the same place for every number of rounds
+}
+
+/**
+ * Applies the ChaCha20 cipher to a whole number of blocks and then a partial last block, starting at the state's position
+ * @param state (IN/OUT) the internal state of the cipher, its position is moved past every block that is used
+ * @param input the input to apply the cipher to
+ * @param len length of the input/output in BYTES
+ * @param output OUTPUT the output of the cipher (may be the same as input)
+ */
+void chacha20_apply(uint32_t *state, const uint8_t *input, size_t len, uint8_t *output) {
+    arx_apply(&chacha20_core, state, input, len, output);
+}
+
+/**
+ * Applies the cipher to part of a longer stream, starting from a state that is at the start of the stream (block 0)
+ * @param core the number of rounds (from arx_select)
+ * @param state (IN/OUT) the internal state of the cipher, at block 0, its position is moved past every block that is used
+ * @param input the input to apply the cipher to, the bytes of the stream starting at offset
+ * @param len length of the input/output in BYTES
+ * @param offset the position of the first byte of input in the whole stream (in BYTES)
+ * @param output OUTPUT the output of the cipher, should be the same size as the input (may be the same as input)
+ */
+void chacha_apply_at(const arx_core *core, uint32_t *state, const uint8_t *input, size_t len, uint64_t offset, uint8_t *output) {
+    arx_advance(core, state, offset / 64); // The block that the offset is in
+
+    // If the offset is part way through a block, only the end of that block's keystream is used
+    size_t skip = offset % 64;
+    if (skip > 0 && len > 0) {
+        uint8_t keystream[64];
+        arx_block(core, state, (uint32_t*)keystream);
+        size_t num_bytes = (len < 64 - skip) ? len : 64 - skip;
+        for (size_t i = 0; i < num_bytes; i++) {
+            output[i] = input[i] ^ keystream[skip + i];
+        }
+        arx_advance(core, state, 1);
+        input += num_bytes;
+        output += num_bytes;
+        len -= num_bytes;
     }
 
-    // Set the keystream to the addition of the original state and the recently mixed state
-    for (int i = 0; i < 16; i++) {
-        keystream[i] = mixed_block[i] + state[i];
+    arx_apply(core, state, input, len, output);
+}
+
+/**
+ * Applies ChaCha with any number of rounds to part of a longer stream, without generating the keystream for anything before it
+ * Since each block's keystream only depends on its position, this can jump straight to any byte of the stream
+ * (e.g. to decrypt part of an encrypted file, or to answer a ranged read)
+ * The number of rounds is picked at run time, e.g. ChaCha12 for bulk data and ChaCha20 for everything else
+ * @param num_rounds the number of rounds (8, 12, or 20)
+ * @param input the input to apply the cipher to, the bytes of the stream starting at offset
+ * @param len length of the input/output in BYTES
+ * @param key the 256-bit or 128-bit symmetric key being used for the cipher
+ * @param nonce 64-bit nonce being used for the cipher
+ * @param offset the position of the first byte of input in the whole stream (in BYTES)
+ * @param output OUTPUT the output of the cipher, should be the same size as the input (may be the same as input)
+ * @returns 0 on success, or -1 if there is no version of ChaCha with that number of rounds
+ */
+int chacha_at(int num_rounds, const uint8_t *input, size_t len,
+              uint32_t *key, uint32_t *nonce, uint64_t offset,
+              uint8_t *output) {
+    const arx_core *core = arx_select(ARX_CHACHA, num_rounds);
+    if (core == NULL) {
+        return -1;
     }
+    uint32_t state[16];
+    uint32_t position[2] = {0, 0};
+    chacha20_init(key, nonce, position, state);
+    chacha_apply_at(core, state, input, len, offset, output);
+    return 0;
+}
+
+/**
+ * Applies the ChaCha20 cipher to part of a longer stream, without generating the keystream for anything before it
+ * @param input the input to apply the cipher to, the bytes of the stream starting at offset
+ * @param len length of the input/output in BYTES
+ * @param key the 256-bit or 128-bit symmetric key being used for the cipher
+ * @param nonce 64-bit nonce being used for the cipher
+ * @param offset the position of the first byte of input in the whole stream (in BYTES)
+ * @param output OUTPUT the output of the cipher, should be the same size as the input (may be the same as input)
+ */
+void chacha20_at(const uint8_t *input, size_t len,
+                 uint32_t *key, uint32_t *nonce, uint64_t offset,
+                 uint8_t *output) {
+    chacha_at(20, input, len, key, nonce, offset, output);
 }
 
 /**
@@ -148,36 +168,332 @@ void chacha20_block(uint32_t *state, uint32_t *keystream) {
 void chacha20(uint8_t *input, int len, 
              uint32_t *key, uint32_t *nonce, 
              uint8_t *output) {
-    // Internal variables for the cipher
-    uint32_t state[16]; // The 4x4 matrix holding the variables that define the cipher (mainly the key and nonce, plus a position value for where in the cipher we are, plus constant values to fill the rest)
-    uint8_t keystream[64]; // The keystream generated by the cipher use to encrypt/decrypt
-                           // My implementation only keeps track of one block's worth of keystream at a time (512-bit) for simplicity
-                           // However, this could easily be split up where each block's keystream be calculated in parallel
-    
-    // Expand the key and create the initial state
-    uint64_t block_num = 0; // Start at block 0
-    chacha20_init((uint32_t*)key, (uint32_t*)nonce, (uint32_t*)(&block_num), state);
+    chacha20_at(input, len, key, nonce, 0, output); // Start at byte 0 (block 0)
+}
+
+
+/*********************
+*** EXTENDED NONCE ***
+*********************/
+/*
+ * A 64-bit nonce is too short to pick at random (after about 2^32 messages under one key, two are likely to share a nonce)
+ * XChaCha20 takes a 192-bit nonce instead: HChaCha20 mixes the key with the first 128 bits of the nonce into a subkey,
+ * and then ChaCha20 runs as usual with the subkey and the last 64 bits of the nonce
+ * With 192 bits, random nonces can be used without any coordination between the senders
+ */
+
+/**
+ * HChaCha20, which derives a subkey from a key and a 128-bit nonce
+ * It runs the same rounds as a block, but leaves out the final addition of the state, and only gives back the rows
+ * that an attacker cannot work out from the output (the constants and the nonce rows), so the subkey can not be undone
+ * @param key the 256-bit symmetric key
+ * @param nonce 128-bit (16-byte) nonce
+ * @param subkey OUTPUT the 256-bit subkey (8 32-bit words)
+ */
+void hchacha20(uint32_t *key, uint32_t *nonce, uint32_t *subkey) {
+    // The nonce fills the last row, where the position and nonce usually go
+    uint32_t state[16];
+    chacha20_init(key, &nonce[2], &nonce[0], state);
+
+    chacha20_core.permute(state);
+
+    memcpy(subkey, &state[0], 16); // First row
+    memcpy(subkey + 4, &state[12], 16); // Last row
+    memset(state, 0, sizeof(state));
+}
+
+/**
+ * Sets up the state for XChaCha20 up to the last 64 bits of the nonce, which is the slow part (an extra block's worth of rounds)
+ * The result only depends on the key and the first 128 bits of the nonce, so it can be kept and reused for every message
+ * that shares them (e.g. a sender that picks a random 128-bit prefix once, then uses a counter or random suffix per message)
+ * @param key the 256-bit symmetric key
+ * @param nonce_prefix the first 128 bits (16 bytes) of the 192-bit nonce
+ * @param template_state OUTPUT the 16 32-bit words of the state, with the subkey in place and the position and nonce left at 0
+ */
+void xchacha20_init(uint32_t *key, uint32_t *nonce_prefix, uint32_t *template_state) {
+    uint32_t subkey[8];
+    uint32_t zeros[2] = {0, 0};
+    hchacha20(key, nonce_prefix, subkey);
+    chacha20_init(subkey, zeros, zeros, template_state);
+    memset(subkey, 0, sizeof(subkey));
+}
+
+/**
+ * Applies XChaCha20 to part of a stream, from a state set up by xchacha20_init
+ * @param input the input to apply the cipher to, the bytes of the stream starting at offset
+ * @param len length of the input/output in BYTES
+ * @param template_state the state from xchacha20_init (it is not changed)
+ * @param nonce_suffix the last 64 bits (8 bytes) of the 192-bit nonce
+ * @param offset the position of the first byte of input in the whole stream (in BYTES)
+ * @param output OUTPUT the output of the cipher, should be the same size as the input (may be the same as input)
+ */
+void xchacha20_at(const uint8_t *input, size_t len,
+                  const uint32_t *template_state, uint32_t *nonce_suffix, uint64_t offset,
+                  uint8_t *output) {
+    uint32_t state[16];
+    memcpy(state, template_state, sizeof(state));
+    state[14] = nonce_suffix[0];
+    state[15] = nonce_suffix[1];
+    chacha_apply_at(&chacha20_core, state, input, len, offset, output);
+}
+
+/**
+ * Applies the XChaCha20 cipher to a given input text using the provided key and 192-bit nonce (this same function does encryption and decryption)
+ * @param input the input to apply the cipher to, will be the plaintext if doing encryption and be the ciphertext if doing decryption
+ * @param len length of the input/output in BYTES
+ * @param key the 256-bit symmetric key being used for the cipher
+ * @param nonce 192-bit (24-byte) nonce being used for the cipher, safe to choose at random
+ * @param output OUTPUT the output of the cipher, should be the same size as the input, will be the ciphertext if doing encryption and be the plaintext if doing decryption
+ */
+void xchacha20(uint8_t *input, int len,
+               uint32_t *key, uint32_t *nonce,
+               uint8_t *output) {
+    uint32_t template_state[16];
+    xchacha20_init(key, nonce, template_state);
+    xchacha20_at(input, len, template_state, &nonce[4], 0, output);
+    memset(template_state, 0, sizeof(template_state));
+}
+
+
+/**************************
+*** PARALLEL ENCRYPTION ***
+**************************/
+/*
+ * Large inputs are split into chunks of whole blocks, and each chunk is encrypted from its own starting position
+ * The chunks are shared out on a pool of threads that is started once and then kept waiting for work
+ * Every thread starts with an equal share of the chunks, and a thread that finishes early steals half of what is left
+ * of another thread's share, so a thread that is slowed down (e.g. by the OS running something else) does not hold up the rest
+ */
+
+/**
+ * The chunks a thread still has to do, packed into one word so that it can be changed atomically:
+ * the next chunk is in the lower 32 bits, and the end of the range (exclusive) is in the upper 32 bits
+ * The owner takes chunks from the start, thieves take them from the end
+ * (Each range is on its own cache line, so threads taking chunks do not slow each other down)
+ */
+typedef struct {
+    _Atomic uint64_t range;
+} __attribute__((aligned(64))) chunk_range;
+
+#define PACK_RANGE(next, end) (((uint64_t)(end) << 32) | (uint32_t)(next))
+#define RANGE_NEXT(range) ((uint32_t)(range))
+#define RANGE_END(range) ((uint32_t)((range) >> 32))
+
+/**
+ * The thread pool, and the job it is currently working on (only one job runs at a time)
+ */
+typedef struct {
+    int num_threads; // Including the thread that submits a job, which works on it too
+    pthread_mutex_t submit; // Held by the thread whose job is running
+    pthread_mutex_t lock; // Protects job_num and num_busy
+    pthread_cond_t wake; // Signalled when a new job is submitted
+    pthread_cond_t done; // Signalled when the last pool thread finishes a job
+    uint64_t job_num; // Counts the jobs submitted, a pool thread starts on a job when this changes
+    int num_busy; // The number of pool threads still working on the current job
+
+    // The current job
+    const arx_core *core; // The number of rounds
+    uint32_t state[16]; // The state at the start of the input
+    const uint8_t *input;
+    uint8_t *output;
+    size_t len;
+    size_t chunk_size;
+    chunk_range ranges[MAX_THREADS];
+} chacha20_pool;
+
+chacha20_pool pool;
+pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Encrypts one chunk of the current job
+ * @param chunk the index of the chunk
+ */
+void pool_do_chunk(size_t chunk) {
+    uint32_t state[16];
+    memcpy(state, pool.state, sizeof(state));
+    size_t start = chunk * pool.chunk_size;
+    size_t len = (pool.len - start < pool.chunk_size) ? pool.len - start : pool.chunk_size;
+    arx_advance(pool.core, state, start / 64);
+    arx_apply(pool.core, state, pool.input + start, len, pool.output + start);
+}
+
+/**
+ * Tries to steal chunks from another thread's range, half of what it has left (rounded up)
+ * @param thread_num the index of the thread doing the stealing
+ * @returns 1 if chunks were stolen (and put in the thread's own range), or 0 if every other range is empty
+ */
+int pool_steal(int thread_num) {
+    for (int i = 1; i < pool.num_threads; i++) {
+        chunk_range *victim = &pool.ranges[(thread_num + i) % pool.num_threads];
+        uint64_t range = atomic_load(&victim->range);
+        while (RANGE_NEXT(range) < RANGE_END(range)) {
+            uint32_t next = RANGE_NEXT(range);
+            uint32_t end = RANGE_END(range);
+            uint32_t mid = end - (end - next + 1) / 2;
+            if (atomic_compare_exchange_weak(&victim->range, &range, PACK_RANGE(next, mid))) {
+                atomic_store(&pool.ranges[thread_num].range, PACK_RANGE(mid, end));
+                return 1;
+            }
+            // range was reloaded by the failed exchange, so just try again with whatever is left
+        }
+    }
+    return 0;
+}
 
-    // Loop through the input message, generate the keystream for the current block, and XOR it with the current input block to get the output
-    // This cipher works in 512-bit (64-byte) blocks, because that is the size of the keystream generated for each block
-    // However, it is still a stream cipher since each bit is encrypted individually, it just so happens that the cipher generates the keystream in chunks/blocks
-    for (int block_pos = 0; block_pos < len; block_pos += 64) { // For each 512-bit (64-byte) block in the input, apply the cipher
-        // Generate the 512-bit keystream for the current block
-        chacha20_block(state, (uint32_t*)keystream);
+/**
+ * Works on the current job until there are no chunks left anywhere
+ * @param thread_num the index of the thread (0 is the thread that submitted the job)
+ */
+void pool_work(int thread_num) {
+    chunk_range *own = &pool.ranges[thread_num];
+    do {
+        uint64_t range = atomic_load(&own->range);
+        while (RANGE_NEXT(range) < RANGE_END(range)) {
+            if (atomic_compare_exchange_weak(&own->range, &range, PACK_RANGE(RANGE_NEXT(range) + 1, RANGE_END(range)))) {
+                pool_do_chunk(RANGE_NEXT(range));
+                range = atomic_load(&own->range);
+            }
+        }
+    } while (pool_steal(thread_num));
+}
 
-        // Apply the cipher to the input text
-        for (int i = 0; (i < 64) && ((block_pos + i) < len); i++) { // Apply bits until either the keystream is used up, OR we get to the end of the input
-            output[block_pos + i] = input[block_pos + i] ^ keystream[i];
+/**
+ * A pool thread, waits for each job to be submitted and then works on it
+ * @param arg the index of the thread (cast to a pointer)
+ * @returns never returns
+ */
+void* pool_thread(void *arg) {
+    int thread_num = (int)(intptr_t)arg;
+    uint64_t last_job = 0;
+
+    pthread_mutex_lock(&pool.lock);
+    while (1) {
+        while (pool.job_num == last_job) {
+            pthread_cond_wait(&pool.wake, &pool.lock);
         }
-        
-        // Increment the block position counter (which is stored in the state)
-        state[8] = (state[8] + 1) & 0xFFFFFFFF; // Adds 1 to the lower 32 bits of the block number (the "& 0xFFFFFFFF" essential performs a modulo 2^32)
-        if (state[8] == 0) { // Handle overflow
-            state[9] = (state[9] + 1) & 0xFFFFFFFF; // Upper 32 bits of the block number 
+        last_job = pool.job_num;
+        pthread_mutex_unlock(&pool.lock);
+
+        pool_work(thread_num);
+
+        pthread_mutex_lock(&pool.lock);
+        pool.num_busy--;
+        if (pool.num_busy == 0) {
+            pthread_cond_signal(&pool.done);
         }
     }
 }
 
+/**
+ * Starts the pool, with one thread per processor (the thread submitting a job counts as one of them)
+ */
+void pool_start() {
+    pthread_mutex_init(&pool.submit, NULL);
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.wake, NULL);
+    pthread_cond_init(&pool.done, NULL);
+
+    long num_processors = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_threads = (num_processors < 1) ? 1 : ((num_processors > MAX_THREADS) ? MAX_THREADS : num_processors);
+    pool.num_threads = 1;
+    for (int i = 1; i < num_threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pool_thread, (void*)(intptr_t)i) != 0) {
+            break; // Just use the threads that did start
+        }
+        pthread_detach(thread);
+        pool.num_threads++;
+    }
+}
+
+/**
+ * Applies the ChaCha cipher to the input split into chunks of the given size, on every thread of the pool
+ * @param core the number of rounds (from arx_select)
+ * @param state the state at the start of the input (not changed)
+ * @param input the input to apply the cipher to
+ * @param len length of the input/output in BYTES
+ * @param output OUTPUT the output of the cipher (may be the same as input)
+ * @param chunk_size the size of each chunk in BYTES (a multiple of 64)
+ * @returns 1 if the input was encrypted, or 0 if the pool was busy with another job (or has no other threads)
+ */
+int pool_apply(const arx_core *core, const uint32_t *state, const uint8_t *input, size_t len, uint8_t *output, size_t chunk_size) {
+    pthread_once(&pool_once, pool_start);
+    size_t num_chunks = (len + chunk_size - 1) / chunk_size;
+    if (pool.num_threads < 2 || num_chunks > UINT32_MAX || pthread_mutex_trylock(&pool.submit) != 0) {
+        return 0;
+    }
+
+    // Set up the job, giving each thread an equal share of the chunks
+    pool.core = core;
+    memcpy(pool.state, state, sizeof(pool.state));
+    pool.input = input;
+    pool.output = output;
+    pool.len = len;
+    pool.chunk_size = chunk_size;
+    for (int i = 0; i < pool.num_threads; i++) {
+        atomic_store(&pool.ranges[i].range, PACK_RANGE(num_chunks * i / pool.num_threads, num_chunks * (i + 1) / pool.num_threads));
+    }
+
+    // Wake the pool threads, work alongside them, then wait for them all to be done (so the job can be safely replaced)
+    pthread_mutex_lock(&pool.lock);
+    pool.num_busy = pool.num_threads - 1;
+    pool.job_num++;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+
+    pool_work(0);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.num_busy > 0) {
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    pthread_mutex_unlock(&pool.submit);
+    return 1;
+}
+
+/**
+ * Applies ChaCha with any number of rounds like chacha_at (from offset 0), except large inputs are encrypted on every processor at once
+ * Inputs shorter than PARALLEL_THRESHOLD (or any input, while another thread's input is being encrypted) are done on this thread
+ * @param num_rounds the number of rounds (8, 12, or 20)
+ * @param input the input to apply the cipher to, will be the plaintext if doing encryption and be the ciphertext if doing decryption
+ * @param len length of the input/output in BYTES
+ * @param key the 256-bit or 128-bit symmetric key being used for the cipher
+ * @param nonce 64-bit nonce being used for the cipher
+ * @param output OUTPUT the output of the cipher, should be the same size as the input (may be the same as input)
+ * @returns 0 on success, or -1 if there is no version of ChaCha with that number of rounds
+ */
+int chacha_parallel(int num_rounds, const uint8_t *input, size_t len,
+                    uint32_t *key, uint32_t *nonce,
+                    uint8_t *output) {
+    const arx_core *core = arx_select(ARX_CHACHA, num_rounds);
+    if (core == NULL) {
+        return -1;
+    }
+    uint32_t state[16];
+    uint32_t position[2] = {0, 0};
+    chacha20_init(key, nonce, position, state);
+    if (len < PARALLEL_THRESHOLD || !pool_apply(core, state, input, len, output, PARALLEL_CHUNK_SIZE)) {
+        arx_apply(core, state, input, len, output);
+    }
+    return 0;
+}
+
+/**
+ * Applies the ChaCha20 cipher like chacha20, except large inputs are encrypted on every processor at once
+ * @param input the input to apply the cipher to, will be the plaintext if doing encryption and be the ciphertext if doing decryption
+ * @param len length of the input/output in BYTES
+ * @param key the 256-bit or 128-bit symmetric key being used for the cipher
+ * @param nonce 64-bit nonce being used for the cipher
+ * @param output OUTPUT the output of the cipher, should be the same size as the input (may be the same as input)
+ */
+void chacha20_parallel(const uint8_t *input, size_t len,
+                       uint32_t *key, uint32_t *nonce,
+                       uint8_t *output) {
+    chacha_parallel(20, input, len, key, nonce, output);
+}
+
 
 /**************
 *** TESTING ***
@@ -189,7 +505,64 @@ void print_hex(unsigned char *bytes, int len) {
     printf("\n");
 }
 
-int main() {
+/**
+ * Prints how fast the pool applies the cipher to inputs of a given length, split into chunks of a given size
+ * @param len length of the input in BYTES
+ * @param chunk_size the size of each chunk in BYTES, or 0 to apply the cipher on this thread only
+ */
+void benchmark_chacha20_parallel(size_t len, size_t chunk_size) {
+    uint8_t *buffer = calloc(len, 1);
+    uint32_t key[8] = {0};
+    uint32_t nonce[2] = {0};
+    uint64_t block_num = 0;
+    uint32_t state[16];
+    chacha20_init(key, nonce, (uint32_t*)&block_num, state);
+
+    // Repeat short inputs enough times to take a measurable amount of time
+    size_t repeats = (len < (64 << 20)) ? (64 << 20) / len : 1;
+    double best = 0;
+    for (int run = 0; run < 3; run++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (size_t i = 0; i < repeats; i++) {
+            if (chunk_size == 0 || !pool_apply(&chacha20_core, state, buffer, len, buffer, chunk_size)) {
+                uint32_t serial_state[16];
+                memcpy(serial_state, state, sizeof(state));
+                chacha20_apply(serial_state, buffer, len, buffer);
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        best = (len * repeats / seconds > best) ? len * repeats / seconds : best;
+    }
+
+    printf("%9zu KiB in %7zu KiB chunks %8.1f MB/s\n", len >> 10, chunk_size >> 10, best / 1e6);
+    free(buffer);
+}
+
+int main(int argc, char **argv) {
+    // Compare the speed of one block at a time with each multi-block function the processor has, at 20, 12, and 8 rounds,
+    // when run as "./chacha20 benchmark"
+    if (argc > 1 && strcmp(argv[1], "benchmark") == 0) {
+        benchmark_arx(ARX_CHACHA);
+
+        // Chunk sizes for a large input (smaller chunks balance better, but each one has a fixed cost)
+        pthread_once(&pool_once, pool_start);
+        printf("\n%d threads (0 KiB chunks = this thread only)\n", pool.num_threads);
+        for (size_t chunk_size = 16 << 10; chunk_size <= (4 << 20); chunk_size *= 4) {
+            benchmark_chacha20_parallel(256 << 20, chunk_size);
+        }
+
+        // Input lengths either side of PARALLEL_THRESHOLD, on this thread only and on the pool
+        printf("\n");
+        for (size_t len = 64 << 10; len <= (16 << 20); len *= 4) {
+            benchmark_chacha20_parallel(len, 0);
+            benchmark_chacha20_parallel(len, (len / 16 < PARALLEL_CHUNK_SIZE) ? ((len / 16 + 63) & ~(size_t)63) : PARALLEL_CHUNK_SIZE);
+        }
+        return 0;
+    }
+
     // Set test variables for the cipher
     uint8_t key[32] = {
         0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
@@ -228,6 +601,180 @@ int main() {
     if (memcmp(plaintext, decrypted_plaintext, len) != 0) {
         printf("ERROR: Plaintext and decrypted_plaintext are NOT the same!");
     }
+
+    // Sanity check the first block of keystream for an all 0 key and nonce against the known value
+    if (KEY_SIZE_BITS == 256) {
+        uint8_t zeros[64] = {0};
+        uint8_t zero_keystream[64];
+        uint8_t expected_keystream[16] = {0x76, 0xb8, 0xe0, 0xad, 0xa0, 0xf1, 0x3d, 0x90, 0x40, 0x5d, 0x6a, 0xe5, 0x53, 0x86, 0xbd, 0x28};
+        chacha20(zeros, 64, (uint32_t*)zeros, (uint32_t*)zeros, zero_keystream);
+        if (memcmp(zero_keystream, expected_keystream, 16) != 0) {
+            printf("ERROR: Keystream for the all 0 key and nonce is NOT correct!");
+        }
+
+        // HChaCha20 example: https://datatracker.ietf.org/doc/html/draft-irtf-cfrg-xchacha (Section 2.2.1)
+        uint8_t hchacha_key[32];
+        uint8_t hchacha_nonce[16] = {0x00, 0x00, 0x00, 0x09, 0x00, 0x00, 0x00, 0x4a, 0x00, 0x00, 0x00, 0x00, 0x31, 0x41, 0x59, 0x27};
+        uint8_t subkey[32];
+        uint8_t expected_subkey[32] = {
+            0x82, 0x41, 0x3b, 0x42, 0x27, 0xb2, 0x7b, 0xfe, 0xd3, 0x0e, 0x42, 0x50, 0x8a, 0x87, 0x7d, 0x73,
+            0xa0, 0xf9, 0xe4, 0xd5, 0x8a, 0x74, 0xa8, 0x53, 0xc1, 0x2e, 0xc4, 0x13, 0x26, 0xd3, 0xec, 0xdc
+        };
+        for (int i = 0; i < 32; i++) {
+            hchacha_key[i] = i;
+        }
+        hchacha20((uint32_t*)hchacha_key, (uint32_t*)hchacha_nonce, (uint32_t*)subkey);
+        if (memcmp(subkey, expected_subkey, 32) != 0) {
+            printf("ERROR: HChaCha20 subkey is NOT correct!");
+        }
+
+        // XChaCha20 example from the same draft (Section A.3.2), which starts at block 1 (64 bytes into the stream)
+        const char *dhole_text = "The dhole (pronounced \"dole\") is also known as the Asiatic wild dog, red dog, and whistling dog. "
+                                 "It is about the size of a German shepherd but looks more like a long-legged fox. This highly elusive "
+                                 "and skilled jumper is classified with wolves, coyotes, jackals, and foxes in the taxonomic family Canidae.";
+        const char *dhole_expected =
+            "7d0a2e6b7f7c65a236542630294e063b7ab9b555a5d5149aa21e4ae1e4fbce87ecc8e08a8b5e350abe622b2ffa617b20"
+            "2cfad72032a3037e76ffdcdc4376ee053a190d7e46ca1de04144850381b9cb29f051915386b8a710b8ac4d027b8b050f"
+            "7cba5854e028d564e453b8a968824173fc16488b8970cac828f11ae53cabd20112f87107df24ee6183d2274fe4c8b148"
+            "5534ef2c5fbc1ec24bfc3663efaa08bc047d29d25043532db8391a8a3d776bf4372a6955827ccb0cdd4af403a7ce4c63"
+            "d595c75a43e045f0cce1f29c8b93bd65afc5974922f214a40b7c402cdb91ae73c0b63615cdad0480680f16515a7ace9d"
+            "39236464328a37743ffc28f4ddb324f4d0f5bbdc270c65b1749a6efff1fbaa09536175ccd29fb9e6057b307320d31683"
+            "8a9c71f70b5b5907a66f7ea49aadc409";
+        size_t dhole_len = strlen(dhole_text);
+        uint8_t dhole_key[32];
+        uint8_t dhole_nonce[24];
+        uint8_t dhole_template[64];
+        uint8_t dhole_ciphertext[304];
+        char dhole_hex[2*304 + 1];
+        for (int i = 0; i < 32; i++) {
+            dhole_key[i] = 0x80 + i;
+        }
+        for (int i = 0; i < 24; i++) {
+            dhole_nonce[i] = 0x40 + i;
+        }
+        dhole_nonce[23] = 0x58; // The draft's nonce skips 0x57
+        xchacha20_init((uint32_t*)dhole_key, (uint32_t*)dhole_nonce, (uint32_t*)dhole_template);
+        xchacha20_at((const uint8_t*)dhole_text, dhole_len, (uint32_t*)dhole_template, (uint32_t*)(dhole_nonce + 16), 64, dhole_ciphertext);
+        for (size_t i = 0; i < dhole_len; i++) {
+            sprintf(&dhole_hex[2*i], "%02x", dhole_ciphertext[i]);
+        }
+        if (dhole_len != 304 || strcmp(dhole_hex, dhole_expected) != 0) {
+            printf("ERROR: XChaCha20 ciphertext is NOT correct!");
+        }
+    }
+
+    // Sanity check XChaCha20 from a kept template against XChaCha20 from scratch, part way into the stream
+    uint8_t long_nonce[24];
+    uint8_t x_expected[300];
+    uint8_t x_actual[200];
+    uint32_t template_state[16];
+    for (int i = 0; i < 24; i++) {
+        long_nonce[i] = i * 11;
+    }
+    xchacha20(plaintext, len, (uint32_t*)key, (uint32_t*)long_nonce, x_expected);
+    xchacha20_init((uint32_t*)key, (uint32_t*)long_nonce, template_state);
+    xchacha20_at(plaintext + 5, len - 5, template_state, (uint32_t*)(long_nonce + 16), 5, x_actual);
+    if (memcmp(x_actual, x_expected + 5, len - 5) != 0) {
+        printf("ERROR: XChaCha20 from a template and XChaCha20 from scratch are NOT the same!");
+    }
+
+    // Sanity check every multi-block function against one block at a time, across the carry into the upper 32 bits of the position,
+    // for every number of rounds
+    uint8_t long_input[64*16];
+    uint8_t expected[64*16];
+    uint8_t actual[64*16];
+    uint64_t start_block = 0xFFFFFFFF - 5;
+    uint32_t start_position[2] = {(uint32_t)start_block, (uint32_t)(start_block >> 32)};
+    uint32_t state[16];
+    for (int i = 0; i < 64*16; i++) {
+        long_input[i] = i * 7;
+    }
+    chacha20_init((uint32_t*)key, (uint32_t*)nonce, start_position, state);
+    int round_counts[3] = {8, 12, 20}; // ChaCha20 last, so expected is left with its output for the checks below
+    for (int r = 0; r < 3; r++) {
+        const arx_core *core = arx_select(ARX_CHACHA, round_counts[r]);
+        for (int block = 0; block < 16; block++) {
+            uint32_t block_state[16];
+            uint8_t block_keystream[64];
+            memcpy(block_state, state, sizeof(state));
+            arx_advance(core, block_state, block);
+            arx_block(core, block_state, (uint32_t*)block_keystream);
+            for (int i = 0; i < 64; i++) {
+                expected[64*block + i] = long_input[64*block + i] ^ block_keystream[i];
+            }
+        }
+
+        arx_blocks_fn apply_blocks;
+        int num_lanes = arx_widest_blocks(core, &apply_blocks);
+        for (int lanes = 4; lanes <= num_lanes; lanes *= 2) {
+            arx_blocks_fn functions[5] = {NULL, core->blocks_x4, core->blocks_x8, NULL, core->blocks_x16};
+            for (int block = 0; block < 16; block += lanes) {
+                uint32_t block_state[16];
+                memcpy(block_state, state, sizeof(state));
+                arx_advance(core, block_state, block);
+                functions[lanes / 4](block_state, long_input + 64*block, actual + 64*block);
+            }
+            if (memcmp(actual, expected, sizeof(expected)) != 0) {
+                printf("ERROR: ChaCha%d %d block keystream and 1 block keystream are NOT the same!", round_counts[r], lanes);
+            }
+        }
+    }
+
+    // Sanity check the first block of keystream for an all 0 key and nonce with fewer rounds against the known values
+    // (https://datatracker.ietf.org/doc/html/draft-strombergson-chacha-test-vectors, TC1)
+    if (KEY_SIZE_BITS == 256) {
+        uint8_t zeros[64] = {0};
+        uint8_t reduced_keystream[64];
+        uint8_t expected_reduced[2][8] = {
+            {0x3e, 0x00, 0xef, 0x2f, 0x89, 0x5f, 0x40, 0xd6}, // ChaCha8
+            {0x9b, 0xf4, 0x9a, 0x6a, 0x07, 0x55, 0xf9, 0x53}  // ChaCha12
+        };
+        for (int r = 0; r < 2; r++) {
+            chacha_at(round_counts[r], zeros, 64, (uint32_t*)zeros, (uint32_t*)zeros, 0, reduced_keystream);
+            if (memcmp(reduced_keystream, expected_reduced[r], 8) != 0) {
+                printf("ERROR: ChaCha%d keystream for the all 0 key and nonce is NOT correct!", round_counts[r]);
+            }
+        }
+    }
+    if (chacha_at(10, long_input, 64, (uint32_t*)key, (uint32_t*)nonce, 0, actual) != -1) {
+        printf("ERROR: ChaCha with an unsupported number of rounds was NOT rejected!");
+    }
+
+    // Sanity check splitting a long input into chunks on the pool gives the same output as encrypting it all on this thread
+    // (The chunk size is an odd number of blocks and does not divide the length, so every chunk starts at a different block)
+    size_t parallel_len = 3*PARALLEL_THRESHOLD + 100;
+    uint8_t *parallel_input = malloc(parallel_len);
+    uint8_t *parallel_expected = malloc(parallel_len);
+    uint8_t *parallel_actual = malloc(parallel_len);
+    for (size_t i = 0; i < parallel_len; i++) {
+        parallel_input[i] = i * 13;
+    }
+    chacha20_at(parallel_input, parallel_len, (uint32_t*)key, (uint32_t*)nonce, 0, parallel_expected);
+    chacha20_parallel(parallel_input, parallel_len, (uint32_t*)key, (uint32_t*)nonce, parallel_actual);
+    if (memcmp(parallel_actual, parallel_expected, parallel_len) != 0) {
+        printf("ERROR: Parallel output and single thread output are NOT the same!");
+    }
+    memset(parallel_actual, 0, parallel_len);
+    if (pool_apply(&chacha20_core, state, parallel_input, parallel_len, parallel_actual, 64*37)) {
+        chacha20_at(parallel_input, parallel_len, (uint32_t*)key, (uint32_t*)nonce, 64*start_block, parallel_expected);
+        if (memcmp(parallel_actual, parallel_expected, parallel_len) != 0) {
+            printf("ERROR: Parallel output with small chunks and single thread output are NOT the same!");
+        }
+    }
+    free(parallel_input);
+    free(parallel_expected);
+    free(parallel_actual);
+
+    // Sanity check starting part way through the stream gives the same output as that part of the whole stream
+    // (The whole stream here starts 6 blocks before the carry into the upper 32 bits of the position, like above)
+    size_t offsets[5] = {0, 1, 63, 64, 300};
+    size_t lens[5] = {64*16, 10, 2, 700, 724};
+    for (int i = 0; i < 5; i++) {
+        chacha20_at(long_input + offsets[i], lens[i], (uint32_t*)key, (uint32_t*)nonce, 64*start_block + offsets[i], actual);
+        if (memcmp(actual, expected + offsets[i], lens[i]) != 0) {
+            printf("ERROR: Output starting at byte %zu of the stream is NOT correct!", offsets[i]);
+        }
+    }
     
     return 0;
 }
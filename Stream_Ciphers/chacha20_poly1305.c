@@ -0,0 +1,564 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+
+/**
+ * ChaCha20-Poly1305 (RFC 8439), authenticated encryption with associated data (AEAD)
+ * ChaCha20 encrypts the message, and Poly1305 computes a MAC of the associated data and the ciphertext
+ * The message is processed in cache sized chunks: each chunk is encrypted and then MAC'ed while it is still in the cache
+ * (or MAC'ed and then decrypted), so the data only makes one trip through memory instead of two
+ */
+
+
+/***************
+*** CHACHA20 ***
+***************/
+#define main chacha20_main
+#include "chacha20.c"
+#undef main
+
+#if KEY_SIZE_BITS != 256
+#error "ChaCha20-Poly1305 is only defined for 256-bit keys"
+#endif
+
+
+/****************
+*** CONSTANTS ***
+****************/
+#define AEAD_CHUNK_SIZE (16 << 10) // Small enough that a chunk is still in the L1/L2 cache when it is MAC'ed
+#define AEAD_MAX_LEN ((uint64_t)64 * UINT32_MAX) // The 32-bit block counter starts at 1, so this is as far as it goes
+
+#define MASK_44 0xFFFFFFFFFFF // The lower 44 bits
+#define MASK_42 0x3FFFFFFFFFF // The lower 42 bits
+
+
+/***************
+*** POLY1305 ***
+***************/
+/*
+ * Poly1305 evaluates the message as a polynomial at the point r, modulo the prime p = 2^130 - 5
+ * Each 16-byte block (with a 1 appended) is a coefficient: h = (h + block) * r mod p, and the tag is h + s mod 2^128
+ * The 130-bit numbers are held as 3 limbs of 44, 44, and 42 bits, so the products of two limbs fit in 128 bits with room to add
+ * Since 2^130 = 5 mod p, the parts of a product above 2^130 wrap around to the bottom multiplied by 5
+ * (which is why the limbs of r are also kept multiplied by 5 * 4, the 4 making up for the 2 bits the top limb is short)
+ */
+typedef unsigned __int128 uint128_t;
+
+/**
+ * A power of r, split into limbs, along with its upper limbs multiplied by 20 (for the wrapped around parts of products)
+ */
+typedef struct {
+    uint64_t r0, r1, r2;
+    uint64_t s1, s2;
+} poly1305_power;
+
+/**
+ * Internal state of a running Poly1305 MAC
+ */
+typedef struct {
+    poly1305_power powers[4]; // r, r^2, r^3, r^4
+    uint64_t h[3]; // The accumulator
+    uint64_t pad[2]; // s, added at the end
+    uint8_t buffer[16]; // Holds the start of a block until the caller has provided all of it
+    size_t buffer_len;
+} poly1305_ctx;
+
+/**
+ * Reads 8 bytes as a 64-bit LITTLE ENDIAN number
+ * @param bytes the bytes to read
+ * @returns the number
+ */
+uint64_t load_le64(const uint8_t *bytes) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+/**
+ * Writes a 64-bit number as 8 bytes in LITTLE ENDIAN
+ * @param bytes (OUTPUT) where the bytes go
+ * @param value the number to write
+ */
+void store_le64(uint8_t *bytes, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        bytes[i] = (uint8_t)(value >> 8*i);
+    }
+}
+
+/**
+ * Sets a power of r from its limbs
+ * @param power (OUTPUT) the power to set
+ * @param r0 the lower 44 bits
+ * @param r1 the middle 44 bits
+ * @param r2 the upper 42 bits
+ */
+void poly1305_set_power(poly1305_power *power, uint64_t r0, uint64_t r1, uint64_t r2) {
+    power->r0 = r0;
+    power->r1 = r1;
+    power->r2 = r2;
+    power->s1 = r1 * 20;
+    power->s2 = r2 * 20;
+}
+
+// Adds the product of h (h0, h1, h2) and a power of r onto the 128-bit columns d0, d1, d2 (any wrap around is folded in)
+#define POLY1305_MUL_ADD(d0, d1, d2, h0, h1, h2, power) \
+    d0 += (uint128_t)(h0) * (power).r0 + (uint128_t)(h1) * (power).s2 + (uint128_t)(h2) * (power).s1; \
+    d1 += (uint128_t)(h0) * (power).r1 + (uint128_t)(h1) * (power).r0 + (uint128_t)(h2) * (power).s2; \
+    d2 += (uint128_t)(h0) * (power).r2 + (uint128_t)(h1) * (power).r1 + (uint128_t)(h2) * (power).r0;
+
+/**
+ * Carries the 128-bit columns back into 44/44/42-bit limbs (the top limb may end up a little over, which is fine)
+ * @param d0 the lowest column
+ * @param d1 the middle column
+ * @param d2 the highest column
+ * @param h (OUTPUT) the 3 limbs
+ */
+void poly1305_carry(uint128_t d0, uint128_t d1, uint128_t d2, uint64_t *h) {
+    uint64_t carry;
+    h[0] = (uint64_t)d0 & MASK_44; carry = (uint64_t)(d0 >> 44);
+    d1 += carry;
+    h[1] = (uint64_t)d1 & MASK_44; carry = (uint64_t)(d1 >> 44);
+    d2 += carry;
+    h[2] = (uint64_t)d2 & MASK_42; carry = (uint64_t)(d2 >> 42);
+    h[0] += carry * 5; // The part above 2^130 wraps around
+    carry = h[0] >> 44;
+    h[0] &= MASK_44;
+    h[1] += carry;
+}
+
+/**
+ * Splits a 16-byte block into limbs, with the 1 bit that is appended to every block (2^128, i.e. bit 40 of the top limb)
+ * @param block the 16 bytes of the block
+ * @param high_bit the appended bit, already shifted into place (only a short final block has it inside its padding instead)
+ * @param m (OUTPUT) the 3 limbs
+ */
+void poly1305_split_block(const uint8_t *block, uint64_t high_bit, uint64_t *m) {
+    uint64_t t0 = load_le64(block);
+    uint64_t t1 = load_le64(block + 8);
+    m[0] = t0 & MASK_44;
+    m[1] = ((t0 >> 44) | (t1 << 20)) & MASK_44;
+    m[2] = ((t1 >> 24) & MASK_42) | high_bit;
+}
+
+/**
+ * Starts a new Poly1305 MAC
+ * @param ctx (OUTPUT) the context to initialize
+ * @param key the 256-bit (32-byte) one time key, r followed by s
+ */
+void poly1305_init(poly1305_ctx *ctx, const uint8_t *key) {
+    // Clamp r (clear the bits the specification requires to be 0), and split it into limbs
+    uint64_t t0 = load_le64(key);
+    uint64_t t1 = load_le64(key + 8);
+    poly1305_set_power(&ctx->powers[0], t0 & 0xFFC0FFFFFFF, ((t0 >> 44) | (t1 << 20)) & 0xFFFFFC0FFFF, (t1 >> 24) & 0x00FFFFFFC0F);
+
+    // r^2, r^3, r^4 for the 4 block path
+    for (int i = 1; i < 4; i++) {
+        uint128_t d0 = 0, d1 = 0, d2 = 0;
+        uint64_t power[3];
+        POLY1305_MUL_ADD(d0, d1, d2, ctx->powers[i - 1].r0, ctx->powers[i - 1].r1, ctx->powers[i - 1].r2, ctx->powers[0])
+        poly1305_carry(d0, d1, d2, power);
+        poly1305_set_power(&ctx->powers[i], power[0], power[1], power[2]);
+    }
+
+    ctx->h[0] = ctx->h[1] = ctx->h[2] = 0;
+    ctx->pad[0] = load_le64(key + 16);
+    ctx->pad[1] = load_le64(key + 24);
+    ctx->buffer_len = 0;
+}
+
+/**
+ * Absorbs whole 16-byte blocks into the accumulator
+ * Groups of 4 blocks are done with one pass of Horner's rule over 4 coefficients: h = (h + m1)*r^4 + m2*r^3 + m3*r^2 + m4*r,
+ * which gives 4 independent multiplications (that the processor can overlap) and only 1 carry chain, instead of 4 of each
+ * @param ctx (IN/OUT) the context of the MAC
+ * @param blocks the blocks
+ * @param num_blocks the number of blocks
+ * @param high_bit the appended bit (1 << 40), or 0 for a short final block that has been padded with its 1 already
+ */
+void poly1305_blocks(poly1305_ctx *ctx, const uint8_t *blocks, size_t num_blocks, uint64_t high_bit) {
+    uint64_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2];
+    uint64_t h[3];
+
+    for (; num_blocks >= 4; num_blocks -= 4, blocks += 64) {
+        uint64_t m[4][3];
+        for (int i = 0; i < 4; i++) {
+            poly1305_split_block(blocks + 16*i, high_bit, m[i]);
+        }
+        uint128_t d0 = 0, d1 = 0, d2 = 0;
+        POLY1305_MUL_ADD(d0, d1, d2, h0 + m[0][0], h1 + m[0][1], h2 + m[0][2], ctx->powers[3])
+        POLY1305_MUL_ADD(d0, d1, d2, m[1][0], m[1][1], m[1][2], ctx->powers[2])
+        POLY1305_MUL_ADD(d0, d1, d2, m[2][0], m[2][1], m[2][2], ctx->powers[1])
+        POLY1305_MUL_ADD(d0, d1, d2, m[3][0], m[3][1], m[3][2], ctx->powers[0])
+        poly1305_carry(d0, d1, d2, h);
+        h0 = h[0]; h1 = h[1]; h2 = h[2];
+    }
+
+    for (; num_blocks > 0; num_blocks--, blocks += 16) {
+        uint64_t m[3];
+        poly1305_split_block(blocks, high_bit, m);
+        uint128_t d0 = 0, d1 = 0, d2 = 0;
+        POLY1305_MUL_ADD(d0, d1, d2, h0 + m[0], h1 + m[1], h2 + m[2], ctx->powers[0])
+        poly1305_carry(d0, d1, d2, h);
+        h0 = h[0]; h1 = h[1]; h2 = h[2];
+    }
+
+    ctx->h[0] = h0; ctx->h[1] = h1; ctx->h[2] = h2;
+}
+
+/**
+ * Adds more of the message to a running MAC
+ * @param ctx (IN/OUT) the context of the MAC
+ * @param msg the next piece of the message
+ * @param len the length of msg in BYTES
+ */
+void poly1305_update(poly1305_ctx *ctx, const uint8_t *msg, size_t len) {
+    // Top up a partially filled block from a previous call first
+    if (ctx->buffer_len > 0) {
+        size_t taken = (len < 16 - ctx->buffer_len) ? len : 16 - ctx->buffer_len;
+        memcpy(ctx->buffer + ctx->buffer_len, msg, taken);
+        ctx->buffer_len += taken;
+        msg += taken;
+        len -= taken;
+        if (ctx->buffer_len < 16) {
+            return;
+        }
+        poly1305_blocks(ctx, ctx->buffer, 1, (uint64_t)1 << 40);
+        ctx->buffer_len = 0;
+    }
+
+    poly1305_blocks(ctx, msg, len / 16, (uint64_t)1 << 40);
+    memcpy(ctx->buffer, msg + (len & ~(size_t)15), len % 16);
+    ctx->buffer_len = len % 16;
+}
+
+/**
+ * Finishes a MAC, by absorbing the final partial block and adding s
+ * @param ctx (IN/OUT) the context of the MAC, must be re-initialized before being used again
+ * @param tag (OUTPUT) the 128-bit (16-byte) tag
+ */
+void poly1305_final(poly1305_ctx *ctx, uint8_t *tag) {
+    // A short final block has its 1 appended right after it, then is padded with 0s
+    if (ctx->buffer_len > 0) {
+        ctx->buffer[ctx->buffer_len] = 1;
+        memset(ctx->buffer + ctx->buffer_len + 1, 0, 15 - ctx->buffer_len);
+        poly1305_blocks(ctx, ctx->buffer, 1, 0);
+    }
+
+    // Fully carry h, then reduce it mod p by subtracting p if h >= p (computed without branching on h)
+    uint64_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2];
+    uint64_t carry;
+    carry = h1 >> 44; h1 &= MASK_44; h2 += carry;
+    carry = h2 >> 42; h2 &= MASK_42; h0 += carry * 5;
+    carry = h0 >> 44; h0 &= MASK_44; h1 += carry;
+    carry = h1 >> 44; h1 &= MASK_44; h2 += carry;
+    carry = h2 >> 42; h2 &= MASK_42; h0 += carry * 5;
+    carry = h0 >> 44; h0 &= MASK_44; h1 += carry;
+
+    uint64_t g0 = h0 + 5; carry = g0 >> 44; g0 &= MASK_44;
+    uint64_t g1 = h1 + carry; carry = g1 >> 44; g1 &= MASK_44;
+    uint64_t g2 = h2 + carry - ((uint64_t)1 << 42);
+    uint64_t mask = (g2 >> 63) - 1; // All 1s if h + 5 - 2^130 did not go negative (h >= p), so g = h - p is the result
+    h0 = (h0 & ~mask) | (g0 & mask);
+    h1 = (h1 & ~mask) | (g1 & mask);
+    h2 = (h2 & ~mask) | (g2 & mask);
+
+    // tag = h + s mod 2^128
+    uint64_t low = h0 | (h1 << 44);
+    uint64_t high = (h1 >> 20) | (h2 << 24);
+    uint128_t sum = (uint128_t)low + ctx->pad[0];
+    low = (uint64_t)sum;
+    high = high + ctx->pad[1] + (uint64_t)(sum >> 64);
+    store_le64(tag, low);
+    store_le64(tag + 8, high);
+}
+
+/**
+ * Computes the Poly1305 MAC of a message
+ * @param msg the message
+ * @param len the length of msg in BYTES
+ * @param key the 256-bit (32-byte) one time key (never use a key for more than one message)
+ * @param tag (OUTPUT) the 128-bit (16-byte) tag
+ */
+void poly1305(const uint8_t *msg, size_t len, const uint8_t *key, uint8_t *tag) {
+    poly1305_ctx ctx;
+    poly1305_init(&ctx, key);
+    poly1305_update(&ctx, msg, len);
+    poly1305_final(&ctx, tag);
+}
+
+
+/***********
+*** AEAD ***
+***********/
+/**
+ * Sets up the state for the IETF layout of ChaCha20: a 32-bit block counter and a 96-bit nonce
+ * (This is the same state as the original layout, with the upper 32 bits of the position used as the first word of the nonce)
+ * @param key the 256-bit (32-byte) key
+ * @param nonce the 96-bit (12-byte) nonce
+ * @param counter the block counter to start at
+ * @param state (OUTPUT) the internal state of the cipher
+ */
+void chacha20_ietf_init(const uint8_t *key, const uint8_t *nonce, uint32_t counter, uint32_t *state) {
+    uint32_t key_words[8];
+    uint32_t position[2];
+    uint32_t nonce_words[2];
+    memcpy(key_words, key, 32);
+    position[0] = counter;
+    memcpy(&position[1], nonce, 4);
+    memcpy(nonce_words, nonce + 4, 8);
+    chacha20_init(key_words, nonce_words, position, state);
+}
+
+/**
+ * Starts the MAC of an AEAD message: derives the one time Poly1305 key from block 0 of the keystream, and MACs the associated data
+ * @param key the 256-bit (32-byte) key
+ * @param nonce the 96-bit (12-byte) nonce
+ * @param aad the associated data (authenticated but not encrypted)
+ * @param aad_len the length of aad in BYTES
+ * @param mac (OUTPUT) the MAC, ready for the ciphertext
+ * @param state (OUTPUT) the state of the cipher, at block 1 where the message starts
+ */
+void aead_start(const uint8_t *key, const uint8_t *nonce, const uint8_t *aad, size_t aad_len,
+                poly1305_ctx *mac, uint32_t *state) {
+    uint32_t block_zero[16];
+    chacha20_ietf_init(key, nonce, 0, state);
+    chacha20_block(state, block_zero);
+    poly1305_init(mac, (uint8_t*)block_zero); // The first 32 bytes of the keystream
+    memset(block_zero, 0, sizeof(block_zero));
+    chacha20_advance(state, 1);
+
+    uint8_t zeros[16] = {0};
+    poly1305_update(mac, aad, aad_len);
+    poly1305_update(mac, zeros, (16 - aad_len % 16) % 16);
+}
+
+/**
+ * Finishes the MAC of an AEAD message: pads the ciphertext, and MACs the lengths
+ * @param mac (IN/OUT) the MAC
+ * @param aad_len the length of the associated data in BYTES
+ * @param len the length of the ciphertext in BYTES
+ * @param tag (OUTPUT) the 128-bit (16-byte) tag
+ */
+void aead_finish(poly1305_ctx *mac, size_t aad_len, size_t len, uint8_t *tag) {
+    uint8_t zeros[16] = {0};
+    uint8_t lengths[16];
+    poly1305_update(mac, zeros, (16 - len % 16) % 16);
+    store_le64(lengths, aad_len);
+    store_le64(lengths + 8, len);
+    poly1305_update(mac, lengths, 16);
+    poly1305_final(mac, tag);
+}
+
+/**
+ * Encrypts and authenticates a message with ChaCha20-Poly1305
+ * @param plaintext the message to encrypt
+ * @param len the length of the message in BYTES (at most AEAD_MAX_LEN)
+ * @param aad the associated data (authenticated but not encrypted, e.g. a packet header)
+ * @param aad_len the length of aad in BYTES
+ * @param key the 256-bit (32-byte) key
+ * @param nonce the 96-bit (12-byte) nonce (never use a nonce more than once with the same key)
+ * @param ciphertext (OUTPUT) the encrypted message, the same length as the plaintext (may be the same as plaintext)
+ * @param tag (OUTPUT) the 128-bit (16-byte) authentication tag
+ * @returns 0 on success, or -1 if the message is too long
+ */
+int chacha20_poly1305_encrypt(const uint8_t *plaintext, size_t len, const uint8_t *aad, size_t aad_len,
+                              const uint8_t *key, const uint8_t *nonce, uint8_t *ciphertext, uint8_t *tag) {
+    if ((uint64_t)len > AEAD_MAX_LEN) {
+        return -1;
+    }
+    poly1305_ctx mac;
+    uint32_t state[16];
+    aead_start(key, nonce, aad, aad_len, &mac, state);
+
+    // Encrypt each chunk, then MAC its ciphertext while it is still in the cache
+    for (size_t pos = 0; pos < len; pos += AEAD_CHUNK_SIZE) {
+        size_t chunk_len = (len - pos < AEAD_CHUNK_SIZE) ? len - pos : AEAD_CHUNK_SIZE;
+        chacha20_apply(state, plaintext + pos, chunk_len, ciphertext + pos);
+        poly1305_update(&mac, ciphertext + pos, chunk_len);
+    }
+
+    aead_finish(&mac, aad_len, len, tag);
+    memset(state, 0, sizeof(state));
+    return 0;
+}
+
+/**
+ * Authenticates and decrypts a message with ChaCha20-Poly1305
+ * Nothing is given back if the tag does not match, the plaintext is wiped
+ * @param ciphertext the message to decrypt
+ * @param len the length of the message in BYTES (at most AEAD_MAX_LEN)
+ * @param aad the associated data (must be exactly what was given when encrypting)
+ * @param aad_len the length of aad in BYTES
+ * @param key the 256-bit (32-byte) key
+ * @param nonce the 96-bit (12-byte) nonce
+ * @param tag the 128-bit (16-byte) authentication tag
+ * @param plaintext (OUTPUT) the decrypted message, the same length as the ciphertext (may be the same as ciphertext)
+ * @returns 0 if the message is authentic, or -1 if it is not (or is too long)
+ */
+int chacha20_poly1305_decrypt(const uint8_t *ciphertext, size_t len, const uint8_t *aad, size_t aad_len,
+                              const uint8_t *key, const uint8_t *nonce, const uint8_t *tag, uint8_t *plaintext) {
+    if ((uint64_t)len > AEAD_MAX_LEN) {
+        return -1;
+    }
+    poly1305_ctx mac;
+    uint32_t state[16];
+    aead_start(key, nonce, aad, aad_len, &mac, state);
+
+    // MAC each chunk of ciphertext, then decrypt it while it is still in the cache
+    for (size_t pos = 0; pos < len; pos += AEAD_CHUNK_SIZE) {
+        size_t chunk_len = (len - pos < AEAD_CHUNK_SIZE) ? len - pos : AEAD_CHUNK_SIZE;
+        poly1305_update(&mac, ciphertext + pos, chunk_len);
+        chacha20_apply(state, ciphertext + pos, chunk_len, plaintext + pos);
+    }
+
+    uint8_t expected_tag[16];
+    aead_finish(&mac, aad_len, len, expected_tag);
+    memset(state, 0, sizeof(state));
+
+    // Compare every byte (rather than stopping at the first difference), so the time taken does not reveal how much matched
+    uint8_t difference = 0;
+    for (int i = 0; i < 16; i++) {
+        difference |= expected_tag[i] ^ tag[i];
+    }
+    if (difference != 0) {
+        memset(plaintext, 0, len);
+        return -1;
+    }
+    return 0;
+}
+
+
+/**************
+*** TESTING ***
+**************/
+/**
+ * Parses a hex string into bytes
+ * @param hex the hex string
+ * @param bytes (OUTPUT) the bytes, half as many as there are hex digits
+ */
+void parse_hex(const char *hex, uint8_t *bytes) {
+    for (size_t i = 0; hex[2*i] != '\0'; i++) {
+        sscanf(&hex[2*i], "%2hhx", &bytes[i]);
+    }
+}
+
+// Test examples: https://www.rfc-editor.org/rfc/rfc8439 (Sections 2.5.2 and 2.8.2)
+int main(int argc, char **argv) {
+    // Poly1305 by itself
+    uint8_t poly_key[32];
+    uint8_t poly_tag[16];
+    uint8_t poly_expected[16];
+    const char *poly_msg = "Cryptographic Forum Research Group";
+    parse_hex("85d6be7857556d337f4452fe42d506a80103808afb0db2fd4abff6af4149f51b", poly_key);
+    parse_hex("a8061dc1305136c6c22b8baf0c0127a9", poly_expected);
+    poly1305((const uint8_t*)poly_msg, strlen(poly_msg), poly_key, poly_tag);
+    if (memcmp(poly_tag, poly_expected, 16) != 0) {
+        printf("ERROR: Poly1305 tag is NOT correct!\n");
+    }
+
+    // The AEAD example
+    const char *plaintext = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, sunscreen would be it.";
+    size_t len = strlen(plaintext);
+    uint8_t key[32], nonce[12], aad[12], tag[16], expected_tag[16], expected_start[16];
+    uint8_t ciphertext[len], decrypted[len];
+    parse_hex("808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f", key);
+    parse_hex("070000004041424344454647", nonce);
+    parse_hex("50515253c0c1c2c3c4c5c6c7", aad);
+    parse_hex("1ae10b594f09e26a7e902ecbd0600691", expected_tag);
+    parse_hex("d31a8d34648e60db7b86afbc53ef7ec2", expected_start);
+
+    chacha20_poly1305_encrypt((const uint8_t*)plaintext, len, aad, 12, key, nonce, ciphertext, tag);
+    printf("plaintext  = %s\n", plaintext);
+    printf("ciphertext = ");
+    print_hex(ciphertext, len);
+    printf("tag        = ");
+    print_hex(tag, 16);
+    if (memcmp(ciphertext, expected_start, 16) != 0 || memcmp(tag, expected_tag, 16) != 0) {
+        printf("ERROR: AEAD ciphertext or tag is NOT correct!\n");
+    }
+    if (chacha20_poly1305_decrypt(ciphertext, len, aad, 12, key, nonce, tag, decrypted) != 0 ||
+        memcmp(decrypted, plaintext, len) != 0) {
+        printf("ERROR: AEAD decryption did NOT give back the plaintext!\n");
+    }
+
+    // Sanity check a changed ciphertext, associated data, or tag is rejected
+    ciphertext[len - 1] ^= 1;
+    if (chacha20_poly1305_decrypt(ciphertext, len, aad, 12, key, nonce, tag, decrypted) == 0) {
+        printf("ERROR: AEAD decryption of a changed ciphertext was NOT rejected!\n");
+    }
+    ciphertext[len - 1] ^= 1;
+    aad[0] ^= 1;
+    if (chacha20_poly1305_decrypt(ciphertext, len, aad, 12, key, nonce, tag, decrypted) == 0) {
+        printf("ERROR: AEAD decryption with changed associated data was NOT rejected!\n");
+    }
+    aad[0] ^= 1;
+    tag[15] ^= 0x80;
+    if (chacha20_poly1305_decrypt(ciphertext, len, aad, 12, key, nonce, tag, decrypted) == 0) {
+        printf("ERROR: AEAD decryption with a changed tag was NOT rejected!\n");
+    }
+
+    // Sanity check the 4 block path against 1 block at a time (feeding exactly 16 bytes per call never fills a group of 4),
+    // and a MAC fed in uneven pieces against all at once
+    size_t long_len = 3*AEAD_CHUNK_SIZE + 77;
+    uint8_t *long_msg = malloc(long_len);
+    for (size_t i = 0; i < long_len; i++) {
+        long_msg[i] = i * 31;
+    }
+    poly1305_ctx ctx;
+    uint8_t single_block_tag[16];
+    uint8_t pieces_tag[16];
+    poly1305(long_msg, long_len, poly_key, poly_tag);
+    poly1305_init(&ctx, poly_key);
+    for (size_t pos = 0; pos < long_len; pos += 16) {
+        poly1305_update(&ctx, long_msg + pos, (pos + 16 < long_len) ? 16 : long_len - pos);
+    }
+    poly1305_final(&ctx, single_block_tag);
+    if (memcmp(poly_tag, single_block_tag, 16) != 0) {
+        printf("ERROR: Poly1305 tag computed 4 blocks at a time and 1 block at a time are NOT the same!\n");
+    }
+    poly1305_init(&ctx, poly_key);
+    for (size_t pos = 0, piece = 1; pos < long_len; pos += piece, piece = piece*2 + 3) {
+        poly1305_update(&ctx, long_msg + pos, (pos + piece < long_len) ? piece : long_len - pos);
+    }
+    poly1305_final(&ctx, pieces_tag);
+    if (memcmp(poly_tag, pieces_tag, 16) != 0) {
+        printf("ERROR: Poly1305 tag of a message fed in pieces is NOT the same!\n");
+    }
+    free(long_msg);
+
+    // Compare encrypting then MAC'ing each chunk against encrypting everything and then MAC'ing it when run as "./chacha20_poly1305 benchmark"
+    if (argc > 1 && strcmp(argv[1], "benchmark") == 0) {
+        size_t bench_len = 64 << 20;
+        uint8_t *bench_data = calloc(bench_len, 1);
+        for (int fused = 0; fused < 2; fused++) {
+            double best = 0;
+            for (int run = 0; run < 3; run++) {
+                struct timespec start, end;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                if (fused) {
+                    chacha20_poly1305_encrypt(bench_data, bench_len, aad, 12, key, nonce, bench_data, tag);
+                }
+                else {
+                    uint32_t state[16];
+                    aead_start(key, nonce, aad, 12, &ctx, state);
+                    chacha20_apply(state, bench_data, bench_len, bench_data);
+                    poly1305_update(&ctx, bench_data, bench_len);
+                    aead_finish(&ctx, 12, bench_len, tag);
+                }
+                clock_gettime(CLOCK_MONOTONIC, &end);
+
+                double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+                best = (bench_len / seconds > best) ? bench_len / seconds : best;
+            }
+            printf("%-32s %8.1f MB/s\n", fused ? "Chunked (one pass)" : "Encrypt, then MAC (two passes)", best / 1e6);
+        }
+        free(bench_data);
+    }
+
+    return 0;
+}
@@ -0,0 +1,430 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/random.h>
+
+
+/**
+ * A cryptographically secure random number generator (CSPRNG) built on the ChaCha20 keystream
+ * The OS is only asked for a 256-bit seed, after that every random byte comes from ChaCha20 under a key that keeps changing:
+ * each refill of the buffer generates a batch of blocks at once (with the multi-block keystream functions), and the first
+ * 32 bytes of the batch become the key for the next refill ("fast key erasure"), so the key that made any bytes that have
+ * already been handed out no longer exists anywhere (and bytes are wiped from the buffer as they are handed out)
+ * Every thread has its own generator, so no locks are needed
+ */
+
+
+/***************
+*** CHACHA20 ***
+***************/
+#define main chacha20_main
+#include "chacha20.c"
+#undef main
+
+
+/****************
+*** CONSTANTS ***
+****************/
+#define RNG_BUFFER_BLOCKS 16 // A whole batch for the widest multi-block function (or two for AVX2, four for SSE2)
+#define RNG_BUFFER_SIZE (64 * RNG_BUFFER_BLOCKS)
+#define RNG_KEY_SIZE 32 // The start of every refill is the next key, and is never handed out
+
+
+/****************
+*** GENERATOR ***
+****************/
+/**
+ * The generator of one thread
+ */
+typedef struct {
+    uint8_t buffer[RNG_BUFFER_SIZE]; // Random bytes waiting to be handed out (the ones before pos have been wiped)
+    size_t pos; // The next byte of buffer to hand out
+    uint32_t key[8]; // The key for the next refill
+    int seeded; // 0 until the key has been seeded by the OS
+    unsigned int fork_generation; // The value of rng_fork_generation when the key was seeded
+} rng_state;
+
+_Thread_local rng_state rng;
+
+// Bumped in the child after a fork(), so the child does not hand out the same bytes as its parent
+// (Only written in a child process, where the forking thread is the only one, so it does not need to be atomic)
+unsigned int rng_fork_generation = 0;
+pthread_once_t rng_atfork_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Marks every generator as needing a new seed, called in the child process after a fork()
+ */
+void rng_after_fork() {
+    rng_fork_generation++;
+}
+
+/**
+ * Registers rng_after_fork with pthread_atfork
+ */
+void rng_register_atfork() {
+    pthread_atfork(NULL, NULL, rng_after_fork);
+}
+
+/**
+ * Refills the buffer with a new batch of keystream, and replaces the key with the start of it
+ * @param state (IN/OUT) the generator of the calling thread
+ */
+void rng_refill(rng_state *state) {
+    uint32_t cipher_state[16];
+    uint32_t nonce[2] = {0, 0};
+    uint32_t position[2] = {0, 0};
+    chacha20_init(state->key, nonce, position, cipher_state); // A new key every time, so the nonce and position can always be 0
+
+    // The keystream is XOR'ed with 0s, which leaves just the keystream
+    memset(state->buffer, 0, RNG_BUFFER_SIZE);
+    chacha20_apply(cipher_state, state->buffer, RNG_BUFFER_SIZE, state->buffer);
+
+    // Fast key erasure: the old key is overwritten by the start of its own output (which is then wiped from the buffer)
+    memcpy(state->key, state->buffer, RNG_KEY_SIZE);
+    memset(state->buffer, 0, RNG_KEY_SIZE);
+    memset(cipher_state, 0, sizeof(cipher_state));
+    state->pos = RNG_KEY_SIZE;
+}
+
+/**
+ * Seeds a generator with the given 256-bit key, and fills its buffer
+ * (Only for testing, every thread seeds itself from the OS the first time it needs random bytes)
+ * @param state (OUTPUT) the generator to seed
+ * @param seed the 256-bit (32-byte) seed
+ */
+void rng_seed(rng_state *state, const uint8_t *seed) {
+    memcpy(state->key, seed, RNG_KEY_SIZE);
+    state->seeded = 1;
+    state->fork_generation = rng_fork_generation;
+    rng_refill(state);
+}
+
+/**
+ * Seeds a generator from the OS, and fills its buffer
+ * The program is stopped if the OS can not provide a seed, since carrying on would hand out predictable "random" values
+ * @param state (OUTPUT) the generator to seed
+ */
+void rng_seed_from_os(rng_state *state) {
+    pthread_once(&rng_atfork_once, rng_register_atfork);
+    uint8_t seed[RNG_KEY_SIZE];
+    if (getentropy(seed, sizeof(seed)) != 0) {
+        fprintf(stderr, "ERROR: Could not get a seed for the random number generator from the OS!\n");
+        abort();
+    }
+    rng_seed(state, seed);
+    memset(seed, 0, sizeof(seed));
+}
+
+/**
+ * Makes sure the calling thread's generator has at least the given number of bytes ready to hand out
+ * @param num_bytes the number of bytes needed (at most RNG_BUFFER_SIZE - RNG_KEY_SIZE)
+ * @returns the generator of the calling thread
+ */
+rng_state* rng_ready(size_t num_bytes) {
+    rng_state *state = &rng;
+    if (__builtin_expect(!state->seeded || state->fork_generation != rng_fork_generation, 0)) {
+        rng_seed_from_os(state);
+    }
+    else if (__builtin_expect(state->pos + num_bytes > RNG_BUFFER_SIZE, 0)) {
+        rng_refill(state);
+    }
+    return state;
+}
+
+
+/******************
+*** RANDOM APIS ***
+******************/
+/**
+ * Fills a buffer with random bytes
+ * @param output (OUTPUT) where the random bytes go
+ * @param len the number of random bytes in BYTES
+ */
+void random_bytes(uint8_t *output, size_t len) {
+    // Large requests are generated straight into the output (from a key taken out of the buffer), rather than copied through the buffer
+    if (len >= RNG_BUFFER_SIZE) {
+        rng_state *state = rng_ready(RNG_KEY_SIZE);
+        uint32_t key[8];
+        uint32_t cipher_state[16];
+        uint32_t nonce[2] = {0, 0};
+        uint32_t position[2] = {0, 0};
+        memcpy(key, state->buffer + state->pos, RNG_KEY_SIZE);
+        memset(state->buffer + state->pos, 0, RNG_KEY_SIZE);
+        state->pos += RNG_KEY_SIZE;
+
+        chacha20_init(key, nonce, position, cipher_state);
+        memset(output, 0, len);
+        chacha20_apply(cipher_state, output, len, output);
+        memset(key, 0, sizeof(key));
+        memset(cipher_state, 0, sizeof(cipher_state));
+        return;
+    }
+
+    while (len > 0) {
+        rng_state *state = rng_ready(1);
+        size_t available = RNG_BUFFER_SIZE - state->pos;
+        size_t num_bytes = (len < available) ? len : available;
+        memcpy(output, state->buffer + state->pos, num_bytes);
+        memset(state->buffer + state->pos, 0, num_bytes);
+        state->pos += num_bytes;
+        output += num_bytes;
+        len -= num_bytes;
+    }
+}
+
+/**
+ * Gets a random 64-bit number
+ * (If fewer than 8 bytes are left in the buffer, they are skipped, and wiped by the refill)
+ * @returns the random number
+ */
+uint64_t random_u64() {
+    rng_state *state = rng_ready(8);
+    uint64_t value;
+    memcpy(&value, state->buffer + state->pos, 8);
+    memset(state->buffer + state->pos, 0, 8);
+    state->pos += 8;
+    return value;
+}
+
+/**
+ * Gets a random number from 0 up to (but not including) bound, with every number equally likely
+ * Multiplying a random 64-bit number by bound puts the result in the upper 64 bits of the 128-bit product,
+ * and the few products whose lower 64 bits fall in the (2^64 mod bound) values that would make some results more likely
+ * than others are thrown away and tried again (Lemire's method, which usually needs no division at all)
+ * @param bound one more than the largest number wanted
+ * @returns the random number, or 0 if bound is 0
+ */
+uint64_t random_uniform(uint64_t bound) {
+    unsigned __int128 product = (unsigned __int128)random_u64() * bound;
+    uint64_t low = (uint64_t)product;
+    if (low < bound) {
+        uint64_t threshold = -bound % bound; // 2^64 mod bound
+        while (low < threshold) {
+            product = (unsigned __int128)random_u64() * bound;
+            low = (uint64_t)product;
+        }
+    }
+    return (uint64_t)(product >> 64);
+}
+
+/**
+ * Gets a random number from min to max (both included), with every number equally likely
+ * @param min the smallest number wanted
+ * @param max the largest number wanted (at least min)
+ * @returns the random number
+ */
+int64_t random_range(int64_t min, int64_t max) {
+    uint64_t span = (uint64_t)max - (uint64_t)min;
+    if (span == UINT64_MAX) {
+        return (int64_t)random_u64(); // Every 64-bit number, so there is nothing to bound
+    }
+    return (int64_t)((uint64_t)min + random_uniform(span + 1));
+}
+
+
+/**************
+*** TESTING ***
+**************/
+/**
+ * A thread for the test, which gets a few random numbers from its own generator
+ * @param arg where to put the numbers (4 64-bit numbers)
+ * @returns NULL
+ */
+void* rng_test_thread(void *arg) {
+    uint64_t *values = arg;
+    for (int i = 0; i < 4; i++) {
+        values[i] = random_u64();
+    }
+    return NULL;
+}
+
+/**
+ * A thread for the benchmark, which gets random 64-bit numbers as fast as it can
+ * @param arg how many numbers to get (a pointer to a size_t), replaced with a checksum so the work is not optimized away
+ * @returns NULL
+ */
+void* rng_benchmark_thread(void *arg) {
+    size_t count = *(size_t*)arg;
+    uint64_t checksum = 0;
+    for (size_t i = 0; i < count; i++) {
+        checksum ^= random_u64();
+    }
+    *(size_t*)arg = (size_t)checksum;
+    return NULL;
+}
+
+/**
+ * Gets the time in seconds
+ * @returns the time from a monotonic clock
+ */
+double now_seconds() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    // Sanity check the output against ChaCha20 with fast key erasure done by hand, starting from a known seed
+    // (Each refill's first 32 bytes are the next key, and the rest is handed out in order)
+    uint8_t seed[32];
+    for (int i = 0; i < 32; i++) {
+        seed[i] = i;
+    }
+    rng_seed(&rng, seed);
+
+    uint8_t actual[3 * RNG_BUFFER_SIZE];
+    uint8_t expected[3 * RNG_BUFFER_SIZE];
+    uint8_t keystream[RNG_BUFFER_SIZE];
+    uint8_t zeros[RNG_BUFFER_SIZE] = {0};
+    uint32_t key[8];
+    size_t expected_len = 0;
+    memcpy(key, seed, 32);
+    for (int refill = 0; refill < 3; refill++) {
+        uint32_t nonce[2] = {0, 0};
+        chacha20_at(zeros, RNG_BUFFER_SIZE, key, nonce, 0, keystream);
+        memcpy(key, keystream, 32);
+        memcpy(expected + expected_len, keystream + RNG_KEY_SIZE, RNG_BUFFER_SIZE - RNG_KEY_SIZE);
+        expected_len += RNG_BUFFER_SIZE - RNG_KEY_SIZE;
+    }
+
+    // Uneven pieces, so some of them span a refill
+    size_t actual_len = 0;
+    for (size_t piece = 1; actual_len < expected_len; piece = piece * 3 + 1) {
+        size_t piece_len = (piece % RNG_BUFFER_SIZE < expected_len - actual_len) ? piece % RNG_BUFFER_SIZE : expected_len - actual_len;
+        random_bytes(actual + actual_len, piece_len);
+        actual_len += piece_len;
+    }
+    if (memcmp(actual, expected, expected_len) != 0) {
+        printf("ERROR: Random bytes are NOT the ChaCha20 keystream with fast key erasure!\n");
+    }
+
+    // The same again 8 bytes at a time (the bytes handed out from each refill are a multiple of 8, so none are skipped)
+    rng_seed(&rng, seed);
+    for (actual_len = 0; actual_len < expected_len; actual_len += 8) {
+        uint64_t value = random_u64();
+        memcpy(actual + actual_len, &value, 8);
+    }
+    if (memcmp(actual, expected, expected_len) != 0) {
+        printf("ERROR: Random 64-bit numbers are NOT the ChaCha20 keystream with fast key erasure!\n");
+    }
+
+    // Sanity check handed out bytes (and the key at the start of the batch) do not stay in the buffer
+    random_u64();
+    for (size_t i = 0; i < rng.pos; i++) {
+        if (rng.buffer[i] != 0) {
+            printf("ERROR: Random bytes that were handed out are still in the buffer!\n");
+            break;
+        }
+    }
+
+    // Sanity check bounded numbers stay in bounds and every value comes up about as often as the others
+    int counts[6] = {0};
+    int num_draws = 600000;
+    for (int i = 0; i < num_draws; i++) {
+        uint64_t value = random_uniform(6);
+        if (value >= 6) {
+            printf("ERROR: Random number %llu is NOT less than the bound!\n", (unsigned long long)value);
+            break;
+        }
+        counts[value]++;
+    }
+    for (int i = 0; i < 6; i++) {
+        if (counts[i] < num_draws / 6 * 0.98 || counts[i] > num_draws / 6 * 1.02) {
+            printf("ERROR: Random number %d came up %d times out of %d, which is NOT close to uniform!\n", i, counts[i], num_draws);
+        }
+    }
+    for (int i = 0; i < 1000; i++) {
+        int64_t value = random_range(-3, 3);
+        if (value < -3 || value > 3) {
+            printf("ERROR: Random number %lld is NOT in the range!\n", (long long)value);
+            break;
+        }
+    }
+    if (random_uniform(0) != 0 || random_uniform(1) != 0 || random_range(7, 7) != 7) {
+        printf("ERROR: Random numbers with only one possible value are NOT that value!\n");
+    }
+
+    // Sanity check a large request (generated straight into the output) is not all 0s, and two of them are different
+    size_t large_len = 5 * RNG_BUFFER_SIZE + 3;
+    uint8_t *large_a = malloc(large_len);
+    uint8_t *large_b = malloc(large_len);
+    random_bytes(large_a, large_len);
+    random_bytes(large_b, large_len);
+    if (memcmp(large_a, large_b, large_len) == 0 || memcmp(large_a + large_len - 32, zeros, 32) == 0) {
+        printf("ERROR: Large random requests are NOT random!\n");
+    }
+    free(large_a);
+    free(large_b);
+
+    // Sanity check every thread gets its own numbers (seeded from the OS)
+    pthread_t threads[4];
+    uint64_t thread_values[4][4];
+    for (int i = 0; i < 4; i++) {
+        pthread_create(&threads[i], NULL, rng_test_thread, thread_values[i]);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < 4; i++) {
+        for (int j = i + 1; j < 4; j++) {
+            if (memcmp(thread_values[i], thread_values[j], sizeof(thread_values[i])) == 0) {
+                printf("ERROR: Threads %d and %d got the same random numbers!\n", i, j);
+            }
+        }
+    }
+
+    // Time each kind of request, and random_u64 on several threads at once, when run as "./chacha20_rng benchmark"
+    if (argc > 1 && strcmp(argv[1], "benchmark") == 0) {
+        size_t count = 100000000;
+        uint64_t checksum = 0;
+        double start = now_seconds();
+        for (size_t i = 0; i < count; i++) {
+            checksum ^= random_u64();
+        }
+        printf("random_u64            %8.1f M/s\n", count / (now_seconds() - start) / 1e6);
+
+        start = now_seconds();
+        for (size_t i = 0; i < count; i++) {
+            checksum ^= random_uniform(1000000007);
+        }
+        printf("random_uniform        %8.1f M/s\n", count / (now_seconds() - start) / 1e6);
+
+        size_t bench_len = 64 << 20;
+        uint8_t *bench_buffer = malloc(bench_len);
+        uint8_t small[16];
+        start = now_seconds();
+        for (size_t pos = 0; pos < bench_len; pos += sizeof(small)) {
+            random_bytes(small, sizeof(small));
+            checksum ^= small[0];
+        }
+        printf("random_bytes (16 B)   %8.1f MB/s\n", bench_len / (now_seconds() - start) / 1e6);
+        start = now_seconds();
+        random_bytes(bench_buffer, bench_len);
+        printf("random_bytes (64 MiB) %8.1f MB/s\n", bench_len / (now_seconds() - start) / 1e6);
+        checksum ^= bench_buffer[bench_len - 1];
+        free(bench_buffer);
+
+        long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = (num_threads < 1) ? 1 : ((num_threads > MAX_THREADS) ? MAX_THREADS : num_threads);
+        pthread_t bench_threads[MAX_THREADS];
+        size_t thread_counts[MAX_THREADS];
+        start = now_seconds();
+        for (long i = 0; i < num_threads; i++) {
+            thread_counts[i] = count;
+            pthread_create(&bench_threads[i], NULL, rng_benchmark_thread, &thread_counts[i]);
+        }
+        for (long i = 0; i < num_threads; i++) {
+            pthread_join(bench_threads[i], NULL);
+            checksum ^= thread_counts[i];
+        }
+        printf("random_u64 x %-2ld       %8.1f M/s\n", num_threads, num_threads * count / (now_seconds() - start) / 1e6);
+        printf("(checksum %016llx)\n", (unsigned long long)checksum);
+    }
+
+    return 0;
+}
@@ -1,75 +1,10 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdlib.h>
+#include <time.h>
 
-
-#define KEY_SIZE_BITS 256 // Can be 256 or 128
-#define NUM_ROUNDS 20 // Can be 20, 12, or 8
-
-
-/****************************
-*** INNER ROUND FUNCTIONS ***
-****************************/
-/**
- * Rotation to the left (ROTL), which rotates the given value by n bytes
- * @param value 32-bit word to rotate
- * @param shift integer value for number of bits to rotate
- */
-uint32_t ROTL(uint32_t value, int shift) {
-    // Wrap the bits around back to the start when shifting
-    return (value << shift) | (value >> (32 - shift));
-}
-
-/**
- * Quarter-Round (QR) function, which adds, rotates, and XORs (ARX) the 4 input words 
- * This is applied to a single row/column of the Salsa20 state
- * Since there are 4 rows/columns in total, a single call to this funciton is a "quarter of a round"
- * Applying it to each row/column, would then be a "round"
- * @param a 32-bit word
- * @param b 32-bit word
- * @param c 32-bit word
- * @param d 32-bit word
- */
-void QR(uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d) {
-    *b = *b ^ ROTL(*a + *d, 7);
-    *c = *c ^ ROTL(*b + *a, 9);
-    *d = *d ^ ROTL(*c + *b, 13);
-    *a = *a ^ ROTL(*d + *c, 18);
-}
-
-/**
- * Odd number round of the Salsa20 cipher
- * Operates on the columns of the Salsa20 state matrix
- * @param state the 4x4 matrix containing the 16 32-bit state values
- */
-void column_round(uint32_t *state) {
-    QR(&state[0],  &state[4],  &state[8],  &state[12]);
-    QR(&state[5],  &state[9],  &state[13], &state[1]);
-    QR(&state[10], &state[14], &state[2],  &state[6]);
-    QR(&state[15], &state[3],  &state[7],  &state[11]);
-}
-
-/**
- * Even number round of the Salsa20 cipher
- * Operates on the rows of the Salsa20 state matrix
- * @param state the 4x4 matrix containing the 16 32-bit state values
- */
-void row_round(uint32_t *state) {
-    QR(&state[0],  &state[1],  &state[2],  &state[3]);
-    QR(&state[5],  &state[6],  &state[7],  &state[4]);
-    QR(&state[10], &state[11], &state[8],  &state[9]);
-    QR(&state[15], &state[12], &state[13], &state[14]);
-}
-
-/**
- * Performs a two rounds (double round) of the Salsa20 cipher
- * The first (odd) round is on the columns, the second (even) round is on the rows
- * @param state the 4x4 matrix containing the 16 32-bit state values
- */
-void double_round(uint32_t *state) {
-    column_round(state);
-    row_round(state);
-}
+#include "arx.h" // The rounds and the multi-block keystream functions, shared with ChaCha
 
 
 /**********************************
@@ -85,7 +20,7 @@ void double_round(uint32_t *state) {
  */
 void salsa20_init(uint32_t *key, uint32_t *nonce, uint32_t *position, uint32_t *state) {
     // Nothing-up-my-sleve number to protect against 0s in the key or nonce
-    uint32_t *constants = (KEY_SIZE_BITS == 256) ? "expand 32-byte k" : "expand 16-byte k";
+    const uint32_t *constants = (KEY_SIZE_BITS == 256) ? ARX_SIGMA : ARX_TAU;
 
     state[0] = constants[0]; // First 32 bits of the constant value
     state[1] = key[0]; // First 32 bits of the key
@@ -116,21 +51,58 @@ void salsa20_init(uint32_t *key, uint32_t *nonce, uint32_t *position, uint32_t *
  * @param keystream OUTPUT the 512-bit (16 32-bit words) output keystream for the given block position
  */
 void salsa20_block(uint32_t *state, uint32_t *keystream) {
-    // Copy the current state to a working variable
-    uint32_t mixed_block[16];
-    for (int i = 0; i < 16; i++) {
-        mixed_block[i] = state[i];
-    }
+    arx_block(&salsa20_core, state, keystream);
+}
 
-    // Perform the actual rounds on the state to mix it up
-    for (int i = 0; i < NUM_ROUNDS / 2; i++) {
-        double_round(mixed_block);
-    }
+/**
+ * Moves the block counter/position in the state forward
+ * The counter is 64 bits split over state[8] (lower 32 bits) and state[9] (upper 32 bits), so it has to carry between them
+ * @param state (IN/OUT) the internal state of the cipher
+ * @param num_blocks how many blocks to move forward by
+ */
+void salsa20_advance(uint32_t *state, uint64_t num_blocks) {
+    arx_advance(&salsa20_core, state, num_blocks); // The counter is in the same place for every number of rounds
+}
 
-    // Set the keystream to the addition of the original state and the recently mixed state
-    for (int i = 0; i < 16; i++) {
-        keystream[i] = mixed_block[i] + state[i];
+/**
+ * Applies the Salsa20 cipher to a given input text, starting at the state's position
+ * @param state (IN/OUT) the internal state of the cipher, its position is moved past every block that is used
+ * @param input the input to apply the cipher to
+ * @param len length of the input/output in BYTES
+ * @param output OUTPUT the output of the cipher (may be the same as input)
+ */
+void salsa20_apply(uint32_t *state, const uint8_t *input, size_t len, uint8_t *output) {
+    arx_apply(&salsa20_core, state, input, len, output);
+}
+
+/**
+ * Applies Salsa20 with any number of rounds to a given input text using the provided key and nonce (this same function does encryption and decryption)
+ * The number of rounds is picked at run time, e.g. Salsa20/12 where speed matters more than the extra safety margin
+ * @param num_rounds the number of rounds (8, 12, or 20)
+ * @param input the input to apply the cipher to, will be the plaintext if doing encryption and be the ciphertext if doing decryption
+ * @param len length of the input/output in BYTES
+ * @param key the 256-bit or 128-bit symmetric key being used for the cipher
+ * @param nonce 64-bit nonce being used for the cipher
+ * @param output OUTPUT the output of the cipher, should be the same size as the input, will be the ciphertext if doing encryption and be the plaintext if doing decryption
+ * @returns 0 on success, or -1 if there is no version of Salsa20 with that number of rounds
+ */
+int salsa(int num_rounds, const uint8_t *input, size_t len,
+          uint32_t *key, uint32_t *nonce,
+          uint8_t *output) {
+    const arx_core *core = arx_select(ARX_SALSA, num_rounds);
+    if (core == NULL) {
+        return -1;
     }
+
+    // Internal variables for the cipher
+    uint32_t state[16]; // The 4x4 matrix holding the variables that define the cipher (mainly the key and nonce, plus a position value for where in the cipher we are, plus constant values to fill the rest)
+    
+    // Expand the key and create the initial state
+    uint32_t position[2] = {0, 0}; // Start at block 0
+    salsa20_init((uint32_t*)key, (uint32_t*)nonce, position, state);
+
+    arx_apply(core, state, input, len, output);
+    return 0;
 }
 
 /**
@@ -144,34 +116,90 @@ void salsa20_block(uint32_t *state, uint32_t *keystream) {
 void salsa20(uint8_t *input, int len, 
              uint32_t *key, uint32_t *nonce, 
              uint8_t *output) {
-    // Internal variables for the cipher
-    uint32_t state[16]; // The 4x4 matrix holding the variables that define the cipher (mainly the key and nonce, plus a position value for where in the cipher we are, plus constant values to fill the rest)
-    uint8_t keystream[64]; // The keystream generated by the cipher use to encrypt/decrypt
-                           // My implementation only keeps track of one block's worth of keystream at a time (512-bit) for simplicity
-                           // However, this could easily be split up where each block's keystream be calculated in parallel
-    
-    // Expand the key and create the initial state
-    uint64_t block_num = 0; // Start at block 0
-    salsa20_init((uint32_t*)key, (uint32_t*)nonce, (uint32_t*)(&block_num), state);
-
-    // Loop through the input message, generate the keystream for the current block, and XOR it with the current input block to get the output
-    // This cipher works in 512-bit (64-byte) blocks, because that is the size of the keystream generated for each block
-    // However, it is still a stream cipher since each bit is encrypted individually, it just so happens that the cipher generates the keystream in chunks/blocks
-    for (int block_pos = 0; block_pos < len; block_pos += 64) { // For each 512-bit (64-byte) block in the input, apply the cipher
-        // Generate the 512-bit keystream for the current block
-        salsa20_block(state, (uint32_t*)keystream);
-
-        // Apply the cipher to the input text
-        for (int i = 0; (i < 64) && ((block_pos + i) < len); i++) { // Apply bits until either the keystream is used up, OR we get to the end of the input
-            output[block_pos + i] = input[block_pos + i] ^ keystream[i];
-        }
-        
-        // Increment the block position counter (which is stored in the state)
-        state[8] = (state[8] + 1) & 0xFFFFFFFF; // Adds 1 to the lower 32 bits of the block number (the "& 0xFFFFFFFF" essential performs a modulo 2^32)
-        if (state[8] == 0) { // Handle overflow
-            state[9] = (state[9] + 1) & 0xFFFFFFFF; // Upper 32 bits of the block number 
-        }
-    }
+    salsa(20, input, len, key, nonce, output);
+}
+
+
+/*********************
+*** EXTENDED NONCE ***
+*********************/
+/*
+ * XSalsa20 takes a 192-bit nonce, which is long enough to pick at random without two messages ever sharing one
+ * HSalsa20 mixes the key with the first 128 bits of the nonce into a subkey, and then Salsa20 runs as usual with the
+ * subkey and the last 64 bits of the nonce
+ */
+
+/**
+ * HSalsa20, which derives a subkey from a key and a 128-bit nonce
+ * It runs the same rounds as a block, but leaves out the final addition of the state, and only gives back the diagonal
+ * (the constants) and the words that held the nonce, which an attacker can not work back from to the key
+ * @param key the 256-bit symmetric key
+ * @param nonce 128-bit (16-byte) nonce
+ * @param subkey OUTPUT the 256-bit subkey (8 32-bit words)
+ */
+void hsalsa20(uint32_t *key, uint32_t *nonce, uint32_t *subkey) {
+    // The nonce fills the words where the nonce and position usually go
+    uint32_t state[16];
+    salsa20_init(key, &nonce[0], &nonce[2], state);
+
+    salsa20_core.permute(state);
+
+    subkey[0] = state[0];
+    subkey[1] = state[5];
+    subkey[2] = state[10];
+    subkey[3] = state[15];
+    memcpy(subkey + 4, &state[6], 16); // The nonce and position words, 6 to 9
+    memset(state, 0, sizeof(state));
+}
+
+/**
+ * Sets up the state for XSalsa20 up to the last 64 bits of the nonce, which is the slow part (an extra block's worth of rounds)
+ * The result only depends on the key and the first 128 bits of the nonce, so it can be kept and reused for every message that shares them
+ * @param key the 256-bit symmetric key
+ * @param nonce_prefix the first 128 bits (16 bytes) of the 192-bit nonce
+ * @param template_state OUTPUT the 16 32-bit words of the state, with the subkey in place and the position and nonce left at 0
+ */
+void xsalsa20_init(uint32_t *key, uint32_t *nonce_prefix, uint32_t *template_state) {
+    uint32_t subkey[8];
+    uint32_t zeros[2] = {0, 0};
+    hsalsa20(key, nonce_prefix, subkey);
+    salsa20_init(subkey, zeros, zeros, template_state);
+    memset(subkey, 0, sizeof(subkey));
+}
+
+/**
+ * Applies XSalsa20 to a given input text, from a state set up by xsalsa20_init
+ * @param input the input to apply the cipher to
+ * @param len length of the input/output in BYTES
+ * @param template_state the state from xsalsa20_init (it is not changed)
+ * @param nonce_suffix the last 64 bits (8 bytes) of the 192-bit nonce
+ * @param output OUTPUT the output of the cipher, should be the same size as the input (may be the same as input)
+ */
+void xsalsa20_apply(const uint8_t *input, size_t len,
+                    const uint32_t *template_state, uint32_t *nonce_suffix,
+                    uint8_t *output) {
+    uint32_t state[16];
+    memcpy(state, template_state, sizeof(state));
+    state[6] = nonce_suffix[0];
+    state[7] = nonce_suffix[1];
+    salsa20_apply(state, input, len, output);
+}
+
+/**
+ * Applies the XSalsa20 cipher to a given input text using the provided key and 192-bit nonce (this same function does encryption and decryption)
+ * @param input the input to apply the cipher to, will be the plaintext if doing encryption and be the ciphertext if doing decryption
+ * @param len length of the input/output in BYTES
+ * @param key the 256-bit symmetric key being used for the cipher
+ * @param nonce 192-bit (24-byte) nonce being used for the cipher, safe to choose at random
+ * @param output OUTPUT the output of the cipher, should be the same size as the input, will be the ciphertext if doing encryption and be the plaintext if doing decryption
+ */
+void xsalsa20(uint8_t *input, int len,
+              uint32_t *key, uint32_t *nonce,
+              uint8_t *output) {
+    uint32_t template_state[16];
+    xsalsa20_init(key, nonce, template_state);
+    xsalsa20_apply(input, len, template_state, &nonce[4], output);
+    memset(template_state, 0, sizeof(template_state));
 }
 
 
@@ -185,7 +213,7 @@ void print_hex(unsigned char *bytes, int len) {
     printf("\n");
 }
 
-int main() {
+int main(int argc, char **argv) {
     // Set test variables for the cipher
     uint8_t key[32] = {
         0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
@@ -224,7 +252,111 @@ int main() {
     if (memcmp(plaintext, decrypted_plaintext, len) != 0) {
         printf("ERROR: Plaintext and decrypted_plaintext are NOT the same!");
     }
-    
+
+    // Sanity check every multi-block function against one block at a time, across the carry into the upper 32 bits of the position,
+    // for every number of rounds
+    uint8_t long_input[64*16];
+    uint8_t expected[64*16];
+    uint8_t actual[64*16];
+    uint32_t start_block[2] = {0xFFFFFFFF - 5, 0};
+    uint32_t state[16];
+    for (int i = 0; i < 64*16; i++) {
+        long_input[i] = i * 7;
+    }
+    salsa20_init((uint32_t*)key, (uint32_t*)nonce, start_block, state);
+    int round_counts[3] = {20, 12, 8};
+    arx_blocks_fn apply_blocks;
+    int num_lanes = 1;
+    for (int r = 0; r < 3; r++) {
+        const arx_core *core = arx_select(ARX_SALSA, round_counts[r]);
+        for (int block = 0; block < 16; block++) {
+            uint32_t block_state[16];
+            uint8_t block_keystream[64];
+            memcpy(block_state, state, sizeof(state));
+            arx_advance(core, block_state, block);
+            arx_block(core, block_state, (uint32_t*)block_keystream);
+            for (int i = 0; i < 64; i++) {
+                expected[64*block + i] = long_input[64*block + i] ^ block_keystream[i];
+            }
+        }
+
+        num_lanes = arx_widest_blocks(core, &apply_blocks);
+        for (int lanes = 4; lanes <= num_lanes; lanes *= 2) {
+            arx_blocks_fn functions[5] = {NULL, core->blocks_x4, core->blocks_x8, NULL, core->blocks_x16};
+            for (int block = 0; block < 16; block += lanes) {
+                uint32_t block_state[16];
+                memcpy(block_state, state, sizeof(state));
+                arx_advance(core, block_state, block);
+                functions[lanes / 4](block_state, long_input + 64*block, actual + 64*block);
+            }
+            if (memcmp(actual, expected, sizeof(expected)) != 0) {
+                printf("ERROR: Salsa20/%d %d block keystream and 1 block keystream are NOT the same!", round_counts[r], lanes);
+            }
+        }
+    }
+    if (salsa(10, long_input, 64, (uint32_t*)key, (uint32_t*)nonce, actual) != -1) {
+        printf("ERROR: Salsa20 with an unsupported number of rounds was NOT rejected!");
+    }
+
+    // Sanity check a length that uses every path (widest kernel, 4 block kernel, single blocks, and a partial block)
+    size_t mixed_len = 64*(num_lanes + 4 + 1) + 9;
+    uint8_t *mixed_input = malloc(mixed_len);
+    uint8_t *mixed_output = malloc(mixed_len);
+    uint32_t mixed_state[16];
+    for (size_t i = 0; i < mixed_len; i++) {
+        mixed_input[i] = i * 3;
+    }
+    memcpy(mixed_state, state, sizeof(state));
+    salsa20_apply(mixed_state, mixed_input, mixed_len, mixed_output);
+    for (size_t block = 0; block * 64 < mixed_len; block++) {
+        uint32_t block_state[16];
+        uint8_t block_keystream[64];
+        memcpy(block_state, state, sizeof(state));
+        salsa20_advance(block_state, block);
+        salsa20_block(block_state, (uint32_t*)block_keystream);
+        for (size_t i = 0; i < 64 && 64*block + i < mixed_len; i++) {
+            if (mixed_output[64*block + i] != (mixed_input[64*block + i] ^ block_keystream[i])) {
+                printf("ERROR: salsa20_apply output is NOT the same as one block at a time!");
+                block = mixed_len; // Only report it once
+                break;
+            }
+        }
+    }
+    free(mixed_input);
+    free(mixed_output);
+
+    // HSalsa20 and XSalsa20 examples from NaCl (tests/core1.c and tests/stream3.c)
+    if (KEY_SIZE_BITS == 256) {
+        uint8_t shared_key[32] = {
+            0x4a, 0x5d, 0x9d, 0x5b, 0xa4, 0xce, 0x2d, 0xe1, 0x72, 0x8e, 0x3b, 0xf4, 0x80, 0x35, 0x0f, 0x25,
+            0xe0, 0x7e, 0x21, 0xc9, 0x47, 0xd1, 0x9e, 0x33, 0x76, 0xf0, 0x9b, 0x3c, 0x1e, 0x16, 0x17, 0x42
+        };
+        uint8_t zero_nonce[16] = {0};
+        uint8_t first_key[32];
+        uint8_t expected_first_key[8] = {0x1b, 0x27, 0x55, 0x64, 0x73, 0xe9, 0x85, 0xd4};
+        hsalsa20((uint32_t*)shared_key, (uint32_t*)zero_nonce, (uint32_t*)first_key);
+        if (memcmp(first_key, expected_first_key, 8) != 0) {
+            printf("ERROR: HSalsa20 subkey is NOT correct!");
+        }
+
+        uint8_t long_nonce[24] = {
+            0x69, 0x69, 0x6e, 0xe9, 0x55, 0xb6, 0x2b, 0x73, 0xcd, 0x62, 0xbd, 0xa8,
+            0x75, 0xfc, 0x73, 0xd6, 0x82, 0x19, 0xe0, 0x03, 0x6b, 0x7a, 0x0b, 0x37
+        };
+        uint8_t zeros[32] = {0};
+        uint8_t x_keystream[32];
+        uint8_t expected_x_keystream[8] = {0xee, 0xa6, 0xa7, 0x25, 0x1c, 0x1e, 0x72, 0x91};
+        xsalsa20(zeros, 32, (uint32_t*)first_key, (uint32_t*)long_nonce, x_keystream);
+        if (memcmp(x_keystream, expected_x_keystream, 8) != 0) {
+            printf("ERROR: XSalsa20 keystream is NOT correct!");
+        }
+    }
+
+    // Compare the speed of one block at a time with each multi-block function the processor has, at 20, 12, and 8 rounds,
+    // when run as "./salsa20 benchmark"
+    if (argc > 1 && strcmp(argv[1], "benchmark") == 0) {
+        benchmark_arx(ARX_SALSA);
+    }
+
     return 0;
 }
-